@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Budget.h"
+#include "Config.h"
+#include "Lowlevel.h"
+#include "SerialMonitor.h"
+
+tBudget Budget = { .limit = 80, .mode = 2 };
+
+// Cost of a single read or write per port type, in CPU cycles
+typedef struct {
+	int (*rfunc)(int);
+	void (*wfunc)(int, int);
+	unsigned long cycles;
+} tPortCost;
+
+static tPortCost PortCosts[] = {
+	{ .rfunc = &port_ana_r, .wfunc = NULL, .cycles = 420 },	// ~5 uS
+	{ .rfunc = &port_dig_r, .wfunc = NULL, .cycles = 100 },
+	// Two I2C transfers at 400 kHz, ~150 uS
+	{ .rfunc = &port_ads1115_r, .wfunc = NULL, .cycles = 12600 },
+	{ .rfunc = NULL, .wfunc = &port_ana_w, .cycles = 500 },
+	{ .rfunc = NULL, .wfunc = &port_dig_w, .cycles = 100 },
+};
+
+#define PORT_COSTS (sizeof(PortCosts) / sizeof(tPortCost))
+
+// Samples measured before they replace the seed
+#define BUDGET_LEARN	16
+
+static tPortCost *port_cost(int p, bool write) {
+	int i;
+
+	for (i = 0; i < PORT_COSTS; i++) {
+		if (write ? PortCosts[i].wfunc == PortList[p].wfunc :
+			    PortCosts[i].rfunc == PortList[p].rfunc)
+			return &PortCosts[i];
+	}
+	return NULL;
+}
+
+static unsigned long read_cost(int p) {
+	tPortCost *c = p > 0 ? port_cost(p, false) : NULL;
+
+	return c ? c->cycles : 0;
+}
+
+static unsigned long write_cost(int p) {
+	tPortCost *c = p > 0 ? port_cost(p, true) : NULL;
+
+	return c ? c->cycles : 0;
+}
+
+// Take what the live configuration has measured. Only plain sources
+// and outputs tell the cost of a single port access.
+static void budget_learn(void) {
+	tPortCost *c;
+	int i;
+
+	for (i = 0; i < Sources->entries; i++) {
+		tSourceEntry *s = &Sources->s[i];
+		unsigned long avg;
+
+		if (s->method != 0 || s->members || s->cost.count < BUDGET_LEARN)
+			continue;
+		c = port_cost(s->p, false);
+		avg = s->cost.total / s->cost.count;
+		if (c)
+			c->cycles = avg > COST_PUSH ? avg - COST_PUSH : 0;
+	}
+
+	for (i = 0; i < Outputs->entries; i++) {
+		tOutputEntry *out = &Outputs->out[i];
+
+		if (out->cost.count < BUDGET_LEARN)
+			continue;
+		c = port_cost(out->p, true);
+		if (c)
+			c->cycles = out->cost.total / out->cost.count;
+	}
+}
+
+// Sources that sample on pin interrupts are not included; their rate
+// is not known in advance.
+void budget_predict(const tSources *s, const tOutputs *o, tLoad *l) {
+	unsigned long long isr, report;
+	unsigned long clock = SystemCoreClock;
+	int i, j;
+
+	l->tick = config_tick(s, o);
+	l->values = 0;
+
+	// Every tick walks both tables
+	isr = (unsigned long long)(COST_TICK + COST_ENTRY *
+		(s->entries + o->entries)) * 1000000 / l->tick;
+
+	for (i = 0; i < s->entries; i++) {
+		const tSourceEntry *e = &s->s[i];
+		unsigned long cost, n = 1;
+
+		if (e->period <= 0 || e->group)
+			continue;
+
+		cost = COST_PUSH + read_cost(e->p);
+		// Members are read by their leader
+		for (j = 0; j < s->entries; j++) {
+			if (s->s[j].group == e->k) {
+				cost += read_cost(s->s[j].p);
+				n++;
+			}
+		}
+		isr += (unsigned long long)cost * 1000000 / e->period;
+		l->values += n * 1000000 / e->period;
+	}
+
+	for (i = 0; i < o->entries; i++) {
+		const tOutputEntry *e = &o->out[i];
+
+		if (e->period <= 0)
+			continue;
+		isr += (unsigned long long)write_cost(e->p) * 1000000 / e->period;
+	}
+
+	report = (unsigned long long)l->values *
+		(stream_mode ? COST_BINARY : COST_TEXT);
+
+	l->isr = isr * 100 / clock;
+	l->report = report * 100 / clock;
+}
+
+// Whether the configuration may be committed. The timer ISR must stay
+// within the limit, and whatever it leaves of the CPU must suffice to
+// report all values, or the queue fills up.
+bool budget_check(const tSources *s, const tOutputs *o) {
+	tLoad l;
+
+	if (!Budget.mode)
+		return true;
+
+	budget_learn();
+	budget_predict(s, o, &l);
+
+	if (l.isr <= Budget.limit && l.isr + l.report <= 100)
+		return true;
+
+	if (Budget.mode == 1) {
+		SerialUSB.print("WARN Predicted overload: ");
+	} else {
+		SerialMonitor_status(E_LOAD);
+		SerialUSB.print("ERROR Configuration rejected, predicted overload: ");
+	}
+	SerialUSB.print("ISR ");
+	SerialUSB.print(l.isr);
+	SerialUSB.print("% reporting ");
+	SerialUSB.print(l.report);
+	SerialUSB.println("%");
+
+	return Budget.mode == 1;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "GPIO_Platform.h"
+#include "Sources.h"
+#include "Outputs.h"
+
+// Admission control: before a configuration is committed, its CPU load
+// is predicted from a cost model, and it is rejected if the device
+// could not keep up with it.
+
+// Seed costs in CPU cycles. The costs of reading and writing ports are
+// in Budget.cpp; all of them are replaced by what the stats command
+// measures once a port type has been used.
+#define COST_TICK	300	// master_handler() itself
+#define COST_ENTRY	20	// Per table entry and tick
+#define COST_PUSH	100	// Queueing a record
+#define COST_TEXT	3400	// Reporting one value as part of a VAL line
+#define COST_BINARY	400	// Reporting one value in the binary stream
+
+typedef struct {
+	int limit;	// Highest load accepted, in percent of the CPU
+	int mode;	// 0 = off, 1 = warn only, 2 = reject
+} tBudget;
+
+extern tBudget Budget;
+
+typedef struct {
+	int tick;		// Timer period, uS
+	unsigned long values;	// Values queued per second
+	int isr;		// Load of the timer ISR, percent
+	int report;		// Load of reporting the values, percent
+} tLoad;
+
+void budget_predict(const tSources *s, const tOutputs *o, tLoad *l);
+bool budget_check(const tSources *s, const tOutputs *o);
+
+#endif
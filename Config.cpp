@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Config.h"
+#include "Sources.h"
+#include "Outputs.h"
+#include "Encoder.h"
+#include "Budget.h"
+
+static bool batch = false;
+
+void config_begin(void) {
+	if (batch) {
+		SerialUSB.println("WARN Discarding uncommitted changes");
+	}
+	sources_begin();
+	outputs_begin();
+	batch = true;
+}
+
+// Publish the shadow tables. Everything that scales with the number of
+// changes happens before interrupts are disabled; the critical section
+// is a couple of fixed-size loops, the pointer swap and at most one
+// timer restart. Returns false if the changes were discarded because
+// the device could not keep up with them.
+bool config_commit(void) {
+	signed char smap[SOURCES_MAX];
+	signed char omap[OUTPUT_SIZE];
+
+	if (!budget_check(SourcesNext, OutputsNext)) {
+		batch = false;
+		return false;
+	}
+
+	sources_prepare(smap);
+	outputs_prepare(omap);
+
+	noInterrupts();
+	sources_swap(smap);
+	outputs_swap(omap);
+	master_period();
+	interrupts();
+
+	sources_finish(smap);
+	outputs_finish(omap);
+	// The binary stream refers to sources by index
+	encoder_reset();
+	batch = false;
+	return true;
+}
+
+void config_abort(void) {
+	batch = false;
+}
+
+bool config_pending(void) {
+	return batch;
+}
+
+void config_edit(void) {
+	if (!batch) {
+		sources_begin();
+		outputs_begin();
+	}
+}
+
+void config_done(void) {
+	if (!batch)
+		config_commit();
+}
+
+static int gcd(int a, int b) {
+	int t;
+	while (b != 0) {
+		t = b;
+		b = a % b;
+		a = t;
+	}
+	return a;
+}
+
+// The timer period needed for these tables, in uS
+int config_tick(const tSources *s, const tOutputs *o) {
+	int i;
+	int tick = 0;
+
+	// Phases have to fall onto a tick as well, or the alignment
+	// would be off by up to a timer period.
+	for (i = 0; i < s->entries; i++) {
+		// Group members are sampled along with their leader
+		if (s->s[i].group)
+			continue;
+		tick = gcd(tick, s->s[i].period);
+		tick = gcd(tick, s->s[i].phase);
+	}
+
+	for (i = 0; i < o->entries; i++) {
+		tick = gcd(tick, o->out[i].period);
+		tick = gcd(tick, o->out[i].phase);
+	}
+
+	// The timer ticks at least every 10s. This must not take part
+	// in the gcd otherwise: with 3000 uS periods, it would tick every
+	// 1000 uS for nothing.
+	if (tick == 0)
+		tick = 10000000;
+	else if (tick > 10000000)
+		tick = gcd(tick, 10000000);
+	return tick;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "GPIO_Platform.h"
+#include "Sources.h"
+#include "Outputs.h"
+
+// Configuration changes are made to shadow copies of the Sources and
+// Outputs tables and published to the ISR in one go. Outside of a
+// begin/commit batch, every single change is committed on its own.
+
+void config_begin(void);
+bool config_commit(void);
+void config_abort(void);
+bool config_pending(void);
+
+// Wrapped around every command that modifies a table
+void config_edit(void);
+void config_done(void);
+
+int config_tick(const tSources *s, const tOutputs *o);
+
+#endif
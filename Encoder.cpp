@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Encoder.h"
+#include "Frame.h"
+#include "Sources.h"
+
+// Record kinds, in the upper nibble of the tag byte. The lower nibble
+// is the source index.
+#define REC_SAMPLE	0x00	// svarint jitter, svarint delta
+#define REC_SAME	0x10	// svarint delta, time of the previous record
+#define REC_RUN		0x20	// varint count of repeats of the last value
+#define REC_PACK	0x30	// two 12 bit values in 3 bytes
+#define REC_KEY		0x40	// key, varint period, varint time, svarint value
+#define REC_ONE		0x50	// key, varint time, svarint value (one-shot)
+
+// Largest possible record (REC_KEY)
+#define REC_MAX		(1 + 1 + 5 + 10 + 10)
+
+// Per source state. last_t and last_v are what the host will have
+// decoded once everything pending has been sent.
+typedef struct {
+	tTime last_t;
+	int last_v;
+	tTime key_t;	// Time of the last keyframe
+	bool keyed;	// Has had a keyframe since the last reset
+	int run;	// Repeats of last_v not sent yet
+	bool packed;	// One sample held back to be packed with the next
+	int pack_v;
+	int pack_dv;
+} tEncoderState;
+
+static tEncoderState Enc[SOURCES_MAX];
+static tFrame Frame;
+static unsigned char Seq;
+static tTime FirstT;	// Time of the oldest data not sent yet
+static bool Pending;
+
+static void encoder_send(void) {
+	if (Frame.len > 0)
+		frame_send(&Frame);
+	Frame.len = 0;
+}
+
+// Make room for n more bytes. Every frame starts with a sequence
+// number, so the host can tell when it has lost one.
+static void encoder_room(int n, tTime t) {
+	if (!frame_room(&Frame, n))
+		encoder_send();
+	if (Frame.len == 0) {
+		frame_begin(&Frame, FRAME_SAMPLES);
+		frame_byte(&Frame, Seq++);
+	}
+	if (!Pending) {
+		FirstT = t;
+		Pending = true;
+	}
+}
+
+// Send whatever is held back for this source
+static void encoder_release(int i) {
+	tEncoderState *e = &Enc[i];
+
+	if (e->run) {
+		encoder_room(REC_MAX, e->last_t);
+		frame_byte(&Frame, REC_RUN | i);
+		frame_varint(&Frame, e->run);
+		e->run = 0;
+	}
+	if (e->packed) {
+		encoder_room(REC_MAX, e->last_t);
+		frame_byte(&Frame, REC_SAMPLE | i);
+		frame_svarint(&Frame, 0);
+		frame_svarint(&Frame, e->pack_dv);
+		e->packed = false;
+	}
+}
+
+static void encoder_key(int i, tTime t, int v) {
+	tSourceEntry *s = &Sources->s[i];
+	tEncoderState *e = &Enc[i];
+
+	frame_byte(&Frame, REC_KEY | i);
+	frame_byte(&Frame, s->k);
+	frame_varint(&Frame, s->period);
+	frame_varint(&Frame, t);
+	frame_svarint(&Frame, v);
+
+	e->keyed = true;
+	e->key_t = t;
+	e->last_t = t;
+	e->last_v = v;
+}
+
+static bool encoder_needs_key(int i, tTime t) {
+	return !Enc[i].keyed || t - Enc[i].key_t >= ENCODER_KEYFRAME;
+}
+
+static void encoder_sample(int i, tTime t, int v) {
+	tEncoderState *e = &Enc[i];
+	long long jitter;
+	int dv;
+
+	if (encoder_needs_key(i, t)) {
+		encoder_release(i);
+		encoder_room(REC_MAX, t);
+		encoder_key(i, t, v);
+		return;
+	}
+
+	jitter = (long long)(t - e->last_t) - Sources->s[i].period;
+	dv = v - e->last_v;
+
+	// On schedule; the host can work out the time by itself
+	if (Sources->s[i].period && jitter == 0) {
+		if (dv == 0 && !e->packed) {
+			e->run++;
+			e->last_t = t;
+			return;
+		}
+
+		// Anything that would need two bytes of delta is cheaper
+		// as half of a packed pair
+		if ((dv < -64 || dv > 63) && v >= 0 && v < 4096) {
+			if (e->packed) {
+				encoder_room(REC_MAX, t);
+				frame_byte(&Frame, REC_PACK | i);
+				frame_byte(&Frame, e->pack_v >> 4);
+				frame_byte(&Frame, ((e->pack_v & 0xf) << 4) | (v >> 8));
+				frame_byte(&Frame, v & 0xff);
+				e->packed = false;
+			} else {
+				encoder_release(i);
+				e->packed = true;
+				e->pack_v = v;
+				e->pack_dv = dv;
+				if (!Pending) {
+					FirstT = t;
+					Pending = true;
+				}
+			}
+			e->last_t = t;
+			e->last_v = v;
+			return;
+		}
+	}
+
+	encoder_release(i);
+	encoder_room(REC_MAX, t);
+	frame_byte(&Frame, REC_SAMPLE | i);
+	frame_svarint(&Frame, jitter);
+	frame_svarint(&Frame, dv);
+	e->last_t = t;
+	e->last_v = v;
+}
+
+// Start over; every source gets a keyframe before its next sample.
+// Needed whenever the source table has been swapped, since records
+// refer to sources by their index.
+void encoder_reset(void) {
+	encoder_flush();
+	memset(Enc, 0, sizeof(Enc));
+}
+
+// Values taken together (a group) share one timestamp. They are never
+// run-length encoded or packed, and always end up in the same frame.
+void encoder_row(tTime t, int n, const int *idx, const int *v) {
+	int j;
+	bool first = true;
+
+	if (n == 1) {
+		if (idx[0] >= 0)
+			encoder_sample(idx[0], t, v[0]);
+		return;
+	}
+
+	for (j = 0; j < n; j++)
+		if (idx[j] >= 0)
+			encoder_release(idx[j]);
+	encoder_room(n * REC_MAX, t);
+
+	for (j = 0; j < n; j++) {
+		int i = idx[j];
+
+		if (i < 0)
+			continue;
+
+		if (first) {
+			if (encoder_needs_key(i, t)) {
+				encoder_key(i, t, v[j]);
+			} else {
+				frame_byte(&Frame, REC_SAMPLE | i);
+				frame_svarint(&Frame, (long long)(t - Enc[i].last_t)
+					- Sources->s[i].period);
+				frame_svarint(&Frame, v[j] - Enc[i].last_v);
+				Enc[i].last_t = t;
+				Enc[i].last_v = v[j];
+			}
+			first = false;
+		} else if (encoder_needs_key(i, t)) {
+			encoder_key(i, t, v[j]);
+		} else {
+			frame_byte(&Frame, REC_SAME | i);
+			frame_svarint(&Frame, v[j] - Enc[i].last_v);
+			Enc[i].last_t = t;
+			Enc[i].last_v = v[j];
+		}
+	}
+}
+
+// A value that doesn't belong to a source, e.g. from the read command
+void encoder_one(tTime t, char k, int v) {
+	encoder_room(REC_MAX, t);
+	frame_byte(&Frame, REC_ONE);
+	frame_byte(&Frame, k);
+	frame_varint(&Frame, t);
+	frame_svarint(&Frame, v);
+	encoder_flush();
+}
+
+// Called from the main loop; sends everything once the oldest pending
+// data is older than ENCODER_LATENCY.
+void encoder_poll(tTime now) {
+	if (Pending && now - FirstT >= ENCODER_LATENCY)
+		encoder_flush();
+}
+
+void encoder_flush(void) {
+	int i;
+
+	for (i = 0; i < SOURCES_MAX; i++)
+		if (Enc[i].run || Enc[i].packed)
+			encoder_release(i);
+
+	encoder_send();
+	Pending = false;
+}
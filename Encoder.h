@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "GPIO_Platform.h"
+
+// Compressed binary encoding of the sample stream, used instead of the
+// VAL lines when the stream mode is set to binary. See README.md for the
+// record format.
+
+// A keyframe for each source at least this often, in uS
+#define ENCODER_KEYFRAME	1000000
+// Longest a sample may be held back before it is sent, in uS
+#define ENCODER_LATENCY		20000
+
+void encoder_reset(void);
+void encoder_row(tTime t, int n, const int *idx, const int *v);
+void encoder_one(tTime t, char k, int v);
+void encoder_poll(tTime now);
+void encoder_flush(void);
+
+#endif
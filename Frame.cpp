@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Frame.h"
+#include "Stats.h"
+#include "Trace.h"
+
+void frame_begin(tFrame *f, unsigned char type) {
+	f->type = type;
+	f->len = 0;
+}
+
+bool frame_room(tFrame *f, int n) {
+	return f->len + n <= FRAME_MAX;
+}
+
+// Callers check frame_room() first; anything beyond is dropped
+void frame_byte(tFrame *f, unsigned char b) {
+	if (f->len < FRAME_MAX)
+		f->buf[f->len++] = b;
+}
+
+// 7 bits per byte, least significant group first; the top bit is set
+// on all but the last byte.
+void frame_varint(tFrame *f, tTime v) {
+	while (v >= 0x80) {
+		frame_byte(f, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	frame_byte(f, v);
+}
+
+// Zig-zag: small negative numbers become small positive ones, so that
+// they still fit into a single byte.
+void frame_svarint(tFrame *f, long long v) {
+	frame_varint(f, ((tTime)v << 1) ^ (tTime)(v >> 63));
+}
+
+// Fletcher-16 over type, len and payload
+static void frame_sum(tFrame *f, unsigned char *sum) {
+	unsigned char hdr[3];
+	unsigned int s1 = 0, s2 = 0;
+	int i;
+
+	hdr[0] = f->type;
+	hdr[1] = f->len & 0xff;
+	hdr[2] = f->len >> 8;
+
+	for (i = 0; i < 3; i++) {
+		s1 = (s1 + hdr[i]) % 255;
+		s2 = (s2 + s1) % 255;
+	}
+	for (i = 0; i < f->len; i++) {
+		s1 = (s1 + f->buf[i]) % 255;
+		s2 = (s2 + s1) % 255;
+	}
+	sum[0] = s1;
+	sum[1] = s2;
+}
+
+void frame_send(tFrame *f) {
+	unsigned char hdr[4];
+	unsigned char sum[2];
+	tTime t = master_time();
+
+	TRACE_BEGIN(TR_FLUSH, f->len);
+	hdr[0] = FRAME_SYNC;
+	hdr[1] = f->type;
+	hdr[2] = f->len & 0xff;
+	hdr[3] = f->len >> 8;
+	frame_sum(f, sum);
+
+	SerialUSB.write(hdr, sizeof(hdr));
+	SerialUSB.write(f->buf, f->len);
+	SerialUSB.write(sum, sizeof(sum));
+	stats_flush(master_time() - t);
+	TRACE_END(TR_FLUSH, f->len);
+}
+
+// Feed the next byte, starting with FRAME_SYNC. Returns 1 once a whole
+// frame with a valid checksum has been received, to be read with the
+// frame_get_*() functions, -1 if it was corrupt and 0 while more bytes
+// are needed.
+int frame_recv(tFrame *f, unsigned char c) {
+	unsigned char sum[2];
+	int n = f->rx++;
+
+	switch (n) {
+	case 0:
+		if (c != FRAME_SYNC) {
+			f->rx = 0;
+			return -1;
+		}
+		return 0;
+	case 1:
+		f->type = c;
+		return 0;
+	case 2:
+		f->len = c;
+		return 0;
+	case 3:
+		f->len |= c << 8;
+		if (f->len > FRAME_MAX) {
+			f->rx = 0;
+			return -1;
+		}
+		return 0;
+	}
+
+	n -= 4;
+	if (n < f->len) {
+		f->buf[n] = c;
+		return 0;
+	}
+	if (n == f->len) {
+		f->sum = c;
+		return 0;
+	}
+
+	f->rx = 0;
+	f->pos = 0;
+	frame_sum(f, sum);
+	if (sum[0] != f->sum || sum[1] != c)
+		return -1;
+	return 1;
+}
+
+bool frame_get_byte(tFrame *f, unsigned char *b) {
+	if (f->pos >= f->len)
+		return false;
+	*b = f->buf[f->pos++];
+	return true;
+}
+
+bool frame_get_varint(tFrame *f, tTime *v) {
+	unsigned char b;
+	int shift = 0;
+
+	*v = 0;
+	do {
+		if (shift > 63 || !frame_get_byte(f, &b))
+			return false;
+		*v |= (tTime)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return true;
+}
+
+bool frame_get_svarint(tFrame *f, long long *v) {
+	tTime u;
+
+	if (!frame_get_varint(f, &u))
+		return false;
+	*v = (long long)(u >> 1) ^ -(long long)(u & 1);
+	return true;
+}
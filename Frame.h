@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "GPIO_Platform.h"
+
+// Binary frames share the serial line with the text output. A frame is
+//
+//	FRAME_SYNC type len(16 bit LE) payload... sum1 sum2
+//
+// where sum1/sum2 are a Fletcher-16 checksum over type, len and payload.
+// Text lines never contain FRAME_SYNC, and a frame is always written in
+// one go, so the host can tell the two apart by the first byte. The host
+// may send frames the same way, mixed with text commands.
+
+#define FRAME_SYNC	0xA5
+#define FRAME_MAX	256	// Payload bytes
+
+// Frame types
+#define FRAME_SAMPLES	0x01
+#define FRAME_COMMAND	0x02	// Host to device, see SerialMonitor.cpp
+#define FRAME_STATUS	0x03	// Reply to FRAME_COMMAND
+#define FRAME_LOG	0x04	// See Log.h
+#define FRAME_STATS	0x05	// Reply to the stats command
+#define FRAME_HIST	0x06	// Reply to the hist command
+#define FRAME_HEARTBEAT	0x07	// Loss counters, see SerialMonitor_heartbeat()
+#define FRAME_TRACE	0x08	// See Trace.h
+#define FRAME_PONG	0x09	// Reply to the ping command
+#define FRAME_CREDIT	0x0a	// Room in the feed of an output, see Outputs.h
+
+typedef struct {
+	unsigned char type;
+	int len;
+	unsigned char buf[FRAME_MAX];
+	int rx;			// Bytes received so far
+	int pos;		// Read position in buf
+	unsigned char sum;	// First checksum byte received
+} tFrame;
+
+void frame_begin(tFrame *f, unsigned char type);
+bool frame_room(tFrame *f, int n);
+void frame_byte(tFrame *f, unsigned char b);
+void frame_varint(tFrame *f, tTime v);
+void frame_svarint(tFrame *f, long long v);
+void frame_send(tFrame *f);
+
+// Receiving, one byte at a time
+int frame_recv(tFrame *f, unsigned char c);
+bool frame_get_byte(tFrame *f, unsigned char *b);
+bool frame_get_varint(tFrame *f, tTime *v);
+bool frame_get_svarint(tFrame *f, long long *v);
+
+#endif
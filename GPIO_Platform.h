@@ -25,18 +25,29 @@
  Global timer handling
  ****************************************************************************/
 
+// Device time in uS since boot. 64 bit, so it never wraps.
+typedef unsigned long long tTime;
+
 typedef struct {
 	unsigned long period; // Global timer period
+	tTime now;	// Time of the current timer tick
 	bool started;
+	bool armed;	// Waiting for an external edge to start
+	int arm_irq;
 } tMaster;
 
 // Functions from the main sketch that other modules need to use -
 // especially the command module:
 extern int debug;
+extern int stream_mode;	// 0 = text, 1 = compressed binary
 
 extern tMaster Master;
 
 void master_period(void);
+void master_start(void);
+void master_arm(int irq, int trigger);
+void master_disarm(void);
+tTime master_time(void);
 
 #endif
 
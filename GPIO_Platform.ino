@@ -19,6 +19,7 @@
 #include <DueTimer.h>
 #include <Wire.h>
 #include <ADS1115.h>
+#include <DueFlashStorage.h>
 #include <Arduino.h>
 
 #include "GPIO_Platform.h"
@@ -27,6 +28,12 @@
 #include "Outputs.h"
 #include "SerialMonitor.h"
 #include "Lowlevel.h"
+#include "Encoder.h"
+#include "Config.h"
+#include "Log.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Store.h"
 
 /////////////////////////////////////////////////////////////////////////////
 // Set to 1 for having all functions log what they do
@@ -34,56 +41,126 @@
 
 int debug = 1;
 
+// How values are reported: 0 = VAL lines, 1 = binary frames
+int stream_mode = 0;
+
 tMaster Master;
 
 ///////////////////////////////////////////////////////////////////////
 
-static int gcd(int a, int b) {
-	int t;
-	while (b != 0) {
-		t = b;
-		b = a % b;
-		a = t;
-	}
-	return a;
-}
-
 // To be called while interrupts are disabled
 void master_period(void) {
-	int i;
-	int new_period;
-
-	// We default to ticking the timer at least every 10s
-	new_period = 10000000;
-
-	for (i = 0; i < Sources.entries; i++)
-		new_period = gcd(new_period, Sources.s[i].period);
-
-	for (i = 0; i < Outputs.entries; i++)
-		new_period = gcd(new_period, Outputs.out[i].period);
+	int new_period = config_tick(Sources, Outputs);
 
 	if (new_period != Master.period) {
 		Timer1.stop();
 		Master.period = new_period;
 		Timer1.setPeriod(Master.period);
 
-		if (debug) {
-			SerialUSB.print("DEBUG Timer period adjusted to ");
-			SerialUSB.println(Master.period);
-		}
-		if (new_period < 50) {
-			SerialUSB.print("WARN Timer period very short: ");
-			SerialUSB.println(Master.period);
-		}
+		LOG_DEBUG(LOG_PERIOD, new_period);
+		if (new_period < 50)
+			LOG_WARN(LOG_PERIOD_SHORT, new_period);
+
+		// Only restart the timer if we really had to stop it;
+		// otherwise the current tick would be cut short.
+		if (Master.started)
+			master_start();
 	}
+}
+
+// micros() wraps every ~71 minutes; this extends it to 64 bit. It has
+// to be called more often than that, which loop() takes care of. Safe
+// to call from interrupt context.
+tTime master_time(void) {
+	static unsigned long hi = 0, last = 0;
+	uint32_t primask = __get_PRIMASK();
+	unsigned long now;
+	tTime t;
+
+	noInterrupts();
+	now = micros();
+	if (now < last)
+		hi++;
+	last = now;
+	t = ((tTime)hi << 32) | now;
+	if (!primask)
+		interrupts();
+
+	return t;
+}
 
-	if (Master.started)
-		Timer1.start();
+// The timestamps of scheduled samples are counted along with the
+// timer ticks, starting from here; there is no need to read the clock
+// for every sample.
+void master_start(void) {
+	Timer1.stop();
+	Master.now = master_time();
+	Master.started = true;
+	Timer1.start();
 }
 
+// HistLate only samples every that many ticks, to keep the clock read
+// out of most of them
+#define LATE_EVERY	16
+
 static void master_handler() {
+	static unsigned int tick;
+	unsigned long c0 = stats_cycles();
+	unsigned long c1, c2;
+
+	TRACE_BEGIN(TR_TICK, 0);
+	Master.now += Master.period;
+	if (++tick >= LATE_EVERY) {
+		tTime now = master_time();
+
+		tick = 0;
+		hist_add(&HistLate, now > Master.now ? now - Master.now : 0);
+	}
 	sources_poll();
+	c1 = stats_cycles();
 	outputs_push();
+	c2 = stats_cycles();
+
+	stats_add(&Stats[STATS_POLL], c1 - c0);
+	stats_add(&Stats[STATS_PUSH], c2 - c1);
+	stats_add(&Stats[STATS_HANDLER], c2 - c0);
+	TRACE_END(TR_TICK, 0);
+}
+
+static void master_trigger() {
+	detachInterrupt(Master.arm_irq);
+	Master.armed = false;
+	master_start();
+}
+
+// Restart all sources and outputs from a common epoch. With irq < 0,
+// the epoch is now; otherwise it is the next edge on that pin.
+void master_arm(int irq, int trigger) {
+	master_disarm();
+
+	noInterrupts();
+	Timer1.stop();
+	Master.started = false;
+	sources_rewind();
+	outputs_rewind();
+
+	if (irq < 0) {
+		master_start();
+	} else {
+		Master.armed = true;
+		Master.arm_irq = irq;
+		attachInterrupt(irq, master_trigger, trigger);
+	}
+	interrupts();
+}
+
+void master_disarm(void) {
+	noInterrupts();
+	if (Master.armed) {
+		detachInterrupt(Master.arm_irq);
+		Master.armed = false;
+	}
+	interrupts();
 }
 
 /****************************************************************************
@@ -122,11 +199,17 @@ void setup(){
 	analogReadResolution(12);
 	analogWriteResolution(12);
 
+	stats_setup();
+
 	if (debug > 1) {
 		delay(1000);
 		SerialUSB.println("Attaching timer");
 	}
 	Timer1.attachInterrupt(master_handler);
+
+	// Pick up where we were before the reset, without the host
+	store_load();
+
 	if (debug > 1) {
 		delay(1000);
 		SerialUSB.println("At your service (hopefully).");
@@ -134,8 +217,22 @@ void setup(){
 }
 
 void loop(){
+	unsigned long c;
+	// Keep the 64 bit clock ticking even if nothing else reads it
+	tTime now = master_time();
+
 	SerialMonitor_poll();
 
+	c = stats_cycles();
 	sources_process();
+	stats_add(&Stats[STATS_PROCESS], stats_cycles() - c);
+
+	if (stream_mode)
+		encoder_poll(now);
+
+	log_poll();
+	outputs_poll(now);
+
+	SerialMonitor_heartbeat(now);
 }
 
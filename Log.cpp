@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Log.h"
+#include "Frame.h"
+#include "SerialMonitor.h"
+
+#define X(name, level, fmt) { level, fmt },
+static const struct {
+	unsigned char level;
+	const char *fmt;
+} LogEvents[] = { LOG_EVENTS };
+#undef X
+
+static tLogEntry Log[LOG_SIZE];
+static volatile int head = 0, tail = 0;
+static volatile unsigned int lost = 0;
+static unsigned long lost_total = 0;
+
+static tFrame Frame;
+
+// Safe to call from interrupt context
+void log_event(unsigned char id, int n, const int *arg) {
+	uint32_t primask = __get_PRIMASK();
+	tLogEntry *e;
+	int i;
+
+	if (n > LOG_ARGS)
+		n = LOG_ARGS;
+
+	noInterrupts();
+	if ((head + 1) % LOG_SIZE == tail) {
+		lost++;
+	} else {
+		e = &Log[head];
+		e->t = master_time();
+		e->id = id;
+		e->n = n;
+		for (i = 0; i < n; i++)
+			e->arg[i] = arg[i];
+		head = (head + 1) % LOG_SIZE;
+	}
+	if (!primask)
+		interrupts();
+}
+
+// Format on the device, for the text mode
+static void log_print(const tLogEntry *e) {
+	const char *f;
+	int i = 0;
+
+	switch (LogEvents[e->id].level) {
+	case LOG_LEVEL_CRIT: SerialUSB.print("CRITICAL ");
+			     break;
+	case LOG_LEVEL_WARN: SerialUSB.print("WARN ");
+			     break;
+	default:	     SerialUSB.print("DEBUG ");
+	}
+
+	for (f = LogEvents[e->id].fmt; *f; f++) {
+		if (f[0] == '%' && f[1] == 'd') {
+			SerialUSB.print(i < e->n ? e->arg[i++] : 0);
+			f++;
+		} else {
+			SerialUSB.print(*f);
+		}
+	}
+	SerialUSB.println("");
+}
+
+// Each record is: id, varint time, count, svarint args...
+static void log_frame(const tLogEntry *e) {
+	int i;
+
+	if (!frame_room(&Frame, 2 + 10 + 5 * LOG_ARGS)) {
+		frame_send(&Frame);
+		frame_begin(&Frame, FRAME_LOG);
+	}
+	frame_byte(&Frame, e->id);
+	frame_varint(&Frame, e->t);
+	frame_byte(&Frame, e->n);
+	for (i = 0; i < e->n; i++)
+		frame_svarint(&Frame, e->arg[i]);
+}
+
+static void log_send(const tLogEntry *e) {
+	if (stream_mode)
+		log_frame(e);
+	else
+		log_print(e);
+}
+
+// Send what has been recorded, from loop()
+void log_poll(void) {
+	tLogEntry e;
+
+	if (head == tail && !lost)
+		return;
+
+	frame_begin(&Frame, FRAME_LOG);
+
+	noInterrupts();
+	e.n = 0;
+	if (lost) {
+		e.t = master_time();
+		e.id = LOG_LOST;
+		e.n = 1;
+		e.arg[0] = lost;
+		lost_total += lost;
+		lost = 0;
+	}
+	interrupts();
+	if (e.n)
+		log_send(&e);
+
+	while (head != tail) {
+		noInterrupts();
+		e = Log[tail];
+		tail = (tail + 1) % LOG_SIZE;
+		interrupts();
+		log_send(&e);
+	}
+
+	if (stream_mode && Frame.len)
+		frame_send(&Frame);
+}
+
+// Events lost since boot, as far as reported yet
+unsigned long log_lost(void) {
+	return lost_total;
+}
+
+void log_reset(void) {
+	noInterrupts();
+	head = tail = 0;
+	lost = 0;
+	interrupts();
+}
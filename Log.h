@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include "GPIO_Platform.h"
+
+// Deferred logging: an event is recorded as its id and up to LOG_ARGS
+// integers, which is cheap and safe from interrupt context. loop()
+// sends them later, as text or, in binary stream mode, as FRAME_LOG
+// frames for the host to format (see host/logdecode.py).
+
+#define LOG_LEVEL_CRIT	1
+#define LOG_LEVEL_WARN	2
+#define LOG_LEVEL_DEBUG	3
+
+// Events above this level are compiled out entirely
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// All events: name, level and format. The id sent is the position in
+// this list, so only ever append to it. Formats only know %d.
+#define LOG_EVENTS \
+	X(LOG_LOST, LOG_LEVEL_WARN, "%d log events lost") \
+	X(LOG_PERIOD, LOG_LEVEL_DEBUG, "Timer period adjusted to %d") \
+	X(LOG_PERIOD_SHORT, LOG_LEVEL_WARN, "Timer period very short: %d") \
+	X(LOG_WRITE_INDEX, LOG_LEVEL_CRIT, "Write to unknown index %d") \
+	X(LOG_READ_INDEX, LOG_LEVEL_CRIT, "Read from unknown index %d") \
+	X(LOG_RB_OVERFLOW, LOG_LEVEL_WARN, "Ring buffer full, %d records lost")
+
+#define X(name, level, fmt) name,
+enum { LOG_EVENTS LOG_EVENT_COUNT };
+#undef X
+
+#define LOG_SIZE	32	// Events waiting to be sent
+#define LOG_ARGS	3
+
+typedef struct {
+	tTime t;
+	unsigned char id;
+	unsigned char n;
+	int arg[LOG_ARGS];
+} tLogEntry;
+
+void log_event(unsigned char id, int n, const int *arg);
+void log_poll(void);
+void log_reset(void);
+unsigned long log_lost(void);
+
+#define LOG_AT(id, ...) do { \
+		int _a[] = { 0, ##__VA_ARGS__ }; \
+		log_event(id, sizeof(_a) / sizeof(int) - 1, &_a[1]); \
+	} while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_CRIT
+#define LOG_CRIT(id, ...) LOG_AT(id, ##__VA_ARGS__)
+#else
+#define LOG_CRIT(id, ...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(id, ...) LOG_AT(id, ##__VA_ARGS__)
+#else
+#define LOG_WARN(id, ...) do { } while (0)
+#endif
+
+// Debug events are also subject to the debug command
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(id, ...) do { \
+		if (debug) \
+			LOG_AT(id, ##__VA_ARGS__); \
+	} while (0)
+#else
+#define LOG_DEBUG(id, ...) do { } while (0)
+#endif
+
+#endif
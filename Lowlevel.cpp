@@ -18,6 +18,7 @@
 
 #include "GPIO_Platform.h"
 #include "Lowlevel.h"
+#include "SerialMonitor.h"
 #include <ADS1115.h>
 
 // Lookup a port in the table, returns the index entry
@@ -44,7 +45,9 @@ void port_write(char *portname, int v) {
 
 	i = port_lookup(portname);
 	if (i < 0) {
-		SerialUSB.println("Unknown port specified.");
+		SerialMonitor_status(E_PORT);
+		SerialUSB.println("ERROR Unknown port specified.");
+		return;
 	}
 	_port_write(i, v);
 }
@@ -53,12 +56,83 @@ int port_read(char *portname) {
 	int i;
 	i = port_lookup(portname);
 	if (i < 0) {
+		SerialMonitor_status(E_PORT);
 		SerialUSB.println("ERROR Unknown port specified.");
 		return -1;
 	}
 	return _port_read(i);
 }
 
+unsigned char PinModes[DAC_MAX + 1];
+
+// mode as for the pin command: 0 = INPUT, 1 = INPUT_PULLUP, 2 = OUTPUT
+bool port_mode(int p, int mode) {
+	static const int modes[] = { INPUT, INPUT_PULLUP, OUTPUT };
+
+	if (!PIN_OK(p) || mode < 0 || mode > 2)
+		return false;
+	pinMode(p, modes[mode]);
+	PinModes[p] = mode + 1;
+	return true;
+}
+
+// idx are PortList indexes of digital pins, all on the same controller.
+// Leaves b alone if they are not. Only works out the mapping; nothing
+// is done to the pins until bus_enable().
+bool bus_setup(tBus *b, const int *idx, int n) {
+	tBus bus;
+	int i, j;
+
+	if (n < 1 || n > BUS_MAX)
+		return false;
+
+	memset(&bus, 0, sizeof(bus));
+	bus.n = n;
+	for (i = 0; i < n; i++) {
+		int p = idx[i] > 0 ? PortList[idx[i]].p : -1;
+		uint32_t m;
+
+		if (p < 0 || p > DIGITAL_MAX || !PortList[idx[i]].wfunc)
+			return false;
+		m = g_APinDescription[p].ulPin;
+		if (i == 0)
+			bus.pio = g_APinDescription[p].pPort;
+		else if (g_APinDescription[p].pPort != bus.pio)
+			return false;
+		if (bus.mask & m)
+			return false;
+		bus.mask |= m;
+		for (j = 0; !(m & (1UL << j)); j++)
+			;
+		bus.bit[i] = j;
+		bus.idx[i] = idx[i];
+	}
+
+	// Pins on consecutive bits, in order, only need a shift
+	bus.shift = bus.bit[0];
+	for (i = 1; i < n; i++)
+		if (bus.bit[i] != bus.bit[0] + i)
+			bus.shift = -1;
+
+	memcpy(b, &bus, sizeof(bus));
+	return true;
+}
+
+// Switch the pins of a bus to output, and let PIO_ODSR writes through
+// to them. Once the bus output is live.
+void bus_enable(const tBus *b) {
+	int i;
+
+	for (i = 0; i < b->n; i++)
+		port_mode(PortList[b->idx[i]].p, 2);
+	b->pio->PIO_OWER = b->mask;
+}
+
+// The pins keep their level and mode, but no longer follow PIO_ODSR
+void bus_disable(const tBus *b) {
+	b->pio->PIO_OWDR = b->mask;
+}
+
 // Why does he not just directly use these functions you ask, why the
 // function pointer indirection? Because there'll be more complex
 // read/write functions, e.g. for servos, I²C devices, etc.
@@ -111,6 +185,6 @@ int port_ads1115_r(int p) {
 		break;
 	default: SerialUSB.println("ERROR Unknown port for ADS1115 on default address");
 	}
-
+	return 0;
 }
 
@@ -18,6 +18,8 @@
 
 #ifndef LOWLEVELH
 #define LOWLEVELH
+
+#include "Log.h"
 /////////////////////////////////////////////////////////////////////////////
 // PWM ports should always be driven using analogWrite
 #define PWM_MIN 2
@@ -50,6 +52,10 @@ void port_dig_w(int p, int v);
 
 int port_ads1115_r(int p);
 
+// Mode set with the pin command, plus one; 0 if it never was
+extern unsigned char PinModes[DAC_MAX + 1];
+bool port_mode(int p, int mode);
+
 typedef struct {
 	const char *name;	// user-readable name
 	int p;			// Numeric port id
@@ -144,21 +150,56 @@ int port_read(char *portname);
 int port_name2id(char *name);
 int port_lookup(char *name);
 
+// Up to 32 digital pins of one PIO controller, written as one word: bit
+// i of the value goes to pin i. They all change with a single store,
+// instead of one digitalWrite() after the other.
+#define BUS_MAX 32
+
+typedef struct {
+	unsigned char n;	// Pins, 0 if not a bus
+	signed char shift;	// Pin i is bit i + shift on pio, or -1
+	Pio *pio;
+	uint32_t mask;		// All pins on pio
+	unsigned char bit[BUS_MAX];	// Of pin i on pio
+	unsigned char idx[BUS_MAX];	// PortList index of pin i
+} tBus;
+
+bool bus_setup(tBus *b, const int *idx, int n);
+void bus_enable(const tBus *b);
+void bus_disable(const tBus *b);
+
 
 // Be careful with these.
 inline void _port_write(int i, int v) {
 	// TODO: remove debug code
 	if (!PortList[i].wfunc) {
-		SerialUSB.println("CRITICAL Write to unknown index");
+		LOG_CRIT(LOG_WRITE_INDEX, i);
 		return;
 	}
 	PortList[i].wfunc(PortList[i].p, v);
 }
 
+// PIO_ODSR only takes the bits enabled in PIO_OWSR, which are those
+// of buses; the other buses on the controller are written back as they
+// were. Only from the timer interrupt.
+inline void _bus_write(const tBus *b, uint32_t v) {
+	uint32_t bits = 0;
+	int i;
+
+	if (b->shift >= 0) {
+		bits = (v << b->shift) & b->mask;
+	} else {
+		for (i = 0; i < b->n; i++)
+			if (v & (1UL << i))
+				bits |= 1UL << b->bit[i];
+	}
+	b->pio->PIO_ODSR = (b->pio->PIO_ODSR & ~b->mask) | bits;
+}
+
 inline int _port_read(int i) {
 	// TODO: remove debug code to speed things up
 	if (!PortList[i].rfunc) {
-		SerialUSB.println("CRITICAL Read from unknown index");
+		LOG_CRIT(LOG_READ_INDEX, i);
 		return 0;
 	}
 	return PortList[i].rfunc(PortList[i].p);
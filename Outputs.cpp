@@ -20,8 +20,12 @@
 #include "Outputs.h"
 #include "RingBuf.h"
 #include "Lowlevel.h"
+#include "SerialMonitor.h"
+#include "Sources.h"
 
-tOutputs Outputs;
+static tOutputs _outputs[2];
+tOutputs *Outputs = &_outputs[0];
+tOutputs *OutputsNext = &_outputs[1];
 
 // Putting the arrays into the Patterns array directly would require *v
 // to have a static size, which I don't want to avoid wasting memory.
@@ -35,10 +39,17 @@ tPattern Patterns[] = {
 	{ .name = "flip", .len = 2, .v = _p_Flip },
 	{ .name = "inc", .len = 4096, .v = _p_Increment },
 	{ .name = "sine", .len = 4096, .v = _p_Sine },
+	// Not a table: the values come from the host, see output_feed()
+	{ .name = "feed", .len = 0, .v = NULL },
 };
 
 const int PatternCount = sizeof(Patterns)/sizeof(tPattern);
 
+static tFeed _feeds[FEED_MAX];
+
+// 2^(i/256) in 16.16, for log sweeps
+static uint32_t _exp2[257];
+
 // Some patterns are pre-computed. Fill those in here.
 static void pattern_setup() {
 	int i;
@@ -50,89 +61,176 @@ static void pattern_setup() {
 	for (i = 0; i < 4096; i++) {
 		_p_Sine[i] = (sin(2.0 * PI * i / 4095) + 1) * 2047;
 	}
+
+	for (i = 0; i <= 256; i++) {
+		_exp2[i] = pow(2.0, i / 256.0) * 65536 + 0.5;
+	}
+}
+
+static inline void output_write(const tOutputEntry *out, int v) {
+	if (out->bus.n)
+		_bus_write(&out->bus, v);
+	else if (out->p)
+		_port_write(out->p, v);
+}
+
+// The value an output was set to last
+static int output_value(const tOutputEntry *out) {
+	if (out->feed)
+		return out->feed->last;
+	return out->v->v[out->last_step];
 }
 
-// Called with interrupts disabled only
+// Called with interrupts disabled only. A feed keeps what it has
+// buffered, it starts over with the next sample. Sweeps start over.
 static void output_reset(int i) {
-	tOutputEntry *out = &Outputs.out[i];
+	tOutputEntry *out = &Outputs->out[i];
+	int j;
 
 	out->last_step = out->offset;
-	out->countdown = out->period;
+	out->countdown = out->period + out->phase;
+	if (out->step < 0)
+		out->step = -out->step;
+	out->frac = 0;
+	for (j = 0; j < 2; j++) {
+		out->mod[j].pos = 0;
+		out->mod[j].down = false;
+		out->mod[j].done = false;
+	}
+
+	output_write(out, output_value(out));
+}
+
+// A feed no output in either table refers to. Outputs deleted from
+// the live table are only gone once the change is committed.
+static tFeed *feed_alloc(void) {
+	int i, j;
+
+	for (j = 0; j < FEED_MAX; j++) {
+		tFeed *f = &_feeds[j];
+
+		for (i = 0; i < Outputs->entries; i++)
+			if (Outputs->out[i].feed == f)
+				break;
+		if (i < Outputs->entries)
+			continue;
+		for (i = 0; i < OutputsNext->entries; i++)
+			if (OutputsNext->out[i].feed == f)
+				break;
+		if (i < OutputsNext->entries)
+			continue;
+
+		memset(f, 0, sizeof(tFeed));
+		return f;
+	}
+	return NULL;
+}
+
+// The feed of output k, live or still waiting for a commit
+static tOutputEntry *feed_lookup(const char k) {
+	int i;
 
-	_port_write(out->p, out->v->v[out->last_step]);
+	for (i = 0; i < Outputs->entries; i++)
+		if (Outputs->out[i].k == k && Outputs->out[i].feed)
+			return &Outputs->out[i];
+	for (i = 0; i < OutputsNext->entries; i++)
+		if (OutputsNext->out[i].k == k && OutputsNext->out[i].feed)
+			return &OutputsNext->out[i];
+	return NULL;
 }
 
 void output_del(const char k) {
 	int i;
-	tOutputEntry *out, *last;
+	tOutputEntry *out = NULL, *last;
 
-	for (i = 0; i < Outputs.entries; i++) {
-		out = &Outputs.out[i];
+	for (i = 0; i < OutputsNext->entries; i++) {
+		out = &OutputsNext->out[i];
 		if (out->k == k)
 			break;
 	}
-	if (i == Outputs.entries) {
+	if (i == OutputsNext->entries) {
+		SerialMonitor_status(E_NOKEY);
 		SerialUSB.print("ERROR Unknown output referenced: ");
 		SerialUSB.println(k);
 		return;
 	}
 
-	last = &Outputs.out[Outputs.entries-1];
-	noInterrupts();
+	last = &OutputsNext->out[OutputsNext->entries-1];
 	if (last != out)
 		memcpy(out, last, sizeof(tOutputEntry));
 	memset(last, 0, sizeof(tOutputEntry));
-	Outputs.entries--;
-
-	master_period();
+	OutputsNext->entries--;
+}
 
+void outputs_reset(void) {
+	noInterrupts();
+	outputs_rewind();
 	interrupts();
 }
 
-void outputs_reset(void) {
+// Like outputs_reset(), but for an armed start: the ports are set to
+// their offset now, the first step follows at start + phase + period.
+// Only with interrupts disabled!
+void outputs_rewind(void) {
 	int i;
 
-	for (i = 0; i < Outputs.entries; i++) {
+	for (i = 0; i < Outputs->entries; i++) {
 		output_reset(i);
 	}
 }
 
 void outputs_setup(void) {
-	memset(&Outputs, 0, sizeof(tOutputs));
+	noInterrupts();
+	memset(_outputs, 0, sizeof(_outputs));
+	memset(_feeds, 0, sizeof(_feeds));
+	Outputs = &_outputs[0];
+	OutputsNext = &_outputs[1];
+	interrupts();
 	pattern_setup();
 }
 
-void output_add(const char k, char *portname, const int period, const int step, const int offset, const int mode, const char *name) {
+void output_add(const char k, char *portname, const int period, const int step, const int offset, const int mode, const char *name, const int phase) {
 	int i;
 	tOutputEntry *out;
 
-	for (i = 0; i < Outputs.entries; i++) {
-		if (out->k == k) {
+	for (i = 0; i < OutputsNext->entries; i++) {
+		if (OutputsNext->out[i].k == k) {
+			SerialMonitor_status(E_EXISTS);
 			SerialUSB.println("ERROR Output key already in use.");
 			return;
 		}
 	}
 
-	for (i = 0; i <= PatternCount; i++) {
+	for (i = 0; i < PatternCount; i++) {
 		if (strcmp(Patterns[i].name, name) == 0)
 			break;
 	}
-	if (i > PatternCount) {
+	if (i == PatternCount) {
+		SerialMonitor_status(E_NOKEY);
 		SerialUSB.print("ERROR Unknown pattern referenced: ");
 		SerialUSB.println(name);
 		return;
 	}
 
-	if (Outputs.entries == OUTPUT_SIZE) {
+	if (OutputsNext->entries == OUTPUT_SIZE) {
+		SerialMonitor_status(E_FULL);
 		SerialUSB.println("ERROR Too many output patterns requested");
 		return;
 	}
+	if (phase < 0) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Phase must not be negative");
+		return;
+	}
 	
 
-	out = &Outputs.out[Outputs.entries];
+	out = &OutputsNext->out[OutputsNext->entries];
+	memset(out, 0, sizeof(tOutputEntry));
 	out->k = k;
+	// Port "none" makes an output that only modulates others
 	out->p = port_lookup(portname);
-	if (out->p < 1 || !PortList[out->p].wfunc) {
+	if (out->p < 0 || (out->p > 0 && !PortList[out->p].wfunc)) {
+		SerialMonitor_status(E_PORT);
 		SerialUSB.println("ERROR Invalid port for output");
 		return;
 	}
@@ -141,29 +239,425 @@ void output_add(const char k, char *portname, const int period, const int step,
 	out->offset = offset;
 	out->mode = mode;
 	out->v = &Patterns[i];
+	if (!Patterns[i].v) {
+		out->feed = feed_alloc();
+		if (!out->feed) {
+			SerialMonitor_status(E_FULL);
+			SerialUSB.println("ERROR Too many fed outputs");
+			return;
+		}
+		out->offset = 0;
+	}
+	out->phase = phase;
+	out->last_step = offset;
+	out->countdown = period + phase;
+	out->fresh = true;
 
-	noInterrupts();
-	output_reset(Outputs.entries);
-	Outputs.entries++;
-	master_period();
-	interrupts();
+	OutputsNext->entries++;
 }
 
-void outputs_push(void) {
+// Like output_add(), but the values go to a bus of the pins with these
+// PortList indexes, bit 0 to the first
+void output_bus(const char k, const int *idx, const int n, const int period, const int step, const int offset, const int mode, const char *name, const int phase) {
+	int entries = OutputsNext->entries;
+	tBus bus;
+
+	if (!bus_setup(&bus, idx, n)) {
+		SerialMonitor_status(E_PORT);
+		SerialUSB.println("ERROR Bus pins must be digital pins of one PIO controller");
+		return;
+	}
+	// Fed values are 16 bit wide
+	if (n > 16 && strcmp(name, "feed") == 0) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Fed buses have at most 16 pins");
+		return;
+	}
+	output_add(k, (char *)PortList[idx[0]].name, period, step, offset,
+		mode, name, phase);
+	if (OutputsNext->entries > entries)
+		memcpy(&OutputsNext->out[entries].bus, &bus, sizeof(tBus));
+}
+
+void outputs_begin(void) {
+	memcpy(OutputsNext, Outputs, sizeof(tOutputs));
+}
+
+// Where the modulators are in the tables about to go live
+static void mods_resolve(void) {
+	int i, j, n;
+
+	for (i = 0; i < OutputsNext->entries; i++) {
+		for (j = 0; j < 2; j++) {
+			tMod *m = &OutputsNext->out[i].mod[j];
+
+			m->idx = -1;
+			if (m->shape == MOD_OUTPUT) {
+				for (n = 0; n < OutputsNext->entries; n++)
+					if (OutputsNext->out[n].k == m->src)
+						m->idx = n;
+			} else if (m->shape == MOD_SOURCE) {
+				for (n = 0; n < SourcesNext->entries; n++)
+					if (SourcesNext->s[n].k == m->src)
+						m->idx = n;
+			}
+		}
+	}
+}
+
+// map[live index] = shadow index of the same output, -1 if it is gone
+void outputs_prepare(signed char *map) {
+	int i, j;
+
+	mods_resolve();
+
+	for (j = 0; j < Outputs->entries; j++) {
+		map[j] = -1;
+		for (i = 0; i < OutputsNext->entries; i++) {
+			tOutputEntry *out = &OutputsNext->out[i];
+
+			if (out->k == Outputs->out[j].k && !out->fresh) {
+				map[j] = i;
+				break;
+			}
+		}
+	}
+}
+
+// Only to be called with interrupts disabled!
+void outputs_swap(const signed char *map) {
+	tOutputs *old = Outputs;
+	int i, j;
+
+	for (j = 0; j < old->entries; j++) {
+		tOutputEntry *o = &old->out[j];
+		tOutputEntry *out;
+
+		if (map[j] < 0)
+			continue;
+		// The ISR flips the step direction in mode 1
+		out = &OutputsNext->out[map[j]];
+		out->countdown = o->countdown;
+		out->last_step = o->last_step;
+		out->step = o->step;
+		out->cost = o->cost;
+		out->frac = o->frac;
+		// Sweeps go on, unless output_mod() changed them
+		for (i = 0; i < 2; i++) {
+			tMod *m = &out->mod[i];
+
+			if (m->gen != o->mod[i].gen)
+				continue;
+			m->pos = o->mod[i].pos;
+			m->down = o->mod[i].down;
+			m->done = o->mod[i].done;
+			m->value = o->mod[i].value;
+		}
+	}
+
+	Outputs = OutputsNext;
+	OutputsNext = old;
+}
+
+// New outputs start at their offset right away, not on the first tick.
+// Buses are only claimed now, and given up once they are gone from the
+// live table; OutputsNext holds the previous one at this point.
+void outputs_finish(const signed char *map) {
+	bool gone = false;
 	int i;
-	unsigned long t;
 
-	t = micros();
+	for (i = 0; i < OutputsNext->entries; i++) {
+		if (map[i] < 0 && OutputsNext->out[i].bus.n) {
+			bus_disable(&OutputsNext->out[i].bus);
+			gone = true;
+		}
+	}
 
-	for (i = 0; i < Outputs.entries; i++) {
-		tOutputEntry *out = &Outputs.out[i];
+	for (i = 0; i < Outputs->entries; i++) {
+		tOutputEntry *out = &Outputs->out[i];
+
+		// Buses may share pins with the ones just given up
+		if (gone && out->bus.n && !out->fresh)
+			out->bus.pio->PIO_OWER = out->bus.mask;
+		if (!out->fresh)
+			continue;
+		out->fresh = false;
+		if (out->bus.n)
+			bus_enable(&out->bus);
+		output_write(out, output_value(out));
+	}
+}
+
+// Append values to the feed of output k. Returns how many fit, or -1
+// if k is not a fed output. Main loop only.
+int output_feed(const char k, const int *v, int n) {
+	tOutputEntry *out = feed_lookup(k);
+	tFeed *f;
+	unsigned long head;
+	int i;
+
+	if (!out) {
+		SerialMonitor_status(E_NOKEY);
+		SerialUSB.print("ERROR Not a fed output: ");
+		SerialUSB.println(k);
+		return -1;
+	}
+	f = out->feed;
+
+	head = f->head;
+	for (i = 0; i < n && head - f->tail < FEED_SIZE; i++)
+		f->v[head++ & (FEED_SIZE - 1)] = v[i];
+	// Only now may the ISR play them
+	f->head = head;
+
+	if (i < n) {
+		SerialMonitor_status(E_FULL);
+		SerialUSB.println("WARN Feed full, values dropped");
+	}
+	return i;
+}
+
+static void feed_report(const tOutputEntry *out, tTime now) {
+	tFeed *f = out->feed;
+	unsigned long tail = f->tail;
+
+	f->reported = tail;
+	f->reported_underruns = f->underruns;
+	f->reported_t = now;
+	SerialMonitor_credit(out->k, FEED_SIZE - (f->head - tail), tail,
+		f->reported_underruns);
+}
+
+// Credit reports for the fed outputs: whenever another quarter of the
+// feed has been played, when it runs dry, and once a second while it
+// keeps underrunning. A host that keeps a quarter or more queued is
+// never left waiting for credit.
+void outputs_poll(tTime now) {
+	int i;
+
+	for (i = 0; i < Outputs->entries; i++) {
+		tOutputEntry *out = &Outputs->out[i];
+		tFeed *f = out->feed;
+		unsigned long tail;
+
+		if (!f)
+			continue;
+		tail = f->tail;
+		if (tail - f->reported >= FEED_SIZE / 4 ||
+		    (tail == f->head && tail != f->reported) ||
+		    (f->underruns != f->reported_underruns &&
+		     now - f->reported_t >= 1000000))
+			feed_report(out, now);
+	}
+}
+
+// After a feed command, so the host does not have to wait
+void output_credit(const char k) {
+	tOutputEntry *out = feed_lookup(k);
+
+	if (out)
+		feed_report(out, master_time());
+}
+
+// Modulate the rate or amplitude of output k; see tMod for the units.
+// MOD_OFF turns it off again.
+void output_mod(const char k, const int what, const int shape, const int from, const int to, const int time, const int mode, const char src) {
+	tOutputEntry *out = NULL;
+	tMod *m;
+	int i;
+
+	for (i = 0; i < OutputsNext->entries; i++)
+		if (OutputsNext->out[i].k == k)
+			out = &OutputsNext->out[i];
+	if (!out) {
+		SerialMonitor_status(E_NOKEY);
+		SerialUSB.print("ERROR Unknown output referenced: ");
+		SerialUSB.println(k);
+		return;
+	}
+	if (what < MOD_RATE || what > MOD_AMP || shape < MOD_OFF ||
+	    shape > MOD_SOURCE || mode < 0 || mode > 2 ||
+	    abs(from) > 1000000 || abs(to) > 1000000) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Invalid modulation");
+		return;
+	}
+	if (what == MOD_RATE && (out->feed || from < 0 || to < 0)) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Rate must be positive, and not of a feed");
+		return;
+	}
+	if ((shape == MOD_LIN || shape == MOD_LOG) && time <= 0) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Sweep time must be positive");
+		return;
+	}
+	if (shape == MOD_LOG && (from <= 0 || to <= 0)) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Log sweeps need from and to above 0");
+		return;
+	}
+
+	m = &out->mod[what];
+	i = m->gen;
+	memset(m, 0, sizeof(tMod));
+	m->gen = i + 1;
+	if (shape == MOD_OFF)
+		return;
+
+	m->shape = shape;
+	m->mode = mode;
+	m->src = src;
+	m->from = from;
+	m->to = to;
+	m->time = time;
+	m->idx = -1;
+	m->qfrom = (long long)from * 65536 / 1000;
+	m->qto = (long long)to * 65536 / 1000;
+	m->value = m->qfrom;
+	if (shape == MOD_LOG)
+		m->lg = log((double)to / from) / log(2.0) * 65536;
+	if (time > out->period)
+		m->inc = ((unsigned long long)out->period << 32) / time;
+	else
+		m->inc = 0xffffffff;
+}
+
+// from * 2^(lg * f), with f the position in the sweep
+static long mod_log(const tMod *m, uint32_t f) {
+	long x = ((long long)m->lg * (long)(f >> 16)) >> 16;
+	int n = x >> 16;
+	int i = (x >> 8) & 0xff;
+	long long e = _exp2[i] + ((((long)_exp2[i + 1] - (long)_exp2[i]) * (x & 0xff)) >> 8);
+	long long v = (m->qfrom * e) >> 16;
+
+	return n >= 0 ? v << n : v >> -n;
+}
+
+// The value of a modulation for the step being taken, 16.16; sweeps
+// move on by one step
+static long mod_step(tMod *m) {
+	uint32_t f, next;
+
+	switch (m->shape) {
+	case MOD_OUTPUT:
+		if (m->idx >= 0)
+			m->value = m->qfrom + (((long long)(m->qto - m->qfrom) *
+				output_value(&Outputs->out[m->idx])) >> 12);
+		return m->value;
+	case MOD_SOURCE:
+		if (m->idx >= 0)
+			m->value = m->qfrom + (((long long)(m->qto - m->qfrom) *
+				Sources->s[m->idx].raw) >> 12);
+		return m->value;
+	}
+
+	f = m->down ? ~m->pos : m->pos;
+	if (m->shape == MOD_LIN)
+		m->value = m->qfrom + (((long long)(m->qto - m->qfrom) * (long)(f >> 16)) >> 16);
+	else
+		m->value = mod_log(m, f);
+
+	if (m->done)
+		return m->value;
+	next = m->pos + m->inc;
+	if (next < m->pos) {
+		// End of a sweep
+		if (m->mode == 0) {
+			m->done = true;
+			next = 0xffffffff;
+		} else if (m->mode == 2) {
+			m->down = !m->down;
+		}
+	}
+	m->pos = next;
+	return m->value;
+}
+
+// The step of an output with modulation. Kept apart so plain outputs
+// do not pay for it. Unlike those, a rate that runs past the end of
+// the pattern wraps around modulo its length in mode 0, so sweeps stay
+// continuous.
+static void output_modulated(tOutputEntry *out) {
+	int v;
+
+	if (out->feed) {
+		tFeed *f = out->feed;
+
+		if (f->tail != f->head)
+			f->last = f->v[f->tail++ & (FEED_SIZE - 1)];
+		else
+			f->underruns++;
+		v = f->last;
+	} else {
+		int len = out->v->len;
+		int n, step;
+
+		if (out->mod[MOD_RATE].shape) {
+			out->frac += mod_step(&out->mod[MOD_RATE]);
+			n = out->frac >> 16;
+			out->frac &= 0xffff;
+		} else {
+			n = abs(out->step);
+		}
+		step = out->last_step + (out->step < 0 ? -n : n);
+
+		if (!out->mode) {
+			step %= len;
+			if (step < 0)
+				step += len;
+		} else if (step >= len) {
+			step = len - 1;
+			out->step = -abs(out->step);
+		} else if (step < 0) {
+			step = 0;
+			out->step = abs(out->step);
+		}
+		out->last_step = step;
+		v = out->v->v[step];
+	}
+
+	if (out->mod[MOD_AMP].shape) {
+		v = OUTPUT_MID + (((long long)(v - OUTPUT_MID) *
+			mod_step(&out->mod[MOD_AMP])) >> 16);
+		if (v < 0)
+			v = 0;
+		else if (v > 4095)
+			v = 4095;
+	}
+	output_write(out, v);
+}
+
+void outputs_push(void) {
+	int i;
+
+	for (i = 0; i < Outputs->entries; i++) {
+		tOutputEntry *out = &Outputs->out[i];
 		out->countdown -= Master.period;
 
 		if (out->countdown <= 0) {
+			unsigned long c = stats_cycles();
 			int step = out->last_step + out->step;
 
 			out->countdown = out->period;
 
+			if (out->mod[MOD_RATE].shape || out->mod[MOD_AMP].shape) {
+				output_modulated(out);
+				stats_add(&out->cost, stats_cycles() - c);
+				continue;
+			}
+			if (out->feed) {
+				tFeed *f = out->feed;
+
+				if (f->tail != f->head)
+					f->last = f->v[f->tail++ & (FEED_SIZE - 1)];
+				else
+					f->underruns++;
+				output_write(out, f->last);
+				stats_add(&out->cost, stats_cycles() - c);
+				continue;
+			}
+
 			if (step >= out->v->len) {
 				if (!out->mode) {
 					step = 0;
@@ -180,7 +674,8 @@ void outputs_push(void) {
 
 			out->last_step = step;
 
-			_port_write(out->p, out->v->v[step]);
+			output_write(out, out->v->v[step]);
+			stats_add(&out->cost, stats_cycles() - c);
 		}
 	}
 }
@@ -19,12 +19,70 @@
 #ifndef OUTPUTS_H
 #define OUTPUTS_H
 
+#include "Stats.h"
+#include "Lowlevel.h"
+
 typedef struct {
 	const char *name;
 	const int len;
 	const int *v; // Pointer to an array of integers
 } tPattern;
 
+// Samples streamed from the host, for outputs with the "feed" pattern.
+// A ring written by the main loop (output_feed()) and played by the
+// timer interrupt; the counters only ever go up, so neither side has to
+// lock the other out. The host learns the free space from the credit
+// reports of outputs_poll() and must not send more than that.
+#define FEED_SIZE	2048	// Samples, a power of two
+#define FEED_MAX	2	// Outputs that can be fed at the same time
+
+typedef struct {
+	volatile unsigned short v[FEED_SIZE];
+	volatile unsigned long head;	// Samples written, ever
+	volatile unsigned long tail;	// Samples played, ever
+	volatile unsigned long underruns; // Steps with nothing to play
+	int last;		// Value of the last step, held on underruns
+
+	// Main loop only
+	unsigned long reported;	// tail at the last credit report
+	unsigned long reported_underruns;
+	tTime reported_t;
+} tFeed;
+
+// Modulation of the rate or the amplitude of an output, set with
+// output_mod(). from and to are in thousandths: of a pattern step per
+// interval for the rate, of the full swing around OUTPUT_MID for the
+// amplitude. The ISR works on the 16.16 fixed point copies.
+#define MOD_RATE	0
+#define MOD_AMP		1
+
+#define MOD_OFF		0
+#define MOD_LIN		1	// Sweep from..to in time uS, linearly
+#define MOD_LOG		2	// Same, by the same factor per uS
+#define MOD_OUTPUT	3	// Follow output src: 0..4095 maps to from..to
+#define MOD_SOURCE	4	// Follow the latest sample of source src
+
+#define OUTPUT_MID	2048	// Amplitude modulation scales around this
+
+typedef struct {
+	char shape;
+	char mode;	// Sweeps: 0 = once, then hold, 1 = repeat, 2 = up and down
+	char src;	// Key of the modulating output or source
+	int from, to;	// Thousandths
+	int time;	// Length of a sweep, uS
+
+	// Internal
+	long qfrom, qto;	// 16.16
+	long lg;	// log2(to / from), 16.16, for MOD_LOG
+	uint32_t inc;	// Sweep position per step, as a fraction of 2^32
+	signed char idx;	// Table index of src, worked out on commit
+	unsigned char gen;	// Changed with the settings; restarts the sweep
+	uint32_t pos;	// Position in the sweep
+	bool down;	// Mode 2, on the way back
+	bool done;	// Mode 0, held at the end
+	long value;	// Current, 16.16
+} tMod;
+
 typedef struct {
 	char k;
 	int p;
@@ -32,11 +90,18 @@ typedef struct {
 	int step;	// Step size through pattern buffer
 	int offset;	// Initial offset into the buffer
 	int mode;	// 0 = cycle, 1 = up, then down
+	int phase;	// uS delay of the first step relative to the start
 
 	// Internal
 	int countdown;
 	int last_step;
 	tPattern *v;
+	tFeed *feed;	// Plays this instead of the pattern, if set
+	tBus bus;	// Written instead of port p, if it has pins
+	tMod mod[2];	// MOD_RATE, MOD_AMP
+	long frac;	// Fraction of a step, 16 bit, with rate modulation
+	tCost cost;	// Cycles spent writing steps
+	bool fresh;	// Added since the last commit
 } tOutputEntry;
 
 #define OUTPUT_SIZE	8
@@ -45,15 +110,30 @@ typedef struct {
 	tOutputEntry out[OUTPUT_SIZE];
 } tOutputs;
 
-extern tOutputs Outputs;
+// Same scheme as the Sources table: the ISR reads Outputs, changes go
+// to OutputsNext and are published by outputs_swap().
+extern tOutputs *Outputs;
+extern tOutputs *OutputsNext;
 extern tPattern Patterns[];
 extern const int PatternCount;
 
 void outputs_setup(void);
-void output_add(const char k, char *portname, const int period, const int step, const int offset, const int mode, const char *name);
+void output_add(const char k, char *portname, const int period, const int step, const int offset, const int mode, const char *name, const int phase);
+void output_bus(const char k, const int *idx, const int n, const int period, const int step, const int offset, const int mode, const char *name, const int phase);
 void output_del(const char k);
+void output_mod(const char k, const int what, const int shape, const int from, const int to, const int time, const int mode, const char src);
+int output_feed(const char k, const int *v, int n);
+void output_credit(const char k);
+void outputs_poll(tTime now);
 void outputs_reset(void);
 void outputs_setup(void);
 void outputs_push(void);
 
+void outputs_begin(void);
+void outputs_prepare(signed char *map);
+void outputs_swap(const signed char *map);
+void outputs_finish(const signed char *map);
+
+void outputs_rewind(void);
+
 #endif
@@ -18,6 +18,7 @@
 
 #include "Arduino.h"
 #include "RingBuf.h"
+#include "Trace.h"
 
 RingBuf::RingBuf(void) {
 	// Constructor, nothing to see here (yet)
@@ -28,6 +29,9 @@ void RingBuf::setup() {
 	_start = 0;
 	_tail = 0;
 	_entries = 0;
+	_high = 0;
+	_pushes = 0;
+	_drops = 0;
 	memset(&_data, 0, sizeof(_data));
 }
 
@@ -36,50 +40,110 @@ char RingBuf::entries() {
 	return _entries;
 }
 
-// Returns true if the buffer has ever overflown
-bool RingBuf::overflow() {
-	return _overflow;
+unsigned long RingBuf::pushes() {
+	return _pushes;
 }
 
-// Pull the next entry from the ring buffer
+unsigned long RingBuf::drops() {
+	return _drops;
+}
+
+// The high-water mark, optionally starting a new one
+char RingBuf::high(bool reset) {
+	char h = _high;
+
+	if (reset) {
+		noInterrupts();
+		h = _high;
+		_high = _entries;
+		interrupts();
+	}
+	return h;
+}
+
+// Pull the next record from the ring buffer. i and v must have room
+// for RINGBUFFER_RECORD_MAX values; returns how many were filled in.
 // Must only be called from non-interrupt context!
-void RingBuf::pull(unsigned long *t, int *i, int *v) {
-	tRingBufferEntry *d = &_data[_start];
+char RingBuf::pull(tTime *t, int *i, int *v) {
+	char n, j, k;
 
 	if (_entries == 0) {
-		return;
+		return 0;
 	}
 
-	*t = d->t;
-	*i = d->i;
-	*v = d->v;
+	n = _data[_start].n;
+	*t = _data[_start].t;
+	for (j = 0, k = _start; j < n; j++) {
+		i[j] = _data[k].i;
+		v[j] = _data[k].v;
 
-	noInterrupts();
-	_entries--;
-	_start++;
-	if (_start >= RINGBUFFER_SIZE) {
-		_start = 0;
+		k++;
+		if (k >= RINGBUFFER_SIZE) {
+			k = 0;
+		}
 	}
+
+	noInterrupts();
+	_entries -= n;
+	_start = k;
 	interrupts();
+
+	return n;
 }
 
-// Push an entry to the ring buffer.
+// Push a single value to the ring buffer.
 // Only to be called from interrupt context!
-void RingBuf::push(const unsigned long t, const int i, const int v) {
-	tRingBufferEntry *d = &_data[_tail];
+bool RingBuf::push(const tTime t, const int i, const int v) {
+	return push(t, 1, &i, &v);
+}
+
+// Push a record of n values taken at the same time. Either the whole
+// record fits, or it is dropped and false returned.
+// Only to be called from interrupt context!
+bool RingBuf::push(const tTime t, const char n, const int *i, const int *v) {
+	char j;
+
+	if (_entries + n > RINGBUFFER_SIZE) {
+		_drops++;
+		TRACE_INSTANT(TR_DROP, i[0]);
+		return false;
+	}
 
-	if (_entries == RINGBUFFER_SIZE) {
-		_overflow = true;
-		return;
+	_data[_tail].t = t;
+	_data[_tail].n = n;
+	for (j = 0; j < n; j++) {
+		_data[_tail].i = i[j];
+		_data[_tail].v = v[j];
+
+		_tail++;
+		if (_tail >= RINGBUFFER_SIZE) {
+			_tail = 0;
+		}
 	}
 
-	d->t = t;
-	d->i = i;
-	d->v = v;
+	_entries += n;
+	_pushes++;
+	TRACE_INSTANT(TR_PUSH, i[0]);
+	if (_entries > _high)
+		_high = _entries;
+	return true;
+}
+
+// Renumber the queued entries after the source table has been swapped;
+// map[old index] is the new index, or -1 if the source is gone.
+// Only to be called with interrupts disabled!
+void RingBuf::remap(const signed char *map) {
+	char n, j;
+
+	for (n = 0, j = _start; n < _entries; n++) {
+		tRingBufferEntry *d = &_data[j];
+
+		if (d->i >= 0)
+			d->i = map[d->i];
 
-	_entries++;
-	_tail++;
-	if (_tail >= RINGBUFFER_SIZE) {
-		_tail = 0;
+		j++;
+		if (j >= RINGBUFFER_SIZE) {
+			j = 0;
+		}
 	}
 }
@@ -19,28 +19,41 @@
 #ifndef HEADER_RINGBUF
 #define HEADER_RINGBUF
 
+#include "GPIO_Platform.h"
+
+// A record is one or more consecutive entries sharing the timestamp of
+// the first one; n is only set in the first entry.
 typedef struct {
-	volatile unsigned long t;
+	volatile tTime t;
 	volatile int i;
 	volatile int v;
+	volatile char n;
 } tRingBufferEntry;
 
 #define RINGBUFFER_SIZE 64
+// Most values a single record may hold
+#define RINGBUFFER_RECORD_MAX 8
 
 class RingBuf {
 public:
 	RingBuf(void);
 	void setup();
 	char entries();
-	bool overflow();
-	void push(const unsigned long t, const int i, const int v);
-	void pull(unsigned long *t, int *i, int *v);
+	unsigned long pushes();
+	unsigned long drops();
+	char high(bool reset);
+	bool push(const tTime t, const int i, const int v);
+	bool push(const tTime t, const char n, const int *i, const int *v);
+	char pull(tTime *t, int *i, int *v);
+	void remap(const signed char *map);
 
 private:
 	volatile char _start;
 	volatile char _tail;
 	volatile char _entries;
-	volatile bool _overflow;
+	volatile char _high;		// Most entries since the last reset
+	volatile unsigned long _pushes;	// Records queued, ever
+	volatile unsigned long _drops;	// Records dropped because it was full
 	tRingBufferEntry _data[RINGBUFFER_SIZE];
 };
 
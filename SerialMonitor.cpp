@@ -20,26 +20,78 @@
 #include "Sources.h"
 #include "Outputs.h"
 #include "Lowlevel.h"
+#include "Config.h"
+#include "Encoder.h"
+#include "Frame.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Budget.h"
+#include "Store.h"
 #include <DueTimer.h>
 
-static char serialCmd[128] = "\0";
+// Long enough for output_bus with all of its 32 pins
+static char serialCmd[256] = "\0";
+
+// Binary command being received, see cmd_frame()
+static tFrame cmdFrame;
+
+// Outcome of the current command
+static int Status;
 
 // Ugly global variables for parsing strings
 static char *P_s, *P_r;
 
-static int parse_start() {
+// Arguments of a binary command instead, if not NULL. Each is a type
+// byte followed by the value.
+static tFrame *P_f;
+
+#define ARG_INT		0x01	// svarint
+#define ARG_CHAR	0x02	// One byte
+#define ARG_STR		0x03	// Length byte, then the characters
+
+static void parse_start() {
 	P_r = NULL;
 	P_s = strtok_r(serialCmd, DELIM, &P_r);
 	/* Skip initial command */
 	P_s = strtok_r(NULL, DELIM, &P_r);
 }
 
+// Whether any arguments are left, for optional ones
+static bool parse_more() {
+	if (P_f)
+		return P_f->pos < P_f->len;
+	return P_s && *P_s;
+}
+
+static bool parse_arg(unsigned char type) {
+	unsigned char t;
+
+	if (!frame_get_byte(P_f, &t) || t != type) {
+		SerialMonitor_status(E_ARGS);
+		return false;
+	}
+	return true;
+}
+
 static bool parse_char(char *c) {
+	unsigned char b;
+
 	if (!c)
 		return false;
-	if (!P_s)
+	if (P_f) {
+		if (!parse_arg(ARG_CHAR) || !frame_get_byte(P_f, &b)) {
+			SerialMonitor_status(E_ARGS);
+			return false;
+		}
+		*c = b;
+		return true;
+	}
+	if (!P_s) {
+		SerialMonitor_status(E_ARGS);
 		return false;
+	}
 	if (*P_s == 0) {
+		SerialMonitor_status(E_ARGS);
 		return false;
 	} else {
 		*c = *P_s;
@@ -49,11 +101,24 @@ static bool parse_char(char *c) {
 }
 
 static int parse_int(int *v) {
+	long long l;
+
 	if (!v)
 		return false;
-	if (!P_s)
+	if (P_f) {
+		if (!parse_arg(ARG_INT) || !frame_get_svarint(P_f, &l)) {
+			SerialMonitor_status(E_ARGS);
+			return false;
+		}
+		*v = l;
+		return true;
+	}
+	if (!P_s) {
+		SerialMonitor_status(E_ARGS);
 		return false;
+	}
 	if (*P_s == 0) {
+		SerialMonitor_status(E_ARGS);
 		return false;
 	} else {
 		*v = atoi(P_s);
@@ -63,11 +128,33 @@ static int parse_int(int *v) {
 }
 
 static bool parse_str(char *c, int len) {
+	unsigned char n, b;
+	int i;
+
 	if (!c)
 		return false;
-	if (!P_s)
+	if (P_f) {
+		if (!parse_arg(ARG_STR) || !frame_get_byte(P_f, &n)) {
+			SerialMonitor_status(E_ARGS);
+			return false;
+		}
+		for (i = 0; i < n; i++) {
+			if (!frame_get_byte(P_f, &b)) {
+				SerialMonitor_status(E_ARGS);
+				return false;
+			}
+			if (i < len - 1)
+				c[i] = b;
+		}
+		c[i < len - 1 ? i : len - 1] = 0;
+		return true;
+	}
+	if (!P_s) {
+		SerialMonitor_status(E_ARGS);
 		return false;
+	}
 	if (*P_s == 0) {
+		SerialMonitor_status(E_ARGS);
 		return false;
 	} else {
 		strlcpy(c, P_s, len);
@@ -77,13 +164,13 @@ static bool parse_str(char *c, int len) {
 }
 
 static void cmd_stop() {
+	master_disarm();
 	Master.started = false;
 	Timer1.stop();
 }
 
 static void cmd_start() {
-	Master.started = true;
-	Timer1.start(Master.period);
+	master_start();
 }
 
 static void cmd_source_add() {
@@ -93,6 +180,7 @@ static void cmd_source_add() {
 	int avg;
 	int mode;
 	int delta;
+	int phase;
 
 	if (!parse_char(&k))
 		return;
@@ -106,6 +194,10 @@ static void cmd_source_add() {
 		return;
 	if (!parse_int(&delta))
 		return;
+	// Optional
+	phase = 0;
+	if (parse_more() && !parse_int(&phase))
+		return;
 
 	if (debug) {
 		SerialUSB.print("DEBUG Adding source: ");
@@ -119,9 +211,13 @@ static void cmd_source_add() {
 		SerialUSB.print(DELIM);
 		SerialUSB.print(mode);
 		SerialUSB.print(DELIM);
-		SerialUSB.println(delta);
+		SerialUSB.print(delta);
+		SerialUSB.print(DELIM);
+		SerialUSB.println(phase);
 	}
-	source_add(k, portname, period, avg, mode, delta);
+	config_edit();
+	source_add(k, portname, period, avg, mode, delta, phase);
+	config_done();
 }
 
 // Technically, this also only modifies the Sources table
@@ -151,7 +247,99 @@ static void cmd_source_attach_irq() {
 		SerialUSB.print(DELIM);
 		SerialUSB.println(count_ticks);
 	}
+	config_edit();
 	source_attach_irq(k, portname, trigger, count_ticks);
+	config_done();
+}
+
+static void cmd_source_group() {
+	char leader;
+	char k;
+
+	if (!parse_char(&leader))
+		return;
+	if (!parse_char(&k))
+		return;
+
+	if (debug) {
+		SerialUSB.print("DEBUG Grouping source ");
+		SerialUSB.print(k);
+		SerialUSB.print(" with ");
+		SerialUSB.println(leader);
+	}
+	config_edit();
+	source_group(leader, k);
+	config_done();
+}
+
+static void cmd_source_shed() {
+	char k;
+	int shed;
+	int n;
+
+	if (!parse_char(&k))
+		return;
+	if (!parse_int(&shed))
+		return;
+	if (!parse_int(&n))
+		return;
+
+	if (debug) {
+		SerialUSB.print("DEBUG Backpressure mode for source ");
+		SerialUSB.print(k);
+		SerialUSB.print(DELIM);
+		SerialUSB.print(shed);
+		SerialUSB.print(DELIM);
+		SerialUSB.println(n);
+	}
+	config_edit();
+	source_shed(k, shed, n);
+	config_done();
+}
+
+static void cmd_source_sdt() {
+	char k;
+	int dev;
+	int max;
+
+	if (!parse_char(&k))
+		return;
+	if (!parse_int(&dev))
+		return;
+	// Optional
+	max = 0;
+	if (parse_more() && !parse_int(&max))
+		return;
+
+	if (debug) {
+		SerialUSB.print("DEBUG Swinging door for source ");
+		SerialUSB.print(k);
+		SerialUSB.print(DELIM);
+		SerialUSB.print(dev);
+		SerialUSB.print(DELIM);
+		SerialUSB.println(max);
+	}
+	config_edit();
+	source_sdt(k, dev, max);
+	config_done();
+}
+
+static void cmd_backpressure() {
+	int high;
+	int low;
+
+	if (!parse_int(&high))
+		return;
+	if (!parse_int(&low))
+		return;
+
+	if (debug) {
+		SerialUSB.print("DEBUG Backpressure watermarks: ");
+		SerialUSB.print(high);
+		SerialUSB.print(DELIM);
+		SerialUSB.println(low);
+	}
+	sources_backpressure(high, low);
 }
 
 static void cmd_source_del() {
@@ -164,7 +352,9 @@ static void cmd_source_del() {
 		SerialUSB.print("DEBUG Deleting source: ");
 		SerialUSB.println(k);
 	}
+	config_edit();
 	source_del(k);
+	config_done();
 }
 
 static void cmd_output_add() {
@@ -175,6 +365,7 @@ static void cmd_output_add() {
 	int offset;
 	int mode;
 	char name[32];
+	int phase;
 
 	if (!parse_char(&k))
 		return;
@@ -190,6 +381,10 @@ static void cmd_output_add() {
 		return;
 	if (!parse_str(name, sizeof(name)))
 		return;
+	// Optional
+	phase = 0;
+	if (parse_more() && !parse_int(&phase))
+		return;
 
 	if (debug) {
 		SerialUSB.print("DEBUG Adding output: ");
@@ -205,9 +400,154 @@ static void cmd_output_add() {
 		SerialUSB.print(" mode: ");
 		SerialUSB.print(mode);
 		SerialUSB.print(" pattern: ");
+		SerialUSB.print(name);
+		SerialUSB.print(" phase: ");
+		SerialUSB.println(phase);
+	}
+	config_edit();
+	output_add(k, portname, period, step, offset, mode, name, phase);
+	config_done();
+}
+
+static void cmd_output_bus() {
+	char k;
+	int period;
+	int step;
+	int offset;
+	int mode;
+	char name[32];
+	int phase;
+	char portname[16];
+	int idx[BUS_MAX];
+	int n = 0;
+
+	if (!parse_char(&k))
+		return;
+	if (!parse_int(&period))
+		return;
+	if (!parse_int(&step))
+		return;
+	if (!parse_int(&offset))
+		return;
+	if (!parse_int(&mode))
+		return;
+	if (!parse_str(name, sizeof(name)))
+		return;
+	if (!parse_int(&phase))
+		return;
+	while (parse_more()) {
+		if (n == BUS_MAX) {
+			SerialMonitor_status(E_INVALID);
+			SerialUSB.println("ERROR Too many pins for a bus");
+			return;
+		}
+		if (!parse_str(portname, sizeof(portname)))
+			return;
+		idx[n] = port_lookup(portname);
+		if (idx[n] < 1) {
+			SerialMonitor_status(E_PORT);
+			SerialUSB.print("ERROR Unknown port for bus: ");
+			SerialUSB.println(portname);
+			return;
+		}
+		n++;
+	}
+	if (!n) {
+		SerialMonitor_status(E_ARGS);
+		return;
+	}
+
+	if (debug) {
+		SerialUSB.print("DEBUG Adding bus output: ");
+		SerialUSB.print(k);
+		SerialUSB.print(" pins: ");
+		SerialUSB.print(n);
+		SerialUSB.print(" period: ");
+		SerialUSB.print(period);
+		SerialUSB.print(" pattern: ");
 		SerialUSB.println(name);
 	}
-	output_add(k, portname, period, step, offset, mode, name);
+	config_edit();
+	output_bus(k, idx, n, period, step, offset, mode, name, phase);
+	config_done();
+}
+
+static void cmd_output_mod() {
+	char k;
+	int what;
+	int shape;
+	int from;
+	int to;
+	int time;
+	int mode;
+	char src;
+
+	if (!parse_char(&k))
+		return;
+	if (!parse_int(&what))
+		return;
+	if (!parse_int(&shape))
+		return;
+	if (!parse_int(&from))
+		return;
+	if (!parse_int(&to))
+		return;
+	if (!parse_int(&time))
+		return;
+	if (!parse_int(&mode))
+		return;
+	// Only for following an output or source
+	src = 0;
+	if ((shape == MOD_OUTPUT || shape == MOD_SOURCE) && !parse_char(&src))
+		return;
+
+	if (debug) {
+		SerialUSB.print("DEBUG Modulating output: ");
+		SerialUSB.print(k);
+		SerialUSB.print(what == MOD_RATE ? " rate" : " amplitude");
+		SerialUSB.print(" shape: ");
+		SerialUSB.print(shape);
+		SerialUSB.print(" from: ");
+		SerialUSB.print(from);
+		SerialUSB.print(" to: ");
+		SerialUSB.print(to);
+		SerialUSB.print(" time: ");
+		SerialUSB.print(time);
+		SerialUSB.print(" mode: ");
+		SerialUSB.println(mode);
+	}
+	config_edit();
+	output_mod(k, what, shape, from, to, time, mode, src);
+	config_done();
+}
+
+// Values for a fed output, as many as fit into the command
+static void cmd_feed() {
+	int v[FRAME_MAX / 2];
+	int n = 0;
+	char k;
+
+	if (!parse_char(&k))
+		return;
+	while (parse_more() && n < (int)(sizeof(v) / sizeof(v[0]))) {
+		if (!parse_int(&v[n]))
+			return;
+		if (v[n] < 0 || v[n] > 0xffff) {
+			SerialMonitor_status(E_INVALID);
+			SerialUSB.println("ERROR Feed value out of range");
+			return;
+		}
+		n++;
+	}
+
+	if (debug > 1) {
+		SerialUSB.print("DEBUG Feeding ");
+		SerialUSB.print(k);
+		SerialUSB.print(DELIM);
+		SerialUSB.println(n);
+	}
+	if (output_feed(k, v, n) >= 0)
+		output_credit(k);
 }
 
 static void cmd_output_del() {
@@ -220,24 +560,32 @@ static void cmd_output_del() {
 		SerialUSB.print("DEBUG Deleting output: ");
 		SerialUSB.println(k);
 	}
+	config_edit();
 	output_del(k);
+	config_done();
 }
 
 // It's because of this function primarily that so many data structures
 // are exposed globally, but it is quite useful for debugging.
 static void cmd_dump() {
-	int i;
+	tLoad l;
+	int i, j;
 
 	SerialUSB.print("INFO Timer period: ");
 	SerialUSB.print(Master.period);
 	SerialUSB.print(" Currently enabled: ");
-	SerialUSB.println(Master.started);
+	SerialUSB.print(Master.started);
+	SerialUSB.print(" Armed: ");
+	SerialUSB.println(Master.armed);
+
+	if (config_pending())
+		SerialUSB.println("INFO Uncommitted changes pending");
 
 	SerialUSB.print("INFO Sources: ");
-	SerialUSB.println((int)Sources.entries);
+	SerialUSB.println((int)Sources->entries);
 
-	for (i = 0; i < Sources.entries; i++) {
-		tSourceEntry *s = &Sources.s[i];
+	for (i = 0; i < Sources->entries; i++) {
+		tSourceEntry *s = &Sources->s[i];
 
 		SerialUSB.print(" Key: ");
 		SerialUSB.print(s->k);
@@ -252,7 +600,33 @@ static void cmd_dump() {
 		SerialUSB.print(" Mode: ");
 		SerialUSB.print(s->mode);
 		SerialUSB.print(" Delta: ");
-		SerialUSB.println(s->delta);
+		SerialUSB.print(s->delta);
+		SerialUSB.print(" Phase: ");
+		SerialUSB.println(s->phase);
+
+		if (s->group) {
+			SerialUSB.print("  Group: ");
+			SerialUSB.println(s->group);
+		}
+
+		if (s->sdt) {
+			SerialUSB.print("  Swinging door: ");
+			SerialUSB.print(s->sdt);
+			SerialUSB.print(" Max: ");
+			SerialUSB.println(s->sdt_max);
+		}
+
+		if (s->drops) {
+			SerialUSB.print("  Dropped: ");
+			SerialUSB.println(s->drops);
+		}
+
+		if (s->shed) {
+			SerialUSB.print("  Shed: ");
+			SerialUSB.print(s->shed);
+			SerialUSB.print(" N: ");
+			SerialUSB.println(s->shed_n);
+		}
 
 		if (s->irq) {
 			SerialUSB.print("  IRQ: ");
@@ -268,10 +642,10 @@ static void cmd_dump() {
 	}
 
 	SerialUSB.print("INFO Outputs: ");
-	SerialUSB.println((int)Outputs.entries);
+	SerialUSB.println((int)Outputs->entries);
 
-	for (i = 0; i < Outputs.entries; i++) {
-		tOutputEntry *out = &Outputs.out[i];
+	for (i = 0; i < Outputs->entries; i++) {
+		tOutputEntry *out = &Outputs->out[i];
 		SerialUSB.print(i);
 		SerialUSB.print(DELIM);
 		SerialUSB.print("output_add ");
@@ -287,7 +661,39 @@ static void cmd_dump() {
 		SerialUSB.print(DELIM);
 		SerialUSB.print(out->mode);
 		SerialUSB.print(DELIM);
-		SerialUSB.println(out->v->name);
+		SerialUSB.print(out->v->name);
+		SerialUSB.print(DELIM);
+		SerialUSB.println(out->phase);
+		if (out->bus.n) {
+			SerialUSB.print(" Bus:");
+			for (j = 0; j < out->bus.n; j++) {
+				SerialUSB.print(DELIM);
+				SerialUSB.print(PortList[out->bus.idx[j]].name);
+			}
+			SerialUSB.println(out->bus.shift >= 0 ? " (shifted)" : " (mapped)");
+		}
+		for (j = 0; j < 2; j++) {
+			tMod *m = &out->mod[j];
+
+			if (!m->shape)
+				continue;
+			SerialUSB.print(j == MOD_RATE ? " Rate: " : " Amplitude: ");
+			SerialUSB.print((int)m->shape);
+			SerialUSB.print(DELIM);
+			SerialUSB.print(m->from);
+			SerialUSB.print(DELIM);
+			SerialUSB.print(m->to);
+			SerialUSB.print(DELIM);
+			SerialUSB.print(m->time);
+			SerialUSB.print(DELIM);
+			SerialUSB.print((int)m->mode);
+			if (m->src) {
+				SerialUSB.print(DELIM);
+				SerialUSB.print(m->src);
+			}
+			SerialUSB.print(" now: ");
+			SerialUSB.println((long)(m->value * 1000 / 65536));
+		}
 		SerialUSB.print(" Status: Countdown: ");
 		SerialUSB.print(out->countdown);
 		SerialUSB.print(" pos: ");
@@ -295,9 +701,328 @@ static void cmd_dump() {
 	}
 
 	SerialUSB.print("INFO Ringbuffer entries: ");
-	SerialUSB.print(rb.entries());
-	SerialUSB.print(" Has overflown: ");
-	SerialUSB.println((int)rb.overflow());
+	SerialUSB.print((int)rb.entries());
+	SerialUSB.print(" High: ");
+	SerialUSB.print((int)rb.high(false));
+	SerialUSB.print(" Pushed: ");
+	SerialUSB.print(rb.pushes());
+	SerialUSB.print(" Dropped: ");
+	SerialUSB.println(rb.drops());
+
+	SerialUSB.print("INFO Serial input overflows: ");
+	SerialUSB.print(LinkStats.rx_overflow);
+	SerialUSB.print(" Corrupt frames: ");
+	SerialUSB.print(LinkStats.rx_corrupt);
+	SerialUSB.print(" Output stalls: ");
+	SerialUSB.print(LinkStats.tx_stalls);
+	SerialUSB.print(" Log events lost: ");
+	SerialUSB.println(log_lost());
+
+	SerialUSB.print("INFO Backpressure high: ");
+	SerialUSB.print((int)Backpressure.high);
+	SerialUSB.print(" low: ");
+	SerialUSB.print((int)Backpressure.low);
+	SerialUSB.print(" Active: ");
+	SerialUSB.println((int)Backpressure.active);
+
+	budget_predict(Sources, Outputs, &l);
+	SerialUSB.print("INFO Predicted load: ISR ");
+	SerialUSB.print(l.isr);
+	SerialUSB.print("% reporting ");
+	SerialUSB.print(l.report);
+	SerialUSB.print("% values/s ");
+	SerialUSB.print(l.values);
+	SerialUSB.print(" Limit: ");
+	SerialUSB.print(Budget.limit);
+	SerialUSB.print("% Mode: ");
+	SerialUSB.println(Budget.mode);
+}
+
+// One line or record per path, source and output
+#define STATS_ROWS (STATS_PATHS + SOURCES_MAX + OUTPUT_SIZE)
+
+typedef struct {
+	unsigned char kind;	// 0 = path, 1 = source, 2 = output
+	unsigned char id;	// Path index or key
+	tCost c;
+} tStatsRow;
+
+// Take a consistent copy of all costs, optionally clearing them in the
+// same go
+static int stats_snapshot(tStatsRow *rows, bool reset) {
+	int i, n = 0;
+
+	noInterrupts();
+	for (i = 0; i < STATS_PATHS; i++, n++) {
+		rows[n].kind = 0;
+		rows[n].id = i;
+		rows[n].c = Stats[i];
+	}
+	for (i = 0; i < Sources->entries; i++, n++) {
+		rows[n].kind = 1;
+		rows[n].id = Sources->s[i].k;
+		rows[n].c = Sources->s[i].cost;
+	}
+	for (i = 0; i < Outputs->entries; i++, n++) {
+		rows[n].kind = 2;
+		rows[n].id = Outputs->out[i].k;
+		rows[n].c = Outputs->out[i].cost;
+	}
+	if (reset)
+		stats_clear();
+	interrupts();
+
+	return n;
+}
+
+// Each frame starts with the cycles per uS, then a record per row:
+// kind, id, varint count, min, max and total
+static void stats_frames(const tStatsRow *rows, int n) {
+	static tFrame f;
+	int i;
+
+	frame_begin(&f, FRAME_STATS);
+	frame_varint(&f, SystemCoreClock / 1000000);
+	for (i = 0; i < n; i++) {
+		if (!frame_room(&f, 2 + 5 * 3 + 10)) {
+			frame_send(&f);
+			frame_begin(&f, FRAME_STATS);
+			frame_varint(&f, SystemCoreClock / 1000000);
+		}
+		frame_byte(&f, rows[i].kind);
+		frame_byte(&f, rows[i].id);
+		frame_varint(&f, rows[i].c.count);
+		frame_varint(&f, rows[i].c.min);
+		frame_varint(&f, rows[i].c.max);
+		frame_varint(&f, rows[i].c.total);
+	}
+	frame_send(&f);
+}
+
+static void print_time(tTime t);
+
+static void cmd_stats() {
+	static tStatsRow rows[STATS_ROWS];
+	int reset = 0;
+	int i, n;
+
+	// Optional
+	if (parse_more() && !parse_int(&reset))
+		return;
+
+	n = stats_snapshot(rows, reset);
+
+	if (stream_mode) {
+		stats_frames(rows, n);
+		return;
+	}
+
+	SerialUSB.print("INFO Cycles per uS: ");
+	SerialUSB.println(SystemCoreClock / 1000000);
+	for (i = 0; i < n; i++) {
+		static const char *kinds[] = { "path", "source", "output" };
+
+		SerialUSB.print("STATS ");
+		SerialUSB.print(kinds[rows[i].kind]);
+		SerialUSB.print(DELIM);
+		if (rows[i].kind == 0)
+			SerialUSB.print(StatsNames[rows[i].id]);
+		else
+			SerialUSB.print((char)rows[i].id);
+		SerialUSB.print(DELIM);
+		SerialUSB.print(rows[i].c.count);
+		SerialUSB.print(DELIM);
+		SerialUSB.print(rows[i].c.min);
+		SerialUSB.print(DELIM);
+		SerialUSB.print(rows[i].c.max);
+		SerialUSB.print(DELIM);
+		print_time(rows[i].c.total);
+		SerialUSB.println("");
+	}
+}
+
+#define HIST_ROWS (2 + SOURCES_MAX)
+
+typedef struct {
+	unsigned char kind;	// 0 = late, 1 = flush, 2 = source
+	unsigned char id;	// Key of the source
+	tHist h;
+} tHistRow;
+
+static int hist_snapshot(tHistRow *rows, bool reset) {
+	int i, n = 2;
+
+	noInterrupts();
+	rows[0].kind = 0;
+	rows[0].id = 0;
+	rows[0].h = HistLate;
+	rows[1].kind = 1;
+	rows[1].id = 0;
+	rows[1].h = HistFlush;
+	for (i = 0; i < Sources->entries; i++, n++) {
+		rows[n].kind = 2;
+		rows[n].id = Sources->s[i].k;
+		rows[n].h = Sources->s[i].resid;
+	}
+	if (reset)
+		hist_clear();
+	interrupts();
+
+	return n;
+}
+
+// A record per row: kind, id and a varint per bucket
+static void hist_frames(const tHistRow *rows, int n) {
+	static tFrame f;
+	int i, b;
+
+	frame_begin(&f, FRAME_HIST);
+	for (i = 0; i < n; i++) {
+		if (!frame_room(&f, 2 + 5 * HIST_BUCKETS)) {
+			frame_send(&f);
+			frame_begin(&f, FRAME_HIST);
+		}
+		frame_byte(&f, rows[i].kind);
+		frame_byte(&f, rows[i].id);
+		for (b = 0; b < HIST_BUCKETS; b++)
+			frame_varint(&f, rows[i].h.n[b]);
+	}
+	frame_send(&f);
+}
+
+static void cmd_hist() {
+	static tHistRow rows[HIST_ROWS];
+	int reset = 0;
+	int i, b, n;
+
+	// Optional
+	if (parse_more() && !parse_int(&reset))
+		return;
+
+	n = hist_snapshot(rows, reset);
+
+	if (stream_mode) {
+		hist_frames(rows, n);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		SerialUSB.print("HIST ");
+		if (rows[i].kind == 0) {
+			SerialUSB.print("late");
+		} else if (rows[i].kind == 1) {
+			SerialUSB.print("flush");
+		} else {
+			SerialUSB.print("source ");
+			SerialUSB.print((char)rows[i].id);
+		}
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			SerialUSB.print(DELIM);
+			SerialUSB.print(rows[i].h.n[b]);
+		}
+		SerialUSB.println("");
+	}
+}
+
+// uS between heartbeats, 0 = off
+static tTime heartbeat_period = 0;
+
+static void cmd_heartbeat() {
+	int ms;
+
+	if (!parse_int(&ms))
+		return;
+
+	if (ms < 0) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Invalid heartbeat period");
+		return;
+	}
+
+	if (debug) {
+		SerialUSB.print("DEBUG Heartbeat every ms: ");
+		SerialUSB.println(ms);
+	}
+	heartbeat_period = (tTime)ms * 1000;
+}
+
+static void cmd_trace() {
+	int mode;
+
+	if (!parse_int(&mode))
+		return;
+
+	if (mode < 0 || mode > 2) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Unknown trace mode");
+		return;
+	}
+	if (!trace_mode(mode)) {
+		SerialMonitor_status(E_STATE);
+		SerialUSB.println("ERROR Tracing is not built in");
+		return;
+	}
+	if (debug) {
+		SerialUSB.print("DEBUG Trace mode ");
+		SerialUSB.println(mode);
+	}
+}
+
+// The device time as the command is run, for the host to relate its
+// own clock to. Read before the arguments, as early as it gets.
+static void cmd_ping() {
+	static tFrame f;
+	tTime now = master_time();
+	int id;
+
+	if (!parse_int(&id))
+		return;
+
+	if (stream_mode) {
+		frame_begin(&f, FRAME_PONG);
+		frame_varint(&f, id);
+		frame_varint(&f, now);
+		frame_send(&f);
+		return;
+	}
+	SerialUSB.print("PONG");
+	SerialUSB.print(DELIM);
+	SerialUSB.print(id);
+	SerialUSB.print(DELIM);
+	print_time(now);
+	SerialUSB.println("");
+}
+
+static void cmd_trace_dump() {
+	if (!trace_dump()) {
+		SerialMonitor_status(E_STATE);
+		SerialUSB.println("ERROR Tracing is not built in");
+	}
+}
+
+static void cmd_budget() {
+	int limit;
+	int mode;
+
+	if (!parse_int(&limit))
+		return;
+	if (!parse_int(&mode))
+		return;
+
+	if (limit < 1 || limit > 100 || mode < 0 || mode > 2) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Invalid budget");
+		return;
+	}
+
+	if (debug) {
+		SerialUSB.print("DEBUG Load limit ");
+		SerialUSB.print(limit);
+		SerialUSB.print("% mode ");
+		SerialUSB.println(mode);
+	}
+	Budget.limit = limit;
+	Budget.mode = mode;
 }
 
 static void cmd_pattern_list() {
@@ -373,7 +1098,7 @@ static void cmd_read() {
 		return;
 
 	v = port_read(portname);
-	SerialMonitor_log(micros(), k, v);
+	SerialMonitor_log(master_time(), k, v);
 }
 
 static void cmd_output_reset() {
@@ -394,23 +1119,20 @@ static void cmd_pin() {
 	port = port_name2id(portname);
 
 	if (!PIN_OK(port)) {
+		SerialMonitor_status(E_PORT);
 		SerialUSB.println("WARN Port not valid");
 		return;
 	}
 
-	switch (mode) {
-	case 0:	pinMode(port, INPUT);
-		if (debug) SerialUSB.println("DEBUG Pin set to INPUT");
-		break;
-	case 1:	pinMode(port, INPUT_PULLUP);
-		if (debug) SerialUSB.println("DEBUG Pin set to INPUT_PULLUP");
-		break;
-	case 2:	pinMode(port, OUTPUT);
-		if (debug) SerialUSB.println("DEBUG Pin set to OUTPUT");
-		break;
-	default:
+	if (!port_mode(port, mode)) {
+		SerialMonitor_status(E_INVALID);
 		if (debug) SerialUSB.println("WARN Unknown pin mode.");
-		break;
+		return;
+	}
+	if (debug) {
+		static const char *names[] = { "INPUT", "INPUT_PULLUP", "OUTPUT" };
+		SerialUSB.print("DEBUG Pin set to ");
+		SerialUSB.println(names[mode]);
 	}
 }
 
@@ -427,45 +1149,176 @@ static void cmd_debug() {
 	debug = lvl;
 }
 
+static void cmd_begin() {
+	if (debug) SerialUSB.println("DEBUG Starting configuration batch");
+	config_begin();
+}
+
+static void cmd_commit() {
+	if (!config_pending()) {
+		SerialMonitor_status(E_STATE);
+		SerialUSB.println("WARN Nothing to commit");
+		return;
+	}
+	if (debug) SerialUSB.println("DEBUG Committing configuration batch");
+	config_commit();
+}
+
+static void cmd_abort() {
+	if (debug) SerialUSB.println("DEBUG Discarding configuration batch");
+	config_abort();
+}
+
+// Start everything from a common epoch, either right away or on the
+// next edge of the given pin
+static void cmd_arm() {
+	char portname[16];
+	int trigger;
+	int i;
+
+	if (!parse_more()) {
+		if (debug) SerialUSB.println("DEBUG Synchronized start");
+		master_arm(-1, 0);
+		return;
+	}
+	if (!parse_str(portname, sizeof(portname)))
+		return;
+	if (!parse_int(&trigger))
+		return;
+
+	i = port_lookup(portname);
+	if (i < 1 || i > 54) {
+		SerialMonitor_status(E_PORT);
+		SerialUSB.println("ERROR Invalid pin for IRQ specified");
+		return;
+	}
+
+	if (trigger == 0)
+		trigger = FALLING;
+	else if (trigger == 1)
+		trigger = RISING;
+	else if (trigger == 2)
+		trigger = CHANGE;
+	else {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("WARN Unknown IRQ trigger specified.");
+		return;
+	}
+
+	if (debug) {
+		SerialUSB.print("DEBUG Armed, waiting for trigger on ");
+		SerialUSB.println(portname);
+	}
+	master_arm(PortList[i].p, trigger);
+}
+
+static void cmd_stream() {
+	int mode;
+
+	if (!parse_int(&mode))
+		return;
+
+	if (mode < 0 || mode > 1) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Unknown stream mode");
+		return;
+	}
+
+	if (debug) {
+		SerialUSB.print("DEBUG Stream mode ");
+		SerialUSB.println(mode);
+	}
+	// Everything starts over with keyframes
+	encoder_reset();
+	stream_mode = mode;
+}
+
 static void cmd_clear() {
+	master_disarm();
 	Timer1.stop();
 	Master.period = 0;
 	Master.started = 0;
+	config_abort();
+	encoder_reset();
 	sources_setup();
 	outputs_setup();
 	SerialUSB.println("INFO All clear");
 }
 
+static void cmd_save() {
+	if (store_save() && debug)
+		SerialUSB.println("DEBUG Configuration saved");
+}
+
+static void cmd_load() {
+	if (store_load() == 0) {
+		SerialMonitor_status(E_STORE);
+		SerialUSB.println("WARN No configuration saved");
+	}
+}
+
+static void cmd_erase() {
+	store_erase();
+	if (debug)
+		SerialUSB.println("DEBUG Saved configuration erased");
+}
+
 static void cmd_help(void);
 
+// The opcodes identify commands in binary frames and must not change
 typedef struct tCmdTableEntry {
 	const char *cmd;
+	unsigned char op;
 	void (*handler)();
 } tCmdTableEntry;
 
 static tCmdTableEntry CmdTable[] = {
-	{ .cmd = "stop", .handler = &cmd_stop },
-	{ .cmd = "start", .handler = &cmd_start },
-
-	{ .cmd = "source_add", .handler = &cmd_source_add },
-	{ .cmd = "source_attach_irq", .handler = &cmd_source_attach_irq },
-	{ .cmd = "source_del", .handler = &cmd_source_del },
-
-	{ .cmd = "output_add", .handler = &cmd_output_add },
-	{ .cmd = "output_reset", .handler = &cmd_output_reset },
-	{ .cmd = "output_del", .handler = &cmd_output_del },
-
-	{ .cmd = "pattern_list", .handler = &cmd_pattern_list },
-
-	{ .cmd = "pin", .handler = &cmd_pin },
-	{ .cmd = "debug", .handler = &cmd_debug },
-	{ .cmd = "dump", .handler = &cmd_dump },
-	{ .cmd = "clear", .handler = &cmd_clear },
-	{ .cmd = "help", .handler = &cmd_help },
-
-	{ .cmd = "writed", .handler = &cmd_writed },
-	{ .cmd = "write", .handler = &cmd_write },
-	{ .cmd = "read", .handler = &cmd_read }
+	{ .cmd = "stop", .op = 0x01, .handler = &cmd_stop },
+	{ .cmd = "start", .op = 0x02, .handler = &cmd_start },
+	{ .cmd = "arm", .op = 0x03, .handler = &cmd_arm },
+
+	{ .cmd = "source_add", .op = 0x10, .handler = &cmd_source_add },
+	{ .cmd = "source_attach_irq", .op = 0x11, .handler = &cmd_source_attach_irq },
+	{ .cmd = "source_del", .op = 0x12, .handler = &cmd_source_del },
+	{ .cmd = "source_group", .op = 0x13, .handler = &cmd_source_group },
+	{ .cmd = "source_shed", .op = 0x14, .handler = &cmd_source_shed },
+	{ .cmd = "source_sdt", .op = 0x15, .handler = &cmd_source_sdt },
+	{ .cmd = "backpressure", .op = 0x16, .handler = &cmd_backpressure },
+	{ .cmd = "budget", .op = 0x17, .handler = &cmd_budget },
+
+	{ .cmd = "output_add", .op = 0x20, .handler = &cmd_output_add },
+	{ .cmd = "output_reset", .op = 0x21, .handler = &cmd_output_reset },
+	{ .cmd = "output_del", .op = 0x22, .handler = &cmd_output_del },
+	{ .cmd = "feed", .op = 0x23, .handler = &cmd_feed },
+	{ .cmd = "output_bus", .op = 0x24, .handler = &cmd_output_bus },
+	{ .cmd = "output_mod", .op = 0x25, .handler = &cmd_output_mod },
+
+	{ .cmd = "begin", .op = 0x30, .handler = &cmd_begin },
+	{ .cmd = "commit", .op = 0x31, .handler = &cmd_commit },
+	{ .cmd = "abort", .op = 0x32, .handler = &cmd_abort },
+
+	{ .cmd = "pattern_list", .op = 0x40, .handler = &cmd_pattern_list },
+
+	{ .cmd = "pin", .op = 0x41, .handler = &cmd_pin },
+	{ .cmd = "debug", .op = 0x42, .handler = &cmd_debug },
+	{ .cmd = "stream", .op = 0x43, .handler = &cmd_stream },
+	{ .cmd = "dump", .op = 0x44, .handler = &cmd_dump },
+	{ .cmd = "stats", .op = 0x47, .handler = &cmd_stats },
+	{ .cmd = "hist", .op = 0x48, .handler = &cmd_hist },
+	{ .cmd = "heartbeat", .op = 0x49, .handler = &cmd_heartbeat },
+	{ .cmd = "trace", .op = 0x4a, .handler = &cmd_trace },
+	{ .cmd = "trace_dump", .op = 0x4b, .handler = &cmd_trace_dump },
+	{ .cmd = "ping", .op = 0x4c, .handler = &cmd_ping },
+	{ .cmd = "clear", .op = 0x45, .handler = &cmd_clear },
+	{ .cmd = "help", .op = 0x46, .handler = &cmd_help },
+
+	{ .cmd = "save", .op = 0x60, .handler = &cmd_save },
+	{ .cmd = "load", .op = 0x61, .handler = &cmd_load },
+	{ .cmd = "erase", .op = 0x62, .handler = &cmd_erase },
+
+	{ .cmd = "writed", .op = 0x50, .handler = &cmd_writed },
+	{ .cmd = "write", .op = 0x51, .handler = &cmd_write },
+	{ .cmd = "read", .op = 0x52, .handler = &cmd_read }
 };
 
 static void cmd_help() {
@@ -484,52 +1337,277 @@ static void cmd_execute() {
 		SerialUSB.println(serialCmd);
 	}
 
+	Status = E_OK;
 	for (i = 0; i < sizeof(CmdTable) / sizeof(tCmdTableEntry); i++) {
-		if (strncmp(serialCmd, CmdTable[i].cmd, strlen(CmdTable[i].cmd)) == 0) {
+		int l = strlen(CmdTable[i].cmd);
+
+		// The whole first word, "write" must not match "writed"
+		if (strncmp(serialCmd, CmdTable[i].cmd, l) == 0 &&
+		    (serialCmd[l] == 0 || serialCmd[l] == DELIM[0])) {
 			parse_start();
+			TRACE_BEGIN(TR_COMMAND, CmdTable[i].op);
+			CmdTable[i].handler();
+			TRACE_END(TR_COMMAND, CmdTable[i].op);
+			break;
+		}
+	}
+}
+
+// A binary command is a FRAME_COMMAND with a sequence number (varint),
+// the opcode and the typed arguments. Every one is answered with a
+// FRAME_STATUS carrying the same sequence number and the outcome, so
+// the host can send many commands back to back and match the replies
+// up later. Text output of the command is sent as usual.
+static void cmd_frame() {
+	static tFrame reply;
+	tTime seq;
+	unsigned char op;
+	int i;
+
+	if (cmdFrame.type != FRAME_COMMAND)
+		return;
+	if (!frame_get_varint(&cmdFrame, &seq) || !frame_get_byte(&cmdFrame, &op)) {
+		SerialUSB.println("ERROR Malformed command frame");
+		return;
+	}
+
+	if (debug) {
+		SerialUSB.print("DEBUG Command frame: ");
+		SerialUSB.print((unsigned long)seq);
+		SerialUSB.print(DELIM);
+		SerialUSB.println(op);
+	}
+
+	Status = E_UNKNOWN;
+	for (i = 0; i < sizeof(CmdTable) / sizeof(tCmdTableEntry); i++) {
+		if (CmdTable[i].op == op) {
+			Status = E_OK;
+			P_f = &cmdFrame;
+			TRACE_BEGIN(TR_COMMAND, op);
 			CmdTable[i].handler();
+			TRACE_END(TR_COMMAND, op);
+			P_f = NULL;
+			break;
 		}
 	}
+
+	frame_begin(&reply, FRAME_STATUS);
+	frame_varint(&reply, seq);
+	frame_byte(&reply, Status);
+	frame_send(&reply);
 }
 
-void SerialMonitor_log(unsigned long t, char k, int v) {
-	static unsigned long last_t = 0;
+// Only the first problem is reported
+void SerialMonitor_status(int status) {
+	if (Status == E_OK)
+		Status = status;
+}
+
+// Print doesn't know about 64 bit integers
+static void print_time(tTime t) {
+	char buf[21];
+	int i = sizeof(buf) - 1;
+
+	buf[i] = 0;
+	do {
+		buf[--i] = '0' + t % 10;
+		t /= 10;
+	} while (t);
+	SerialUSB.print(&buf[i]);
+}
 
-	if (!last_t)
+// Start a VAL line. Times are reported relative to the previous line.
+// The absolute device time is sent in a TIME line first, and again
+// whenever the difference would not fit into 32 bit.
+static void log_start(tTime t) {
+	static bool started = false;
+	static tTime last_t = 0;
+	long long d = t - last_t;
+
+	// The swinging door reports points after the fact, so d can
+	// be negative
+	if (!started || d > 0x7fffffffLL || d < -0x7fffffffLL) {
+		SerialUSB.print("TIME");
+		SerialUSB.print(DELIM);
+		print_time(t);
+		SerialUSB.println("");
 		last_t = t;
+		started = true;
+	}
 
 	SerialUSB.print("VAL");
 	SerialUSB.print(DELIM);
-	SerialUSB.print((unsigned long)(t-last_t));
+	SerialUSB.print((long)(t-last_t));
+	last_t = t;
+}
+
+// For values that don't come from a source
+void SerialMonitor_log(tTime t, char k, int v) {
+	if (stream_mode) {
+		encoder_one(t, k, v);
+		return;
+	}
+
+	log_start(t);
 	SerialUSB.print(DELIM);
 	SerialUSB.print(k);
 	SerialUSB.print(DELIM);
 	SerialUSB.println(v);
-	last_t = t;
 }
 
+// Report values from the sources with the given indexes. Several
+// values taken at the same time go onto one line, as additional
+// key/value pairs. Indexes of -1 are skipped.
+void SerialMonitor_log_row(tTime t, int n, const int *idx, const int *v) {
+	tTime now;
+	int j;
+
+	if (stream_mode) {
+		encoder_row(t, n, idx, v);
+		return;
+	}
+
+	now = master_time();
+	TRACE_BEGIN(TR_FLUSH, 0);
+	log_start(t);
+	for (j = 0; j < n; j++) {
+		if (idx[j] < 0)
+			continue;
+		SerialUSB.print(DELIM);
+		SerialUSB.print(Sources->s[idx[j]].k);
+		SerialUSB.print(DELIM);
+		SerialUSB.print(v[j]);
+	}
+	SerialUSB.println("");
+	stats_flush(master_time() - now);
+	TRACE_END(TR_FLUSH, 0);
+}
+
+// Loss counters, sent every heartbeat_period: time, records queued and
+// dropped, the high-water mark of rb since the last heartbeat, serial
+// input overflows, corrupt frames, output stalls and log events lost,
+// then key and drops of every source that has lost samples.
+void SerialMonitor_heartbeat(tTime now) {
+	static tFrame f;
+	static tTime next = 0;
+	unsigned long v[7];
+	int i, j;
+
+	if (!heartbeat_period)
+		return;
+	if (now < next)
+		return;
+	next = now + heartbeat_period;
+
+	v[0] = rb.pushes();
+	v[1] = rb.drops();
+	v[2] = rb.high(true);
+	v[3] = LinkStats.rx_overflow;
+	v[4] = LinkStats.rx_corrupt;
+	v[5] = LinkStats.tx_stalls;
+	v[6] = log_lost();
+
+	if (stream_mode) {
+		frame_begin(&f, FRAME_HEARTBEAT);
+		frame_varint(&f, now);
+		for (j = 0; j < 7; j++)
+			frame_varint(&f, v[j]);
+		for (i = 0; i < Sources->entries; i++) {
+			if (!Sources->s[i].drops || !frame_room(&f, 6))
+				continue;
+			frame_byte(&f, Sources->s[i].k);
+			frame_varint(&f, Sources->s[i].drops);
+		}
+		frame_send(&f);
+		return;
+	}
+
+	SerialUSB.print("BEAT");
+	SerialUSB.print(DELIM);
+	print_time(now);
+	for (j = 0; j < 7; j++) {
+		SerialUSB.print(DELIM);
+		SerialUSB.print(v[j]);
+	}
+	for (i = 0; i < Sources->entries; i++) {
+		if (!Sources->s[i].drops)
+			continue;
+		SerialUSB.print(DELIM);
+		SerialUSB.print(Sources->s[i].k);
+		SerialUSB.print(DELIM);
+		SerialUSB.print(Sources->s[i].drops);
+	}
+	SerialUSB.println("");
+}
+
+// Room left in the feed of output k, the samples it has played and the
+// steps it had nothing to play for, both since it was added
+void SerialMonitor_credit(char k, int free, unsigned long played, unsigned long underruns) {
+	static tFrame f;
+
+	if (stream_mode) {
+		frame_begin(&f, FRAME_CREDIT);
+		frame_byte(&f, k);
+		frame_varint(&f, free);
+		frame_varint(&f, played);
+		frame_varint(&f, underruns);
+		frame_send(&f);
+		return;
+	}
+
+	SerialUSB.print("CREDIT");
+	SerialUSB.print(DELIM);
+	SerialUSB.print(k);
+	SerialUSB.print(DELIM);
+	SerialUSB.print(free);
+	SerialUSB.print(DELIM);
+	SerialUSB.print(played);
+	SerialUSB.print(DELIM);
+	SerialUSB.println(underruns);
+}
+
+// Reads what is available, but runs at most one command per call
 void SerialMonitor_poll(void) {
 	int c;
 
-	if (SerialUSB.available()) {
+	while (SerialUSB.available()) {
 		c = SerialUSB.read();
 
+		// Binary commands can come in between text lines
+		if (c == FRAME_SYNC || cmdFrame.rx) {
+			switch (frame_recv(&cmdFrame, c)) {
+			case 1:
+				cmd_frame();
+				return;
+			case -1:
+				LinkStats.rx_corrupt++;
+				SerialUSB.println("ERROR Corrupt command frame");
+				return;
+			}
+			continue;
+		}
+
 		switch (c) {
 		case '\r': cmd_execute();
+			   memset(serialCmd, 0, sizeof(serialCmd));
+			   return;
 		case '\b': memset(serialCmd, 0, sizeof(serialCmd));
 			   break;
 		default:
 			int l = strlen(serialCmd);
 			if (l < sizeof(serialCmd)-2)
 				serialCmd[l] = c;
-			else
+			else {
+				LinkStats.rx_overflow++;
 				SerialUSB.println("ERROR Input buffer overflow");
+			}
 		}
 	}
 }
 
 void SerialMonitor_setup(void) {
 	memset(serialCmd, 0, sizeof(serialCmd));
+	memset(&cmdFrame, 0, sizeof(cmdFrame));
 	SerialUSB.begin(115200);
 }
 
@@ -23,9 +23,26 @@
 
 #define DELIM " "
 
+// Outcome of a command, reported in FRAME_STATUS replies
+#define E_OK		0
+#define E_ARGS		1	// Missing or malformed arguments
+#define E_UNKNOWN	2	// Unknown command
+#define E_NOKEY		3	// No such source, output or pattern
+#define E_EXISTS	4	// Key already in use
+#define E_FULL		5	// Table full
+#define E_PORT		6	// Invalid port
+#define E_INVALID	7	// Argument out of range
+#define E_STATE		8	// Not possible right now
+#define E_LOAD		9	// The device could not keep up with it
+#define E_STORE		10	// No usable configuration in flash, or writing failed
+
 void SerialMonitor_poll(void);
 void SerialMonitor_setup(void);
-void SerialMonitor_log(unsigned long t, char k, int v);
+void SerialMonitor_log(tTime t, char k, int v);
+void SerialMonitor_log_row(tTime t, int n, const int *idx, const int *v);
+void SerialMonitor_status(int status);
+void SerialMonitor_heartbeat(tTime now);
+void SerialMonitor_credit(char k, int free, unsigned long played, unsigned long underruns);
 
 #endif
 
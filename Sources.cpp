@@ -19,27 +19,44 @@
 #include "Sources.h"
 #include "SerialMonitor.h"
 #include "Lowlevel.h"
+#include "Trace.h"
 
-tSources Sources;
+// Two copies of the table; Sources is the one the ISR reads from,
+// SourcesNext is where the next configuration is assembled.
+static tSources _sources[2];
+tSources *Sources = &_sources[0];
+tSources *SourcesNext = &_sources[1];
 
 RingBuf rb;
 
-static void source_add_value(int i);
+tBackpressure Backpressure = { .high = RINGBUFFER_SIZE * 3 / 4,
+	.low = RINGBUFFER_SIZE / 4, .active = false, .changes = 0 };
+
+// What sources_process() has reported so far; caught up with the
+// counters whenever sources_setup() starts them over
+static unsigned long _reported_drops;
+static unsigned int _reported_changes;
+
+static void source_add_value(int i, tTime t);
 
 void sources_setup(void) {
 	int i;
 
 	noInterrupts();
-	for (i = 0; i < Sources.entries; i++)
-		if (Sources.s[i].irq)
-			detachInterrupt(Sources.s[i].irq);
+	for (i = 0; i < Sources->entries; i++)
+		if (Sources->s[i].irq)
+			detachInterrupt(Sources->s[i].irq);
 	rb.setup();
-	memset(&Sources, 0, sizeof(tSources));
+	_reported_drops = 0;
+	_reported_changes = Backpressure.changes;
+	memset(_sources, 0, sizeof(_sources));
+	Sources = &_sources[0];
+	SourcesNext = &_sources[1];
 	interrupts();
 }
 
 static void source_update_method(int i) {
-	tSourceEntry *s = &Sources.s[i];
+	tSourceEntry *s = &SourcesNext->s[i];
 
 	if (!s->period && s->p) {
 		s->method = 2;
@@ -54,33 +71,42 @@ static void source_update_method(int i) {
 }
 
 // Not to be called in interrupt context!
-void source_add(char k, char *portname, int period, int avg, int mode, int delta) {
+void source_add(char k, char *portname, int period, int avg, int mode, int delta, int phase) {
 	int i;
 	tSourceEntry *s;
 
-	if (Sources.entries >= SOURCES_MAX) {
+	if (SourcesNext->entries >= SOURCES_MAX) {
+		SerialMonitor_status(E_FULL);
 		SerialUSB.println("ERROR Too many sources defined.");
 		return;
 	}
 	if (avg > SAMPLES_MAX) {
+		SerialMonitor_status(E_INVALID);
 		SerialUSB.println("ERROR Averaging too many samples");
 		return;
 	}
+	if (phase < 0) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Phase must not be negative");
+		return;
+	}
 
-	for (i = 0; i < Sources.entries; i++) {
-		if (Sources.s[i].k == k) {
+	for (i = 0; i < SourcesNext->entries; i++) {
+		if (SourcesNext->s[i].k == k) {
+			SerialMonitor_status(E_EXISTS);
 			SerialUSB.println("ERROR That source key already exists.");
 			return;
 		}
 	}
 
-	s = &Sources.s[Sources.entries];
+	s = &SourcesNext->s[SourcesNext->entries];
 	memset(s, 0, sizeof(tSourceEntry));
 	s->k = k;
 	s->p = port_lookup(portname);
 	// This allows zero as a special case for interrupt-driven
 	// sources
 	if ((s->p < 0) || (s->p > 0 && !PortList[s->p].rfunc)) {
+		SerialMonitor_status(E_PORT);
 		SerialUSB.println("ERROR Invalid port for input");
 		return;
 	}
@@ -88,22 +114,24 @@ void source_add(char k, char *portname, int period, int avg, int mode, int delta
 	s->period = period;
 	s->avg = avg;
 	s->delta = delta;
-	source_update_method(Sources.entries);
+	s->phase = phase;
+	s->countdown = period + phase;
+	s->fresh = true;
+	source_update_method(SourcesNext->entries);
 
-	noInterrupts();
-	Sources.entries++;
-	master_period();
-	interrupts();
+	SourcesNext->entries++;
 }
 
 // So yes, this is a bit ugly. It's needed because IRQ handlers don't
 // take arguments; there's one IRQ handler per source table entry.
 
 #define _IRQ_Handler_X(n) static void _IRQ_Handler_##n(void) { \
-	if (Sources.s[n].count_ticks) \
-		Sources.s[n].ticks++; \
+	TRACE_BEGIN(TR_IRQ, n); \
+	if (Sources->s[n].count_ticks) \
+		Sources->s[n].ticks++; \
 	else \
-		source_add_value(n); \
+		source_add_value(n, master_time()); \
+	TRACE_END(TR_IRQ, n); \
 }
 
 _IRQ_Handler_X(0);
@@ -135,24 +163,26 @@ void (*IRQ_Handlers[SOURCES_MAX])(void) =
 
 void source_attach_irq(char k, char *irqpin, int trigger, int count_ticks) {
 	int i, irq;
-	tSourceEntry *s;
+	tSourceEntry *s = NULL;
 
 	i = port_lookup(irqpin);
 	if (i < 1 || i > 54) {
 		// 54 = Magic number! Last digital PIN on the arduino
 		// in the table, the last one that can be used as an IRQ
+		SerialMonitor_status(E_PORT);
 		SerialUSB.println("ERROR Invalid pin for IRQ specified");
 		return;
 	}
 	irq = port_name2id(irqpin);
 
-	for (i = 0; i < Sources.entries; i++) {
-		s = &Sources.s[i];
+	for (i = 0; i < SourcesNext->entries; i++) {
+		s = &SourcesNext->s[i];
 		if (s->k == k)
 			break;
 	}
 
-	if (i == Sources.entries) {
+	if (i == SourcesNext->entries) {
+			SerialMonitor_status(E_NOKEY);
 			SerialUSB.println("WARN This source key does not exist");
 			return;
 	}
@@ -162,69 +192,335 @@ void source_attach_irq(char k, char *irqpin, int trigger, int count_ticks) {
 	else if (trigger == 1)
 		trigger = RISING;
 	else if (trigger == 2)
-		trigger == CHANGE;
+		trigger = CHANGE;
 	else {
+		SerialMonitor_status(E_INVALID);
 		SerialUSB.print("WARN Unknown IRQ trigger specified.");
 		return;
 	}
 
-	s->irq = irq;
-	s->trigger = trigger;
-	s->count_ticks = count_ticks;
-
-	if (s->count_ticks && !s->period) {
+	if (count_ticks && !s->period) {
+		SerialMonitor_status(E_INVALID);
 		SerialUSB.println("WARN Counting ticks requires period to be non-zero");
 		return;
 	}
 
-	noInterrupts();
-	source_update_method(i);
-	if (IRQ_Handlers[i]) {
-		attachInterrupt(irq, IRQ_Handlers[i], trigger);
-	} else {
-		SerialUSB.println("ERROR No IRQ handler available!?");
+	if (s->group) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Group members cannot have an IRQ");
+		return;
 	}
-	interrupts();
+
+	// The handler itself is attached once the table is published
+	s->irq = irq;
+	s->trigger = trigger;
+	s->count_ticks = count_ticks;
+	source_update_method(i);
 }
 
 void source_del(char k) {
 	int i;
-	tSourceEntry *s, *o;
+	tSourceEntry *s = NULL, *o;
 
-	for (i = 0; i < Sources.entries; i++) {
-		s = &Sources.s[i];
+	for (i = 0; i < SourcesNext->entries; i++) {
+		s = &SourcesNext->s[i];
 		if (s->k == k)
 			break;
 	}
 
-	if (i == Sources.entries) {
+	if (i == SourcesNext->entries) {
+			SerialMonitor_status(E_NOKEY);
 			SerialUSB.println("WARN This source key does not exist");
 			return;
 	}
-	
-	if (s->irq)
-		detachInterrupt(s->irq);
-	
-	o = &Sources.s[Sources.entries-1];
 
-	noInterrupts();
+	// Members of a deleted group go back to being on their own
+	for (i = 0; i < SourcesNext->entries; i++) {
+		if (SourcesNext->s[i].group == k)
+			SourcesNext->s[i].group = 0;
+	}
+
+	o = &SourcesNext->s[SourcesNext->entries-1];
+
 	// This can happen if this is the last entry already. Not
 	// harmful, but why risk it?
 	if (s != o)
 		memcpy(s, o, sizeof(tSourceEntry));
 	memset(o, 0, sizeof(tSourceEntry));
-	Sources.entries--;
+	SourcesNext->entries--;
+}
+
+// Start a new shadow configuration from the live one. The ISR may be
+// updating the live house keeping fields while we copy; those are
+// carried over again in sources_swap().
+void sources_begin(void) {
+	memcpy(SourcesNext, Sources, sizeof(tSources));
+}
+
+// Work out where each live entry ends up in the shadow table (-1 if it
+// is gone), carry over the main loop state, and detach the IRQs that
+// won't survive the swap unchanged. map is indexed by the live index.
+void sources_prepare(signed char *map) {
+	int i, j;
+
+	// The indexes are final now, so this is where group members
+	// can be resolved for the ISR.
+	for (i = 0; i < SourcesNext->entries; i++) {
+		tSourceEntry *s = &SourcesNext->s[i];
+
+		s->members = 0;
+		for (j = 0; j < SourcesNext->entries; j++) {
+			if (SourcesNext->s[j].group != s->k)
+				continue;
+			if (s->members < GROUP_MAX-1)
+				s->member[(int)s->members++] = j;
+		}
+	}
+
+	for (j = 0; j < Sources->entries; j++) {
+		tSourceEntry *o = &Sources->s[j];
+
+		map[j] = -1;
+		for (i = 0; i < SourcesNext->entries; i++) {
+			tSourceEntry *s = &SourcesNext->s[i];
+
+			if (s->k == o->k && !s->fresh) {
+				map[j] = i;
+				memcpy(s->buf, o->buf, sizeof(s->buf));
+				s->cur = o->cur;
+				s->filled = o->filled;
+				s->last_v = o->last_v;
+				if (s->sdt == o->sdt)
+					s->door = o->door;
+				break;
+			}
+		}
+
+		if (!o->irq)
+			continue;
+		if (map[j] != j || SourcesNext->s[j].irq != o->irq
+				|| SourcesNext->s[j].trigger != o->trigger)
+			detachInterrupt(o->irq);
+	}
+}
+
+// Only to be called with interrupts disabled! Bounded by SOURCES_MAX
+// plus the ring buffer size, no matter how much has changed.
+void sources_swap(const signed char *map) {
+	tSources *old = Sources;
+	int j;
+
+	for (j = 0; j < old->entries; j++) {
+		tSourceEntry *o = &old->s[j];
+		tSourceEntry *s;
+
+		if (map[j] < 0)
+			continue;
+		s = &SourcesNext->s[map[j]];
+		s->countdown = o->countdown;
+		s->ticks = o->ticks;
+		s->last_t = o->last_t;
+		s->shed_count = o->shed_count;
+		s->shed_sum = o->shed_sum;
+		s->cost = o->cost;
+		s->resid = o->resid;
+		s->drops = o->drops;
+		s->raw = o->raw;
+	}
+
+	Sources = SourcesNext;
+	SourcesNext = old;
+	rb.remap(map);
+}
+
+// Attach the IRQs of entries that are new, have moved, or changed their
+// trigger. SourcesNext holds the previous live table at this point.
+void sources_finish(const signed char *map) {
+	int i;
+
+	for (i = 0; i < Sources->entries; i++) {
+		tSourceEntry *s = &Sources->s[i];
+		tSourceEntry *o = &SourcesNext->s[i];
+		bool attached;
+
+		attached = i < SourcesNext->entries && map[i] == i
+			&& o->irq == s->irq && o->trigger == s->trigger;
+
+		s->fresh = false;
+		if (s->irq && !attached)
+			attachInterrupt(s->irq, IRQ_Handlers[i], s->trigger);
+	}
+}
+
+// Add a source to the group of another one. With leader = '-', the
+// source leaves its group again.
+void source_group(char leader, char k) {
+	tSourceEntry *s = NULL, *l = NULL;
+	int i, n = 1;
+
+	for (i = 0; i < SourcesNext->entries; i++) {
+		tSourceEntry *e = &SourcesNext->s[i];
+
+		if (e->k == k)
+			s = e;
+		if (e->k == leader)
+			l = e;
+		if (e->group == leader)
+			n++;
+	}
+
+	if (!s) {
+		SerialMonitor_status(E_NOKEY);
+		SerialUSB.println("WARN This source key does not exist");
+		return;
+	}
+
+	if (leader == '-') {
+		s->group = 0;
+		return;
+	}
+
+	if (!l || l == s) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Invalid group leader");
+		return;
+	}
+	if (l->group || l->method != 0) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Group leader must be a plain port source");
+		return;
+	}
+	if (s->p < 1 || s->irq) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Group members must read a port and have no IRQ");
+		return;
+	}
+	if (s->sdt || l->sdt) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Sources in a group cannot use the swinging door");
+		return;
+	}
+	for (i = 0; i < SourcesNext->entries; i++) {
+		if (SourcesNext->s[i].group == k) {
+			SerialMonitor_status(E_INVALID);
+			SerialUSB.println("ERROR Group members cannot lead a group themselves");
+			return;
+		}
+	}
+	if (s->group != leader && n >= GROUP_MAX) {
+		SerialMonitor_status(E_FULL);
+		SerialUSB.println("ERROR Too many sources in this group");
+		return;
+	}
+
+	s->group = leader;
+}
+
+void source_shed(char k, int shed, int n) {
+	int i;
+
+	for (i = 0; i < SourcesNext->entries; i++) {
+		if (SourcesNext->s[i].k == k)
+			break;
+	}
+	if (i == SourcesNext->entries) {
+		SerialMonitor_status(E_NOKEY);
+		SerialUSB.println("WARN This source key does not exist");
+		return;
+	}
+	if (shed < 0 || shed > 2 || (shed && n < 2)) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Invalid backpressure mode");
+		return;
+	}
+
+	SourcesNext->s[i].shed = shed;
+	SourcesNext->s[i].shed_n = n;
+	SourcesNext->s[i].shed_count = 0;
+	SourcesNext->s[i].shed_sum = 0;
+}
+
+void source_sdt(char k, int dev, int max) {
+	int i, j;
 
-	master_period();
+	for (i = 0; i < SourcesNext->entries; i++) {
+		if (SourcesNext->s[i].k == k)
+			break;
+	}
+	if (i == SourcesNext->entries) {
+		SerialMonitor_status(E_NOKEY);
+		SerialUSB.println("WARN This source key does not exist");
+		return;
+	}
+	if (dev < 0 || max < 0) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Invalid swinging door parameters");
+		return;
+	}
+	// Groups are reported row by row, see sources_process()
+	for (j = 0; j < SourcesNext->entries && dev; j++) {
+		if (SourcesNext->s[j].group == k || (j == i && SourcesNext->s[j].group)) {
+			SerialMonitor_status(E_INVALID);
+			SerialUSB.println("ERROR Sources in a group cannot use the swinging door");
+			return;
+		}
+	}
 
+	SourcesNext->s[i].sdt = dev;
+	SourcesNext->s[i].sdt_max = max ? max : 0x7fffffff;
+	memset(&SourcesNext->s[i].door, 0, sizeof(tSwingDoor));
+}
+
+void sources_backpressure(int high, int low) {
+	if (low < 0 || high <= low || high > RINGBUFFER_SIZE) {
+		SerialMonitor_status(E_INVALID);
+		SerialUSB.println("ERROR Invalid watermarks");
+		return;
+	}
+
+	noInterrupts();
+	Backpressure.high = high;
+	Backpressure.low = low;
 	interrupts();
 }
 
-static void source_add_value(int i) {
-	tSourceEntry *s = &Sources.s[i];
-	unsigned long t = micros();
+// Only to be called in interrupt context!
+static void sources_pressure(void) {
+	char e = rb.entries();
+
+	if (!Backpressure.active && e >= Backpressure.high) {
+		Backpressure.active = true;
+		Backpressure.changes++;
+	} else if (Backpressure.active && e <= Backpressure.low) {
+		Backpressure.active = false;
+		Backpressure.changes++;
+	}
+}
+
+// t is the time of the timer tick for scheduled samples; only
+// asynchronous events need to read the clock.
+static void source_sample(int i, tTime t) {
+	tSourceEntry *s = &Sources->s[i];
 	int v;
 
+	if (s->shed && !Backpressure.active && s->shed_count) {
+		s->shed_count = 0;
+		s->shed_sum = 0;
+	}
+
+	// Skipped samples aren't even read. Groups are only ever
+	// decimated; summing up every member would cost more than it
+	// saves.
+	if (Backpressure.active && (s->shed == 1 || (s->shed == 2 && s->members))) {
+		if (++s->shed_count < s->shed_n) {
+			// An interval is still measured from the last event
+			if (s->method == 2)
+				s->last_t = t;
+			return;
+		}
+		s->shed_count = 0;
+	}
+
 	switch (s->method) {
 	// Too much indirection?
 	case 0:	v = _port_read(s->p); break;
@@ -238,84 +534,307 @@ static void source_add_value(int i) {
 			 // counter isn't fully configured yet
 		break;
 	}
+	s->raw = v;
+
+	if (s->shed == 2 && Backpressure.active && !s->members) {
+		s->shed_sum += v;
+		if (++s->shed_count < s->shed_n)
+			return;
+		v = s->shed_sum / s->shed_count;
+		s->shed_count = 0;
+		s->shed_sum = 0;
+	}
+
+	if (s->members) {
+		// Read the rest of the group right away; they all share
+		// the timestamp taken above
+		int idx[GROUP_MAX], val[GROUP_MAX];
+		int j;
+
+		idx[0] = i;
+		val[0] = v;
+		for (j = 0; j < s->members; j++) {
+			idx[j+1] = s->member[j];
+			val[j+1] = _port_read(Sources->s[s->member[j]].p);
+			Sources->s[s->member[j]].raw = val[j+1];
+		}
+		if (!rb.push(t, s->members + 1, idx, val))
+			s->drops++;
+	} else {
+		if (!rb.push(t, i, v))
+			s->drops++;
+	}
+}
+
+// A periodic source with an IRQ attached comes here from both the timer
+// and the pin interrupt, so its cost is updated with them held off
+static void source_add_value(int i, tTime t) {
+	uint32_t primask = __get_PRIMASK();
+	unsigned long c = stats_cycles();
 
-	rb.push(t, i, v);
+	source_sample(i, t);
+	c = stats_cycles() - c;
+	noInterrupts();
+	stats_add(&Sources->s[i].cost, c);
+	if (!primask)
+		interrupts();
+}
+
+// Start all periodic sources over from a common epoch, which is the
+// next time the timer is started. Only with interrupts disabled!
+void sources_rewind(void) {
+	int i;
+
+	for (i = 0; i < Sources->entries; i++) {
+		tSourceEntry *s = &Sources->s[i];
+
+		s->countdown = s->period + s->phase;
+		s->ticks = 0;
+	}
 }
 
 // Only to be called in interrupt context!
 void sources_poll() {
 	int i;
 
-	for (i = 0; i < Sources.entries; i++) {
-		tSourceEntry *s = &Sources.s[i];
+	sources_pressure();
+
+	for (i = 0; i < Sources->entries; i++) {
+		tSourceEntry *s = &Sources->s[i];
 
-		/* Interrupt-driven source */
-		if (s->period == 0)
+		/* Interrupt-driven source, or sampled by a group leader */
+		if (s->period == 0 || s->group)
 			continue;
 
 		s->countdown -= Master.period;
 		if (s->countdown <= 0) {
 			s->countdown = s->period;
-			source_add_value(i);
+			source_add_value(i, Master.now);
 		}
 	}
 }
 
+// Run a new value through the averaging filters. Returns false if
+// there is nothing to report yet.
+static bool source_filter(tSourceEntry *s, int *v) {
+	long sum = 0;
+	int j;
+
+	if (s->avg <= 0)
+		return true;
+
+	s->buf[s->cur] = *v;
+
+	s->cur++;
+	if (s->cur == s->avg) {
+		s->cur = 0;
+		s->filled = true;
+	}
+
+	/* Always take a full sample first */
+	if (!s->filled)
+		return false;
+
+	// Mode 0 = sliding average
+	if (s->mode < 2) {
+		for (j = 0; j < s->avg; j++)
+			sum += s->buf[j];
+		*v = sum / s->avg;
+		// For mode 1, start each average fresh
+		s->filled = 0;
+	} else if (s->mode == 2) {
+		// mode 2 only reports if all values agree
+		// Especially for digital values this allows
+		// the source to settle
+		for (j = 1; j < s->avg; j++) {
+			if (s->buf[0] != s->buf[j]) {
+				*v = s->last_v;
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Swinging door compression: only report the points needed to
+// reconstruct the signal by straight lines with an error of at most
+// s->sdt. Returns true if a point is to be reported; that is usually
+// at the time of the one seen before (t, v), so both are updated.
+//
+// Unlike the textbook version, the door also closes when the line to
+// the newest sample doesn't pass through it. Reported points are
+// always raw samples and the line between two of them stays within
+// s->sdt of all the samples it covers. When s->sdt_max runs out, the
+// door is closed early, the same way.
+static bool source_door(tSourceEntry *s, tTime *t, int *v) {
+	tSwingDoor *d = &s->door;
+	long long dt, up, low, sn;
+	long long un, ud, ln, ld;
+	bool expired = d->started && *t - d->at >= (tTime)s->sdt_max;
+
+	// Nothing in between: the line to this sample is exact
+	if (!d->started || (expired && !d->held)) {
+		d->started = true;
+		d->held = false;
+		d->at = *t;
+		d->av = *v;
+		return true;
+	}
+
+	dt = *t - d->at;
+	if (dt <= 0)
+		return false;
+	up = (long long)*v + s->sdt - d->av;
+	low = (long long)*v - s->sdt - d->av;
+
+	if (!d->held) {
+		d->un = up;
+		d->ud = dt;
+		d->ln = low;
+		d->ld = dt;
+		d->held = true;
+		d->ht = *t;
+		d->hv = *v;
+		return false;
+	}
+
+	// Narrow the door; all denominators are positive
+	un = d->un;
+	ud = d->ud;
+	ln = d->ln;
+	ld = d->ld;
+	if (up * ud < un * dt) {
+		un = up;
+		ud = dt;
+	}
+	if (low * ld > ln * dt) {
+		ln = low;
+		ld = dt;
+	}
+
+	// Still open if the line to this sample passes through the door
+	sn = (long long)*v - d->av;
+	if (!expired && ln * dt <= sn * ld && sn * ud <= un * dt) {
+		d->un = un;
+		d->ud = ud;
+		d->ln = ln;
+		d->ld = ld;
+		d->ht = *t;
+		d->hv = *v;
+		return false;
+	}
+
+	// Closed: the segment ends at the last sample that still fit.
+	// The new door opens from there to this sample.
+	d->at = d->ht;
+	d->av = d->hv;
+	dt = *t - d->at;
+	d->un = (long long)*v + s->sdt - d->av;
+	d->ud = dt;
+	d->ln = (long long)*v - s->sdt - d->av;
+	d->ld = dt;
+	d->ht = *t;
+	d->hv = *v;
+
+	*t = d->at;
+	*v = d->av;
+	return true;
+}
+
+// A group is reported as one row if any of its members would be
+// reported on its own. Members that have nothing new to say are
+// reported with their last value.
+static void sources_process_group(tTime t, int n, int *idx, int *val) {
+	bool ready[GROUP_MAX];
+	bool report = false;
+	int j;
+
+	for (j = 0; j < n; j++) {
+		tSourceEntry *s;
+
+		ready[j] = false;
+		if (idx[j] < 0)
+			continue;
+		s = &Sources->s[idx[j]];
+		ready[j] = source_filter(s, &val[j]);
+		if (ready[j] && abs(s->last_v - val[j]) >= s->delta)
+			report = true;
+	}
+
+	if (!report)
+		return;
+
+	for (j = 0; j < n; j++) {
+		if (idx[j] < 0)
+			continue;
+		if (ready[j])
+			Sources->s[idx[j]].last_v = val[j];
+		else
+			val[j] = Sources->s[idx[j]].last_v;
+	}
+
+	SerialMonitor_log_row(t, n, idx, val);
+}
+
 void sources_process(void) {
 	tSourceEntry *s;
-	unsigned long t;
-	int v;
-	int i;
+	tTime t;
+	int idx[GROUP_MAX], val[GROUP_MAX];
+	int n, v;
 
-	if ((debug > 1) && rb.overflow()) {
-		SerialUSB.println("WARN Ring buffer has overflown!");
+	if (rb.drops() != _reported_drops) {
+		LOG_WARN(LOG_RB_OVERFLOW, (int)(rb.drops() - _reported_drops));
+		_reported_drops = rb.drops();
 	}
 
-	while (rb.entries()) {
-		/* Pull a value from the ring buffer and process it */
-		rb.pull(&t, &i, &v);
-		s = &Sources.s[i];
+	// Report every transition, even if several happened since the
+	// last time we got here
+	while (_reported_changes != Backpressure.changes) {
+		_reported_changes++;
+		SerialUSB.print("EVT backpressure ");
+		SerialUSB.print((int)((Backpressure.changes - _reported_changes) % 2 ?
+			!Backpressure.active : Backpressure.active));
+		SerialUSB.print(DELIM);
+		SerialUSB.println((int)rb.entries());
+	}
 
-		if (s->avg > 0) {
-			long sum = 0;
-			int j;
+	if (!rb.entries())
+		return;
 
-			s->buf[s->cur] = v;
+	TRACE_BEGIN(TR_DRAIN, rb.entries());
+	while (rb.entries()) {
+		/* Pull a record from the ring buffer and process it */
+		n = rb.pull(&t, idx, val);
+		// For groups, this is counted for the leader
+		if (idx[0] >= 0)
+			hist_add(&Sources->s[idx[0]].resid, master_time() - t);
+		if (n > 1) {
+			sources_process_group(t, n, idx, val);
+			continue;
+		}
 
-			s->cur++;
-			if (s->cur == s->avg) {
-				s->cur = 0;
-				s->filled = true;
-			}
+		// The source was deleted while this was queued
+		if (idx[0] < 0)
+			continue;
+		s = &Sources->s[idx[0]];
+		v = val[0];
 
-			/* Always take a full sample first */
-			if (!s->filled)
-				continue;
+		if (!source_filter(s, &v))
+			continue;
 
-			// Mode 0 = sliding average
-			if (s->mode < 2) {
-				for (j = 0; j < s->avg; j++)
-					sum += s->buf[j];
-				v = sum / s->avg;
-				// For mode 1, start each average fresh
-				s->filled = 0;
-			} else if (s->mode == 2) {
-				// mode 2 only reports if all values agree
-				// Especially for digital values this allows
-				// the source to settle
-				for (j = 1; j < s->avg; j++) {
-					if (s->buf[0] != s->buf[j]) {
-						v = s->last_v;
-						break;
-					}
-				}
+		if (s->sdt) {
+			if (source_door(s, &t, &v)) {
+				SerialMonitor_log_row(t, 1, idx, &v);
+				s->last_v = v;
 			}
+			continue;
 		}
 
 		if (abs(s->last_v - v) >= s->delta) {
-			SerialMonitor_log(t, s->k, v);
+			SerialMonitor_log_row(t, 1, idx, &v);
 			s->last_v = v;
 		}
 	}
+	TRACE_END(TR_DRAIN, 0);
 }
-
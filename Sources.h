@@ -21,8 +21,25 @@
 
 #include "GPIO_Platform.h"
 #include "RingBuf.h"
+#include "Stats.h"
 
 #define SAMPLES_MAX 32
+// Most sources sampled together as one group, including the leader
+#define GROUP_MAX RINGBUFFER_RECORD_MAX
+
+// State of the swinging door filter. The door is made up of the
+// steepest lower and the flattest upper slope, from the last reported
+// point to all points seen since, each as a fraction.
+typedef struct {
+	bool started;
+	bool held;	// (ht, hv) is valid
+	tTime at;	// Last reported point
+	int av;
+	tTime ht;	// Last point seen
+	int hv;
+	long long un, ud;	// Upper slope
+	long long ln, ld;	// Lower slope
+} tSwingDoor;
 
 typedef struct {
 	char k;
@@ -40,6 +57,18 @@ typedef struct {
 			// 2 = only report value if stable over the avg period
 			// 3 = Oversampling to improve resolution (TODO)
 	int delta;	// Report only if the value has changed by at least this
+	int phase;	// uS offset of the samples relative to the common
+			// start; sampling happens at start + phase + n*period
+	char group;	// Key of the source this one is sampled along
+			// with, 0 if none. Members are never polled on
+			// their own.
+	char shed;	// What to do under backpressure:
+			// 0 = nothing, full rate at all times
+			// 1 = only keep every shed_n'th sample
+			// 2 = report the average of shed_n samples
+	int shed_n;
+	int sdt;	// Swinging door: max. deviation, 0 = off
+	int sdt_max;	// Report at least this often (uS)
 
 	// For IRQs:
 	int irq;	// Port triggering the IRQ
@@ -50,12 +79,22 @@ typedef struct {
 	// House keeping:
 	int countdown;	// Ticks down on every invocation
 	int last_v;	// Last reported value, if only reporting changes
-	long last_t;	// For interrupt-driven sources: last tick
+	int raw;	// Last value read, for outputs modulated by it
+	tTime last_t;	// For interrupt-driven sources: last tick
 	int buf[SAMPLES_MAX]; // A buffer for averaging values
 	int cur;	// cursor in the buffer
 	int ticks;	// For IRQs: how often has this ticked in this period
+	int shed_count;	// Samples skipped or summed up under backpressure
+	long shed_sum;
+	tCost cost;	// Cycles spent taking samples
+	tHist resid;	// Time samples spent queued in rb
+	unsigned long drops;	// Samples lost because rb was full
 	bool filled;	// If the buffer has been filled at least once
+	tSwingDoor door;
 	unsigned char method; // Which method to use for acquiring values
+	bool fresh;	// Added since the last commit; nothing to carry over
+	char members;	// For group leaders: table indexes of the members,
+	signed char member[GROUP_MAX-1]; // worked out on commit
 } tSourceEntry;
 
 #define SOURCES_MAX 16
@@ -65,14 +104,42 @@ typedef struct {
 	tSourceEntry s[SOURCES_MAX];
 } tSources;
 
-extern tSources Sources;
+// The ISR only ever looks at the live table. Configuration changes are
+// made to the shadow copy and published by sources_swap().
+extern tSources *Sources;
+extern tSources *SourcesNext;
 
 extern RingBuf rb;
 
-void source_add(char k, char *portname, int period, int avg, int mode, int delta);
+// Load shedding once the ring buffer fills up. Above the high
+// watermark, sources that allow it are degraded until it has drained
+// below the low watermark again.
+typedef struct {
+	char high;
+	char low;
+	volatile bool active;
+	volatile unsigned int changes; // Transitions, counted by the ISR
+} tBackpressure;
+
+extern tBackpressure Backpressure;
+
+// These modify the shadow table only
+void source_add(char k, char *portname, int period, int avg, int mode, int delta, int phase);
 void source_del(char k);
+void source_group(char leader, char k);
+void source_shed(char k, int shed, int n);
+void source_sdt(char k, int dev, int max);
+void sources_backpressure(int high, int low);
 void sources_setup(void);
 
+// Publishing the shadow table, see Config.cpp
+void sources_begin(void);
+void sources_prepare(signed char *map);
+void sources_swap(const signed char *map);
+void sources_finish(const signed char *map);
+
+void sources_rewind(void);
+
 // Called from main code's interrupt handler
 void sources_poll(void);
 void sources_process(void);
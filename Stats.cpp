@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Stats.h"
+#include "Sources.h"
+#include "Outputs.h"
+
+tCost Stats[STATS_PATHS];
+const char *StatsNames[STATS_PATHS] = { "handler", "poll", "push", "process" };
+
+tHist HistLate;
+tHist HistFlush;
+
+tLinkStats LinkStats;
+
+void stats_setup(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	stats_reset();
+	noInterrupts();
+	hist_clear();
+	interrupts();
+}
+
+// Clears the paths, and the per source and output costs of the live
+// tables. Only with interrupts disabled!
+void stats_clear(void) {
+	int i;
+
+	memset(Stats, 0, sizeof(Stats));
+	for (i = 0; i < Sources->entries; i++)
+		memset(&Sources->s[i].cost, 0, sizeof(tCost));
+	for (i = 0; i < Outputs->entries; i++)
+		memset(&Outputs->out[i].cost, 0, sizeof(tCost));
+}
+
+// Same for the histograms; only with interrupts disabled!
+void hist_clear(void) {
+	int i;
+
+	memset(&HistLate, 0, sizeof(tHist));
+	memset(&HistFlush, 0, sizeof(tHist));
+	for (i = 0; i < Sources->entries; i++)
+		memset(&Sources->s[i].resid, 0, sizeof(tHist));
+}
+
+void stats_reset(void) {
+	noInterrupts();
+	stats_clear();
+	interrupts();
+}
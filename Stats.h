@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "GPIO_Platform.h"
+
+// CPU cost of the time critical paths, counted in CPU cycles with the
+// DWT cycle counter. Reading it costs a single load, so this is always
+// on.
+
+typedef struct {
+	unsigned long count;
+	unsigned long min;
+	unsigned long max;
+	unsigned long long total;
+} tCost;
+
+// Paths measured as a whole
+enum {
+	STATS_HANDLER,	// master_handler(), all of the timer ISR
+	STATS_POLL,	// sources_poll()
+	STATS_PUSH,	// outputs_push()
+	STATS_PROCESS,	// sources_process(), per pass of loop()
+	STATS_PATHS
+};
+
+extern tCost Stats[STATS_PATHS];
+extern const char *StatsNames[STATS_PATHS];
+
+// Histograms of times in uS, with log2 buckets: bucket 0 counts 0,
+// bucket b counts [2^(b-1), 2^b), and the last one everything above.
+#define HIST_BUCKETS	16
+
+typedef struct {
+	unsigned long n[HIST_BUCKETS];
+} tHist;
+
+extern tHist HistLate;	// How late the timer ISR ran
+extern tHist HistFlush;	// Handing one line or frame to SerialUSB
+
+// A write to SerialUSB taking this long (uS) counts as a stall
+#define TX_STALL	1000
+
+// Losses on the serial line, counted since boot
+typedef struct {
+	unsigned long rx_overflow;	// Bytes dropped, command line too long
+	unsigned long rx_corrupt;	// Command frames with a bad checksum
+	unsigned long tx_stalls;	// Slow writes, see TX_STALL
+} tLinkStats;
+
+extern tLinkStats LinkStats;
+
+void stats_setup(void);
+void stats_clear(void);
+void stats_reset(void);
+void hist_clear(void);
+
+inline unsigned long stats_cycles(void) {
+	return DWT->CYCCNT;
+}
+
+// A zeroed tCost is empty. Each one must only ever be updated from one
+// context, or with interrupts disabled.
+inline void stats_add(tCost *c, unsigned long cycles) {
+	if (!c->count || cycles < c->min)
+		c->min = cycles;
+	if (cycles > c->max)
+		c->max = cycles;
+	c->count++;
+	c->total += cycles;
+}
+
+// Same rule as for stats_add()
+inline void hist_add(tHist *h, unsigned long v) {
+	int b = v ? 32 - __builtin_clz(v) : 0;
+
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+	h->n[b]++;
+}
+
+// How long a write to SerialUSB took, in uS
+inline void stats_flush(unsigned long us) {
+	hist_add(&HistFlush, us);
+	if (us >= TX_STALL)
+		LinkStats.tx_stalls++;
+}
+
+#endif
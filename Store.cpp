@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "GPIO_Platform.h"
+#include "Store.h"
+#include "Config.h"
+#include "Budget.h"
+#include "Lowlevel.h"
+#include "SerialMonitor.h"
+#include <DueTimer.h>
+#include <DueFlashStorage.h>
+
+#define STORE_HEADER	12
+
+static DueFlashStorage flash;
+
+typedef struct {
+	unsigned char buf[STORE_HEADER + STORE_MAX];
+	int len;	// Bytes in buf, including the header
+	int pos;	// Read position
+	bool bad;	// Ran out of room, or past the end
+} tImage;
+
+static tImage Image;
+
+static void put_byte(tImage *im, unsigned char b) {
+	if (im->len < (int)sizeof(im->buf))
+		im->buf[im->len++] = b;
+	else
+		im->bad = true;
+}
+
+static void put_varint(tImage *im, uint32_t v) {
+	while (v >= 0x80) {
+		put_byte(im, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	put_byte(im, v);
+}
+
+static void put_svarint(tImage *im, int32_t v) {
+	put_varint(im, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static unsigned char get_byte(tImage *im) {
+	if (im->pos < im->len)
+		return im->buf[im->pos++];
+	im->bad = true;
+	return 0;
+}
+
+static uint32_t get_varint(tImage *im) {
+	uint32_t v = 0;
+	int shift = 0;
+	unsigned char b;
+
+	do {
+		b = get_byte(im);
+		v |= (uint32_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while ((b & 0x80) && shift < 35);
+	return v;
+}
+
+static int32_t get_svarint(tImage *im) {
+	uint32_t u = get_varint(im);
+
+	return (int32_t)((u >> 1) ^ (0 - (u & 1)));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+
+// CRC-32 (IEEE), bit by bit; the image is small and rarely read
+static uint32_t store_crc(const unsigned char *p, int n) {
+	uint32_t crc = 0xffffffff;
+	int k;
+
+	while (n--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+// PortList index of a digital pin that can take an interrupt
+static int store_irq_port(int pin) {
+	int i;
+
+	for (i = 1; i <= DIGITAL_MAX + 1; i++)
+		if (PortList[i].p == pin)
+			return i;
+	return 0;
+}
+
+static unsigned char store_trigger(int trigger) {
+	switch (trigger) {
+	case RISING:	return 1;
+	case CHANGE:	return 2;
+	default:	return 0;
+	}
+}
+
+// Only the live tables are saved; a batch that is not committed yet
+// is not part of the image.
+bool store_save(void) {
+	tImage *im = &Image;
+	int i, j, n;
+
+	memset(im, 0, sizeof(tImage));
+	im->len = STORE_HEADER;
+
+	put_byte(im, (Master.started ? 1 : 0) | (stream_mode ? 2 : 0));
+	put_byte(im, Backpressure.high);
+	put_byte(im, Backpressure.low);
+	put_svarint(im, Budget.limit);
+	put_byte(im, Budget.mode);
+
+	for (i = 0, n = 0; i <= DAC_MAX; i++)
+		if (PinModes[i])
+			n++;
+	put_byte(im, n);
+	for (i = 0; i <= DAC_MAX; i++) {
+		if (!PinModes[i])
+			continue;
+		put_byte(im, i);
+		put_byte(im, PinModes[i] - 1);
+	}
+
+	put_byte(im, Sources->entries);
+	for (i = 0; i < Sources->entries; i++) {
+		tSourceEntry *s = &Sources->s[i];
+
+		put_byte(im, s->k);
+		put_varint(im, s->p);
+		put_svarint(im, s->period);
+		put_svarint(im, s->avg);
+		put_svarint(im, s->mode);
+		put_svarint(im, s->delta);
+		put_svarint(im, s->phase);
+		put_byte(im, s->group);
+		put_byte(im, s->shed);
+		put_svarint(im, s->shed_n);
+		put_svarint(im, s->sdt);
+		put_svarint(im, s->sdt_max);
+		put_varint(im, s->irq ? store_irq_port(s->irq) : 0);
+		put_byte(im, store_trigger(s->trigger));
+		put_byte(im, s->count_ticks);
+	}
+
+	put_byte(im, Outputs->entries);
+	for (i = 0; i < Outputs->entries; i++) {
+		tOutputEntry *out = &Outputs->out[i];
+
+		put_byte(im, out->k);
+		put_varint(im, out->p);
+		put_svarint(im, out->period);
+		// The ISR flips the sign in mode 1
+		put_svarint(im, abs(out->step));
+		put_svarint(im, out->offset);
+		put_svarint(im, out->mode);
+		put_varint(im, out->v - Patterns);
+		put_svarint(im, out->phase);
+		put_byte(im, out->bus.n);
+		for (j = 0; j < out->bus.n; j++)
+			put_varint(im, out->bus.idx[j]);
+		for (j = 0; j < 2; j++) {
+			tMod *m = &out->mod[j];
+
+			put_byte(im, m->shape);
+			if (!m->shape)
+				continue;
+			put_svarint(im, m->from);
+			put_svarint(im, m->to);
+			put_svarint(im, m->time);
+			put_byte(im, m->mode);
+			put_byte(im, m->src);
+		}
+	}
+
+	if (im->bad) {
+		SerialMonitor_status(E_FULL);
+		SerialUSB.println("ERROR Configuration too large to save");
+		return false;
+	}
+
+	put_u32(im->buf, STORE_MAGIC);
+	im->buf[4] = STORE_VERSION;
+	im->buf[5] = 0;
+	im->buf[6] = (im->len - STORE_HEADER) & 0xff;
+	im->buf[7] = (im->len - STORE_HEADER) >> 8;
+	put_u32(im->buf + 8, store_crc(im->buf + STORE_HEADER,
+		im->len - STORE_HEADER));
+
+	if (!flash.write(STORE_ADDR, im->buf, im->len)) {
+		SerialMonitor_status(E_STORE);
+		SerialUSB.println("ERROR Writing to flash failed");
+		return false;
+	}
+	return true;
+}
+
+// Check the image and copy it to Image
+static int store_read(void) {
+	tImage *im = &Image;
+	const unsigned char *p = flash.readAddress(STORE_ADDR);
+	int len;
+
+	if (get_u32(p) != STORE_MAGIC)
+		return 0;
+
+	len = p[6] | p[7] << 8;
+	if (p[4] != STORE_VERSION || len > STORE_MAX) {
+		SerialMonitor_status(E_STORE);
+		SerialUSB.println("WARN Saved configuration is from another firmware version");
+		return -1;
+	}
+	if (store_crc(p + STORE_HEADER, len) != get_u32(p + 8)) {
+		SerialMonitor_status(E_STORE);
+		SerialUSB.println("ERROR Saved configuration is damaged");
+		return -1;
+	}
+
+	memset(im, 0, sizeof(tImage));
+	memcpy(im->buf, p, STORE_HEADER + len);
+	im->len = STORE_HEADER + len;
+	im->pos = STORE_HEADER;
+	return 1;
+}
+
+// Replaces the running configuration, in one batch, as if the commands
+// had been sent again
+int store_load(void) {
+	tImage *im = &Image;
+	tBudget budget = Budget;
+	unsigned char pins[DAC_MAX + 1], modes[DAC_MAX + 1];
+	unsigned char flags;
+	int high, low, npins;
+	int i, j, n, r;
+
+	r = store_read();
+	if (r <= 0)
+		return r;
+
+	config_begin();
+	while (SourcesNext->entries)
+		source_del(SourcesNext->s[0].k);
+	while (OutputsNext->entries)
+		output_del(OutputsNext->out[0].k);
+
+	// The settings outside the tables only change once the batch
+	// went through; the budget it is checked against is the saved one
+	flags = get_byte(im);
+	high = get_byte(im);
+	low = get_byte(im);
+	Budget.limit = get_svarint(im);
+	Budget.mode = get_byte(im);
+	if (low < 0 || high <= low || high > RINGBUFFER_SIZE ||
+	    Budget.limit < 1 || Budget.limit > 100 || Budget.mode > 2)
+		im->bad = true;
+
+	npins = get_byte(im);
+	if (npins > DAC_MAX + 1)
+		im->bad = true;
+	for (i = 0; i < npins && !im->bad; i++) {
+		pins[i] = get_byte(im);
+		modes[i] = get_byte(im);
+		if (pins[i] > DAC_MAX || modes[i] > 2)
+			im->bad = true;
+	}
+
+	n = get_byte(im);
+	for (i = 0; i < n && !im->bad; i++) {
+		char k = get_byte(im);
+		int p = get_varint(im);
+		int period = get_svarint(im);
+		int avg = get_svarint(im);
+		int mode = get_svarint(im);
+		int delta = get_svarint(im);
+		int phase = get_svarint(im);
+		char group = get_byte(im);
+		int shed = get_byte(im);
+		int shed_n = get_svarint(im);
+		int sdt = get_svarint(im);
+		int sdt_max = get_svarint(im);
+		int irq = get_varint(im);
+		int trigger = get_byte(im);
+		int count_ticks = get_byte(im);
+
+		if (p >= (int)(sizeof(PortList) / sizeof(tPortListEntry)) ||
+		    irq > DIGITAL_MAX + 1) {
+			im->bad = true;
+			break;
+		}
+		source_add(k, (char *)PortList[p].name, period, avg, mode,
+			delta, phase);
+		if (irq)
+			source_attach_irq(k, (char *)PortList[irq].name,
+				trigger, count_ticks);
+		// Members may come before their leader in the table
+		if (group) {
+			for (j = 0; j < SourcesNext->entries; j++)
+				if (SourcesNext->s[j].k == k)
+					break;
+			if (j == SourcesNext->entries) {
+				im->bad = true;
+				break;
+			}
+			SourcesNext->s[j].group = group;
+		}
+		if (shed)
+			source_shed(k, shed, shed_n);
+		if (sdt)
+			source_sdt(k, sdt, sdt_max);
+	}
+
+	n = get_byte(im);
+	for (i = 0; i < n && !im->bad; i++) {
+		char k = get_byte(im);
+		int p = get_varint(im);
+		int period = get_svarint(im);
+		int step = get_svarint(im);
+		int offset = get_svarint(im);
+		int mode = get_svarint(im);
+		int pattern = get_varint(im);
+		int phase = get_svarint(im);
+		int pins = get_byte(im);
+		int idx[BUS_MAX];
+
+		for (j = 0; j < pins && j < BUS_MAX; j++)
+			idx[j] = get_varint(im);
+		if (p >= (int)(sizeof(PortList) / sizeof(tPortListEntry)) ||
+		    pattern >= PatternCount || pins > BUS_MAX) {
+			im->bad = true;
+			break;
+		}
+		for (j = 0; j < pins; j++)
+			if (idx[j] >= (int)(sizeof(PortList) / sizeof(tPortListEntry)))
+				im->bad = true;
+		if (im->bad)
+			break;
+		if (pins)
+			output_bus(k, idx, pins, period, step, offset,
+				mode, Patterns[pattern].name, phase);
+		else
+			output_add(k, (char *)PortList[p].name, period, step,
+				offset, mode, Patterns[pattern].name, phase);
+		for (j = 0; j < 2; j++) {
+			int shape = get_byte(im);
+			int from, to, time, mmode;
+			char src;
+
+			if (!shape)
+				continue;
+			from = get_svarint(im);
+			to = get_svarint(im);
+			time = get_svarint(im);
+			mmode = get_byte(im);
+			src = get_byte(im);
+			output_mod(k, j, shape, from, to, time, mmode, src);
+		}
+	}
+
+	if (im->bad) {
+		config_abort();
+		Budget = budget;
+		SerialMonitor_status(E_STORE);
+		SerialUSB.println("ERROR Saved configuration is damaged");
+		return -1;
+	}
+	if (!config_commit()) {
+		Budget = budget;
+		return -1;
+	}
+
+	// Only once the new configuration is in place; a rejected one
+	// leaves the board running as it was
+	sources_backpressure(high, low);
+	for (i = 0; i < npins; i++)
+		port_mode(pins[i], modes[i]);
+	master_disarm();
+	Master.started = false;
+	Timer1.stop();
+
+	stream_mode = flags & 2 ? 1 : 0;
+	if (flags & 1)
+		master_start();
+	SerialUSB.println("INFO Configuration loaded");
+	return 1;
+}
+
+void store_erase(void) {
+	unsigned char none[4] = { 0, 0, 0, 0 };
+
+	if (!flash.write(STORE_ADDR, none, sizeof(none))) {
+		SerialMonitor_status(E_STORE);
+		SerialUSB.println("ERROR Writing to flash failed");
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include "GPIO_Platform.h"
+
+// The running configuration can be saved to flash and is restored at
+// boot, so the board starts sampling without the host having to send
+// it again. The image is
+//
+//	magic (4) version (1) 0 (1) len (2, LE) crc32 (4, LE) payload...
+//
+// with the payload made of varints, as in the binary stream. It holds
+// the pin modes, the sources and outputs as they would be configured
+// by commands, and the settings that go with them. Sources and
+// outputs refer to ports by their PortList index and to patterns by
+// their Patterns index; STORE_VERSION has to change with either table.
+
+#define STORE_MAGIC	0x4f495047	// "GPIO"
+#define STORE_VERSION	3
+#define STORE_ADDR	0	// Offset in the DueFlashStorage area
+#define STORE_MAX	1024	// Payload bytes
+
+// Returns 1 if a configuration was loaded, 0 if there is none, -1 if
+// the image is damaged or could not be applied
+int store_load(void);
+bool store_save(void);
+void store_erase(void);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Trace.h"
+#include "Frame.h"
+#include "Stats.h"
+
+#if TRACE
+
+static tTraceEntry Trace[TRACE_SIZE];
+static volatile int head = 0;		// Next entry to write
+static volatile bool wrapped = false;
+static volatile char mode = 0;
+
+// Safe to call from interrupt context
+void trace_event(unsigned char ev, unsigned char phase, int arg) {
+	uint32_t primask = __get_PRIMASK();
+	tTraceEntry *e;
+
+	if (!mode)
+		return;
+
+	noInterrupts();
+	e = &Trace[head];
+	e->cycles = stats_cycles();
+	e->ev = ev;
+	e->phase = phase;
+	e->arg = arg;
+	if (++head == TRACE_SIZE) {
+		head = 0;
+		wrapped = true;
+	}
+	// Keep what led up to the loss
+	if (ev == TR_DROP && mode == 2)
+		mode = 0;
+	if (!primask)
+		interrupts();
+}
+
+bool trace_mode(int m) {
+	noInterrupts();
+	if (m && !mode) {
+		head = 0;
+		wrapped = false;
+	}
+	mode = m;
+	interrupts();
+	return true;
+}
+
+// Oldest first. Each frame starts with the cycles per uS; each record
+// is event, phase, argument and the varint cycle counter.
+bool trace_dump(void) {
+	static tFrame f;
+	char m = mode;
+	int i, n, start;
+
+	// Don't record the dump itself
+	mode = 0;
+
+	n = wrapped ? TRACE_SIZE : head;
+	start = wrapped ? head : 0;
+
+	frame_begin(&f, FRAME_TRACE);
+	frame_varint(&f, SystemCoreClock / 1000000);
+	for (i = 0; i < n; i++) {
+		tTraceEntry *e = &Trace[(start + i) % TRACE_SIZE];
+
+		if (!frame_room(&f, 3 + 5)) {
+			frame_send(&f);
+			frame_begin(&f, FRAME_TRACE);
+			frame_varint(&f, SystemCoreClock / 1000000);
+		}
+		frame_byte(&f, e->ev);
+		frame_byte(&f, e->phase);
+		frame_byte(&f, e->arg);
+		frame_varint(&f, e->cycles);
+	}
+	frame_send(&f);
+
+	mode = m;
+	return true;
+}
+
+#else
+
+bool trace_mode(int) {
+	return false;
+}
+
+bool trace_dump(void) {
+	return false;
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "GPIO_Platform.h"
+
+// Execution trace: a flight recorder of timestamped begin/end events
+// of the timer ISR, pin IRQs, ring buffer pushes, draining and USB
+// writes. It costs RAM and a few cycles per event, so it is only built
+// with TRACE set to 1. Dumped with the trace_dump command; see
+// host/trace2json.py for turning that into a timeline.
+#ifndef TRACE
+#define TRACE 0
+#endif
+
+#define TRACE_SIZE	512	// Events kept, the oldest are overwritten
+
+// Events; the argument is noted for each
+enum {
+	TR_TICK,	// master_handler()
+	TR_IRQ,		// Pin IRQ handler, source index
+	TR_PUSH,	// Record queued, source index
+	TR_DROP,	// Record lost, source index
+	TR_DRAIN,	// sources_process() reporting, entries queued
+	TR_FLUSH,	// Write to SerialUSB, bytes (0 for text)
+	TR_COMMAND,	// Command run from SerialMonitor_poll()
+};
+
+// Phases, as in the Chrome trace format
+#define TR_BEGIN	'B'
+#define TR_END		'E'
+#define TR_INSTANT	'i'
+
+typedef struct {
+	unsigned long cycles;	// DWT cycle counter
+	unsigned char ev;
+	unsigned char phase;
+	unsigned char arg;
+} tTraceEntry;
+
+#if TRACE
+void trace_event(unsigned char ev, unsigned char phase, int arg);
+#define TRACE_BEGIN(ev, arg) trace_event(ev, TR_BEGIN, arg)
+#define TRACE_END(ev, arg) trace_event(ev, TR_END, arg)
+#define TRACE_INSTANT(ev, arg) trace_event(ev, TR_INSTANT, arg)
+#else
+#define TRACE_BEGIN(ev, arg) do { } while (0)
+#define TRACE_END(ev, arg) do { } while (0)
+#define TRACE_INSTANT(ev, arg) do { } while (0)
+#endif
+
+// 0 = off, 1 = recording, 2 = recording until a record is dropped
+bool trace_mode(int mode);
+bool trace_dump(void);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Reads the ring of gpio_aggd:
+//
+//   gpio_aggcat [--name /gpio] [--host] [--count seconds]
+//
+// prints every record as "port key time value", or with --count, the
+// samples per board and source after that many seconds. --host prints
+// the time on the host's clock, for boards gpio_aggd has synced.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include "Shm.h"
+
+static volatile sig_atomic_t Quit;
+
+static void quit(int) {
+	Quit = 1;
+}
+
+int main(int argc, char **argv) {
+	static unsigned long long count[SHM_BOARDS][256];
+	const char *name = SHM_NAME;
+	double seconds = 0;
+	bool host = false;
+	gpio::ShmReader r;
+	const gpio::tShmHeader *h;
+	std::chrono::steady_clock::time_point end;
+	int a, b, k;
+
+	for (a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "--name") && a + 1 < argc)
+			name = argv[++a];
+		else if (!strcmp(argv[a], "--host"))
+			host = true;
+		else if (!strcmp(argv[a], "--count") && a + 1 < argc)
+			seconds = atof(argv[++a]);
+		else
+			break;
+	}
+	if (a < argc) {
+		fprintf(stderr, "usage: %s [--name /gpio] [--host] "
+			"[--count seconds]\n", argv[0]);
+		return 2;
+	}
+	if (!r.open(name)) {
+		perror(name);
+		return 1;
+	}
+	h = r.header();
+
+	signal(SIGINT, quit);
+	signal(SIGTERM, quit);
+	end = std::chrono::steady_clock::now() +
+		std::chrono::microseconds((long long)(seconds * 1e6));
+	while (!Quit) {
+		const gpio::tShmRecord *p;
+		size_t n, i;
+
+		if (seconds && std::chrono::steady_clock::now() >= end)
+			break;
+		n = r.peek(&p, 4096);
+		if (!n) {
+			usleep(1000);
+			continue;
+		}
+		if (seconds) {
+			for (i = 0; i < n; i++)
+				count[p[i].board % SHM_BOARDS][(unsigned char)p[i].key]++;
+			if (!r.done(n))
+				fprintf(stderr, "overwritten while counting\n");
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			// Formatting is slow enough to be lapped; print a copy
+			gpio::tShmRecord c = p[i];
+			gpio::tClockFit f;
+
+			if (!r.done(1)) {
+				fprintf(stderr, "overwritten\n");
+				break;
+			}
+			if (host && r.clock(c.board, &f))
+				printf("%s %c %.0f %d\n", h->board[c.board].name,
+					c.key, gpio::clock_to_ref(f, c.t), c.v);
+			else if (!host)
+				printf("%s %c %llu %d\n", h->board[c.board % SHM_BOARDS].name,
+					c.key, (unsigned long long)c.t, c.v);
+		}
+	}
+
+	for (b = 0; seconds && b < (int)h->boards; b++) {
+		for (k = 0; k < 256; k++) {
+			if (count[b][k])
+				printf("%s %c %llu\n", h->board[b].name, k,
+					count[b][k]);
+		}
+	}
+	if (r.lost())
+		fprintf(stderr, "%llu records lost\n", (unsigned long long)r.lost());
+	return 0;
+}
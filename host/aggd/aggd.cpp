@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// The aggregator: owns the serial ports of several boards and publishes
+// their samples, merged, in a ring in shared memory (host/client/Shm.h)
+// for any number of local readers.
+//
+//   gpio_aggd [--name /gpio] [--size records] [--sync seconds] [--start] port...
+//
+// Each board is decoded on a thread of its own, by gpio::Client; one
+// more thread moves the batches into the ring. With --start, every
+// board is switched to the binary stream and started; otherwise they
+// run as configured, e.g. as restored from flash. Every --sync seconds
+// (5 by default, 0 for never) each board is pinged, and the fitted model
+// of its clock against the host's is put into the ring, so readers can
+// put all boards onto one timeline. Runs until killed, printing the
+// totals per board every ten seconds.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include "Client.h"
+#include "Shm.h"
+
+static volatile sig_atomic_t Quit;
+
+static void quit(int) {
+	Quit = 1;
+}
+
+typedef struct {
+	const char *port;
+	gpio::Client client;
+	gpio::Subscription *sub;
+	gpio::ClockModel clock;
+} tBoard;
+
+static tBoard Boards[SHM_BOARDS];
+static int BoardCount;
+
+// Pings take a round trip each, so not on the thread moving the samples
+static void sync_clocks(gpio::ShmWriter *w, double period) {
+	int i;
+
+	while (!Quit) {
+		for (i = 0; i < BoardCount && !Quit; i++) {
+			tBoard *b = &Boards[i];
+
+			if (b->client.sync(&b->clock, 4))
+				w->set_clock(i, b->clock.fitted());
+		}
+		for (i = 0; i < period * 10 && !Quit; i++)
+			usleep(100000);
+	}
+}
+
+static void report(gpio::ShmWriter *w) {
+	int i;
+
+	for (i = 0; i < BoardCount; i++) {
+		gpio::tClientStats s = Boards[i].client.counters();
+
+		printf("%s: %llu samples, %llu dropped, %lu frames lost, "
+			"%lu damaged, clock %+.1f ppm to %.0f uS\n", Boards[i].port,
+			(unsigned long long)w->board(i)->samples.load(),
+			(unsigned long long)w->board(i)->lost.load(),
+			s.gaps, s.corrupt, Boards[i].clock.drift_ppm(),
+			Boards[i].clock.error());
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	const char *name = SHM_NAME;
+	const char *ports[SHM_BOARDS];
+	size_t size = SHM_SIZE;
+	double period = 5;
+	bool start = false;
+	std::thread syncer;
+	gpio::ShmWriter w;
+	std::chrono::steady_clock::time_point next;
+	int a, i;
+
+	for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+		if (!strcmp(argv[a], "--name") && a + 1 < argc)
+			name = argv[++a];
+		else if (!strcmp(argv[a], "--size") && a + 1 < argc)
+			size = strtoul(argv[++a], NULL, 0);
+		else if (!strcmp(argv[a], "--sync") && a + 1 < argc)
+			period = atof(argv[++a]);
+		else if (!strcmp(argv[a], "--start"))
+			start = true;
+		else
+			break;
+	}
+	if (a == argc || (a < argc && argv[a][0] == '-') ||
+	    argc - a > SHM_BOARDS) {
+		fprintf(stderr, "usage: %s [--name /gpio] [--size records] "
+			"[--sync seconds] [--start] port...\n", argv[0]);
+		return 2;
+	}
+
+	for (; a < argc; a++) {
+		tBoard *b = &Boards[BoardCount];
+
+		b->port = ports[BoardCount] = argv[a];
+		b->sub = b->client.subscribe(NULL, 1024);
+		if (!b->client.open(b->port)) {
+			perror(b->port);
+			return 1;
+		}
+		BoardCount++;
+	}
+	if (!w.create(name, size, BoardCount, ports)) {
+		perror(name);
+		return 1;
+	}
+	if (start) {
+		for (i = 0; i < BoardCount; i++) {
+			std::future<int> s = Boards[i].client.stream(1);
+			std::future<int> r = Boards[i].client.start();
+
+			if (s.get() != gpio::E_OK || r.get() != gpio::E_OK)
+				fprintf(stderr, "%s: failed to start\n",
+					Boards[i].port);
+		}
+	}
+
+	signal(SIGINT, quit);
+	signal(SIGTERM, quit);
+	if (period > 0)
+		syncer = std::thread(sync_clocks, &w, period);
+	next = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!Quit) {
+		bool idle = true;
+
+		for (i = 0; i < BoardCount; i++) {
+			tBoard *b = &Boards[i];
+			gpio::tBatch *batch;
+
+			while ((batch = b->sub->pop())) {
+				w.publish(i, batch->key, batch->s, batch->n);
+				b->sub->release(batch);
+				idle = false;
+			}
+			w.board(i)->lost.store(b->sub->lost(), std::memory_order_relaxed);
+			w.board(i)->gaps.store(b->client.counters().gaps, std::memory_order_relaxed);
+		}
+		if (idle)
+			usleep(200);
+		if (std::chrono::steady_clock::now() >= next) {
+			report(&w);
+			next += std::chrono::seconds(10);
+		}
+	}
+
+	if (syncer.joinable())
+		syncer.join();
+	for (i = 0; i < BoardCount; i++)
+		Boards[i].client.close();
+	report(&w);
+	w.close();
+	return 0;
+}
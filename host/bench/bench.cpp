@@ -0,0 +1,865 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Microbenchmarks of the hot paths, run natively against the simulated
+// board in host/hal. Times are wall clock on the host, so only compare
+// them between runs on the same machine:
+//
+//   gpio_bench [--quick] [--save file] [--baseline file [--tolerance pct]]
+//
+// --save writes the results, --baseline fails the run if any benchmark
+// got slower than in that file by more than the tolerance (default 25%).
+
+#include <chrono>
+#include <vector>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "GPIO_Platform.h"
+#include "Sources.h"
+#include "Outputs.h"
+#include "Lowlevel.h"
+#include "RingBuf.h"
+#include "Encoder.h"
+#include "SerialMonitor.h"
+#include "Log.h"
+#include "hal.h"
+#include "Decoder.h"
+#include "Recording.h"
+#include "Shm.h"
+
+// From the sketch
+void setup(void);
+
+typedef std::chrono::steady_clock tClock;
+
+typedef struct {
+	char name[32];
+	int n;		// Channels
+	double ns;	// Per operation
+} tResult;
+
+#define RESULTS_MAX 64
+
+static tResult Results[RESULTS_MAX];
+static int ResultCount;
+static tResult Baseline[RESULTS_MAX];
+static int BaselineCount;
+static double Tolerance = 25;
+static int Failed;
+
+static long Rounds = 200000;
+
+#define BATCH_SAMPLES 256
+
+static double elapsed(tClock::time_point t0) {
+	return std::chrono::duration<double, std::nano>(tClock::now() - t0).count();
+}
+
+static void result(const char *name, int n, double ns, long ops) {
+	tResult *r;
+	int i;
+
+	ns /= ops;
+	printf("%-16s %3d %10.1f ns/op", name, n, ns);
+
+	for (i = 0; i < BaselineCount; i++) {
+		if (strcmp(Baseline[i].name, name) || Baseline[i].n != n)
+			continue;
+		printf("  (%+.0f%%)", (ns / Baseline[i].ns - 1) * 100);
+		if (ns > Baseline[i].ns * (1 + Tolerance / 100)) {
+			printf(" REGRESSION");
+			Failed++;
+		}
+		break;
+	}
+	printf("\n");
+
+	if (ResultCount == RESULTS_MAX)
+		return;
+	r = &Results[ResultCount++];
+	strlcpy(r->name, name, sizeof(r->name));
+	r->n = n;
+	r->ns = ns;
+}
+
+static void check(bool ok, const char *what) {
+	if (!ok) {
+		printf("FAILED %s\n", what);
+		Failed++;
+	}
+}
+
+/****************************************************************************
+ Driving the firmware
+ ****************************************************************************/
+
+static void input(const char *line) {
+	hal_serial_input(line, strlen(line));
+	hal_serial_input("\r", 1);
+}
+
+static void run(void) {
+	while (hal_serial_pending())
+		SerialMonitor_poll();
+}
+
+static void cmd(const char *fmt, ...) {
+	char line[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	input(line);
+	run();
+}
+
+// Power on, without the admission control; these configurations are
+// about measuring, not about whether the board could keep up
+static void board(void) {
+	hal_reset();
+	setup();
+	hal_serial_sink(hal_serial_discard);
+	cmd("debug 0");
+	cmd("budget 80 0");
+}
+
+static void drain(void) {
+	tTime t;
+	int idx[RINGBUFFER_RECORD_MAX], val[RINGBUFFER_RECORD_MAX];
+
+	while (rb.entries())
+		rb.pull(&t, idx, val);
+}
+
+// A timer tick's worth of sampling, as master_handler does it
+static void tick(void) {
+	Master.now += Master.period;
+	sources_poll();
+}
+
+static void add_sources(int n) {
+	int i;
+
+	cmd("begin");
+	for (i = 0; i < n; i++)
+		cmd("source_add %c a%d 1000 0 0 0", 'A' + i, i % 12);
+	cmd("commit");
+}
+
+static void add_outputs(int n) {
+	int i;
+
+	cmd("begin");
+	for (i = 0; i < n; i++)
+		cmd("output_add %c D%d 1000 1 0 0 sine", 'a' + i, 2 + i);
+	cmd("commit");
+}
+
+/****************************************************************************
+ Benchmarks
+ ****************************************************************************/
+
+// Every source is due on every tick. Runs as many ticks as fit into the
+// ring buffer, then empties it without the clock running.
+static void bench_poll(int n) {
+	int batch = RINGBUFFER_SIZE / 2 / n;
+	long ticks = 0;
+	double ns = 0;
+
+	board();
+	add_sources(n);
+	if (batch < 1)
+		batch = 1;
+
+	while (ticks < Rounds) {
+		tClock::time_point t0 = tClock::now();
+		int i;
+
+		for (i = 0; i < batch; i++)
+			tick();
+		ns += elapsed(t0);
+		ticks += batch;
+		drain();
+	}
+	result("sources_poll", n, ns, ticks);
+	check(rb.drops() == 0, "sources_poll lost samples");
+}
+
+// Reporting each queued value, as VAL lines or binary records
+static void bench_process(int n, int mode) {
+	int batch = RINGBUFFER_SIZE / 2 / n;
+	long values = 0;
+	double ns = 0;
+
+	board();
+	cmd("stream %d", mode);
+	add_sources(n);
+	if (batch < 1)
+		batch = 1;
+
+	while (values < Rounds) {
+		tClock::time_point t0;
+		int i;
+
+		for (i = 0; i < batch; i++)
+			tick();
+		values += rb.entries();
+		t0 = tClock::now();
+		sources_process();
+		ns += elapsed(t0);
+	}
+	result(mode ? "process_binary" : "process_text", n, ns, values);
+	check(rb.drops() == 0, "sources_process lost samples");
+}
+
+// One timer tick with every output due
+static void bench_push(int n) {
+	unsigned long writes;
+	tClock::time_point t0;
+	long i;
+
+	board();
+	add_outputs(n);
+	writes = hal_writes();
+
+	t0 = tClock::now();
+	for (i = 0; i < Rounds; i++)
+		outputs_push();
+	result("outputs_push", n, elapsed(t0), Rounds);
+	check(hal_writes() - writes == (unsigned long)Rounds * n,
+		"outputs_push missed writes");
+}
+
+// One timer tick writing an 8 bit counter to a bus: D33 to D40 are
+// PC1 to PC8, in order; D44 to D51 are PC19 down to PC12
+static void bench_bus(int mapped) {
+	tClock::time_point t0;
+	uint32_t want = 0;
+	long i;
+	int b;
+
+	board();
+	if (mapped)
+		cmd("output_bus a 1000 1 0 0 inc 0 D44 D45 D46 D47 D48 D49 D50 D51");
+	else
+		cmd("output_bus a 1000 1 0 0 inc 0 D33 D34 D35 D36 D37 D38 D39 D40");
+	check(Outputs->entries == 1 && Outputs->out[0].bus.shift == (mapped ? -1 : 1),
+		"output_bus did not take the pins");
+
+	t0 = tClock::now();
+	for (i = 0; i < Rounds; i++)
+		outputs_push();
+	result(mapped ? "outputs_bus_map" : "outputs_bus", 8, elapsed(t0), Rounds);
+
+	for (b = 0; b < 8; b++)
+		if (Rounds % 4096 & (1 << b))
+			want |= 1UL << (mapped ? 19 - b : 1 + b);
+	check(PIOC->PIO_ODSR == want, "outputs_push wrote the wrong bus value");
+}
+
+// Bus pins are only touched once the output goes live, and let go
+// when it is deleted
+static void bench_bus_claim(void) {
+	board();
+	memset(PinModes, 0, sizeof(PinModes));
+	cmd("begin");
+	cmd("output_bus a 1000 1 0 0 inc 0 D33 D34 D35 D36");
+	cmd("abort");
+	check(PinModes[33] == 0 && PIOC->PIO_OWER == 0,
+		"aborted bus took its pins");
+
+	cmd("begin");
+	cmd("output_bus a 1 1 0 0 inc 0 D33 D34 D35 D36");
+	cmd("budget 1 2");
+	cmd("commit");
+	cmd("budget 80 0");
+	check(Outputs->entries == 0 && PinModes[33] == 0 && PIOC->PIO_OWER == 0,
+		"rejected bus took its pins");
+
+	cmd("output_bus a 1000 1 0 0 inc 0 D33 D34 D35 D36");
+	check(PinModes[33] == 3 && PinModes[36] == 3 && PIOC->PIO_OWER == 0x1e,
+		"bus did not take its pins");
+	cmd("output_del a");
+	check(PIOC->PIO_OWDR == 0x1e, "deleted bus kept its pins");
+}
+
+// One timer tick of a chirp: a sine, its rate swept up and down by a
+// factor of 100 every 1000 steps, faded out over the same time. Checks
+// the sweep against the exact curve, the faded value, and an output
+// following another one.
+static void bench_mod(void) {
+	tClock::time_point t0;
+	tOutputEntry *out;
+	double want;
+	long i;
+	int v;
+
+	board();
+	cmd("begin");
+	cmd("output_add a DAC0 100 1 0 0 sine");
+	cmd("output_mod a 0 2 1000 100000 100000 2");
+	cmd("output_mod a 1 1 1000 0 100000 1");
+	cmd("output_add l none 100 1 0 0 inc");
+	cmd("output_add b DAC1 100 1 0 0 flip");
+	cmd("output_mod b 1 3 0 1000 0 0 l");
+	cmd("commit");
+	check(Outputs->entries == 3, "output_mod setup failed");
+	out = &Outputs->out[0];
+
+	// Each step uses the position before it moves on
+	for (i = 0; i < 500; i++)
+		outputs_push();
+	want = 1000 * pow(100, 499 / 1000.0);
+	check(fabs(out->mod[MOD_RATE].value / 65.536 - want) < want / 200,
+		"log sweep off its curve");
+	v = Patterns[2].v[out->last_step];
+	check(hal_written(DAC_MIN) == OUTPUT_MID + (int)(((long long)(v - OUTPUT_MID) *
+		out->mod[MOD_AMP].value) >> 16), "amplitude not applied");
+	// b's amplitude follows l's ramp, 0..4095 onto 0..1000 thousandths
+	v = Patterns[1].v[Outputs->out[1].last_step];
+	check(abs(Outputs->out[2].mod[MOD_AMP].value - (int)(65536LL * v >> 12)) <= 16,
+		"output does not follow its modulator");
+
+	// Up and down again
+	for (i = 0; i < 1500; i++)
+		outputs_push();
+	check(out->mod[MOD_RATE].value < 1000 * 65.536 * 1.01, "sweep did not come back");
+
+	t0 = tClock::now();
+	for (i = 0; i < Rounds; i++)
+		outputs_push();
+	result("outputs_mod", 3, elapsed(t0), Rounds);
+}
+
+// One timer tick playing a fed output, refilled from the main loop side
+// whenever it has played half of the feed
+static void bench_feed(void) {
+	int v[FEED_SIZE / 2];
+	bool order = true;
+	double ns = 0;
+	long i = 0;
+	int j;
+
+	board();
+	cmd("begin");
+	cmd("output_add a DAC0 1000 1 0 0 feed");
+	cmd("output_add b DAC1 1000 1 0 0 feed");
+	cmd("output_add c D2 1000 1 0 0 feed");
+	cmd("commit");
+	check(Outputs->entries == 2, "feed took a third output");
+	cmd("output_del b");
+
+	while (i < Rounds) {
+		tClock::time_point t0;
+
+		for (j = 0; j < FEED_SIZE / 2; j++)
+			v[j] = (i + j) & 4095;
+		output_feed('a', v, FEED_SIZE / 2);
+		t0 = tClock::now();
+		for (j = 0; j < FEED_SIZE / 2; j++)
+			outputs_push();
+		ns += elapsed(t0);
+		order = order && hal_written(DAC_MIN) == v[FEED_SIZE / 2 - 1];
+		i += FEED_SIZE / 2;
+	}
+	result("outputs_feed", 1, ns, i);
+	check(order, "outputs_push played the feed out of order");
+	check(Outputs->out[0].feed->underruns == 0, "feed ran dry");
+	outputs_push();
+	check(Outputs->out[0].feed->underruns == 1, "feed underrun not counted");
+}
+
+// A push and a pull, with the ring buffer half full
+static void bench_rb(void) {
+	tTime t;
+	int idx[RINGBUFFER_RECORD_MAX], val[RINGBUFFER_RECORD_MAX];
+	tClock::time_point t0;
+	long i;
+
+	board();
+	for (i = 0; i < RINGBUFFER_SIZE / 2; i++)
+		rb.push(i, 0, i);
+
+	t0 = tClock::now();
+	for (i = 0; i < Rounds; i++) {
+		rb.push(i, 0, i);
+		rb.pull(&t, idx, val);
+	}
+	result("rb_push_pull", 1, elapsed(t0), Rounds);
+	check(rb.drops() == 0, "ring buffer overflowed");
+}
+
+static size_t put_varint(unsigned char *p, unsigned long v) {
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+// A command frame for "backpressure 48 16"
+static size_t backpressure_frame(unsigned char *f, unsigned long seq) {
+	unsigned char p[32];
+	size_t len = put_varint(p, seq), i;
+	unsigned char s1 = 0, s2 = 0;
+
+	p[len++] = 0x16;
+	p[len++] = 0x01;	// ARG_INT, zig-zag
+	p[len++] = 48 << 1;
+	p[len++] = 0x01;
+	p[len++] = 16 << 1;
+
+	f[0] = 0xA5;
+	f[1] = 0x02;
+	f[2] = len & 0xff;
+	f[3] = len >> 8;
+	memcpy(f + 4, p, len);
+	for (i = 1; i < len + 4; i++) {
+		s1 = (s1 + f[i]) % 255;
+		s2 = (s2 + s1) % 255;
+	}
+	f[len + 4] = s1;
+	f[len + 5] = s2;
+	return len + 6;
+}
+
+// Parsing and running one command, text or binary, queued up front
+static void bench_cmd(int binary) {
+	long batch = 1000, done = 0;
+	double ns = 0;
+
+	board();
+	while (done < Rounds / 10) {
+		tClock::time_point t0;
+		long i;
+
+		for (i = 0; i < batch; i++) {
+			if (binary) {
+				unsigned char f[64];
+				hal_serial_input(f, backpressure_frame(f, done + i));
+			} else {
+				input("backpressure 48 16");
+			}
+		}
+		t0 = tClock::now();
+		run();
+		ns += elapsed(t0);
+		done += batch;
+	}
+	result(binary ? "cmd_binary" : "cmd_text", 1, ns, done);
+}
+
+// The host side of bench_process: decoding what the firmware sent, as
+// gpio::Client does it, in one go
+class CountSink : public gpio::DecoderSink {
+public:
+	CountSink(void) : n(0), sum(0) {}
+	void sample(char, gpio::tTime, int v) {
+		n++;
+		sum += v;
+	}
+	long n;
+	long sum;
+};
+
+static void bench_decode(int n, int mode) {
+	static char buf[1 << 24];
+	int batch = RINGBUFFER_SIZE / 2 / n;
+	long values = 0, rounds = 0;
+	size_t len;
+	double ns = 0;
+	CountSink sink;
+
+	board();
+	cmd("stream %d", mode);
+	add_sources(n);
+	hal_serial_take(buf, sizeof(buf));
+	hal_serial_sink(NULL);
+	if (batch < 1)
+		batch = 1;
+	while (values < Rounds) {
+		int i;
+
+		for (i = 0; i < batch; i++)
+			tick();
+		values += rb.entries();
+		sources_process();
+	}
+	// The last, partly filled frame
+	encoder_flush();
+	len = hal_serial_take(buf, sizeof(buf));
+
+	while (rounds * values < Rounds * 10) {
+		gpio::Decoder d(&sink);
+		tClock::time_point t0 = tClock::now();
+
+		check(d.feed((unsigned char *)buf, len) == len,
+			"decoder left bytes over");
+		ns += elapsed(t0);
+		rounds++;
+	}
+	result(mode ? "decode_binary" : "decode_text", n, ns, rounds * values);
+	check(sink.n == rounds * values, "decoder lost samples");
+}
+
+// Losses are reported as counted since the last report, also across a
+// clear, which starts the ring buffer's counters over
+static void bench_lost(void) {
+	static char buf[65536];
+	size_t n;
+	int i;
+
+	board();
+	hal_serial_sink(NULL);
+	cmd("stream 0");
+	add_sources(1);
+	for (i = 0; i < RINGBUFFER_SIZE + 40; i++)
+		tick();
+	sources_process();
+	log_poll();
+	cmd("clear");
+	add_sources(1);
+	for (i = 0; i < RINGBUFFER_SIZE + 4; i++)
+		tick();
+	sources_process();
+	log_poll();
+	n = hal_serial_take(buf, sizeof(buf) - 1);
+	buf[n] = 0;
+	check(strstr(buf, "40 records lost") && strstr(buf, "4 records lost") &&
+		!strstr(buf, "full, -"), "lost records miscounted after clear");
+	hal_serial_sink(hal_serial_discard);
+}
+
+// Under backpressure a group leader in mode 2 is decimated like mode 1
+static void bench_shed(void) {
+	int i;
+
+	board();
+	cmd("begin");
+	cmd("source_add A a0 1000 0 0 0");
+	cmd("source_add B a1 1000 0 0 0");
+	cmd("source_group A B");
+	cmd("source_shed A 2 4");
+	cmd("commit");
+	cmd("backpressure 2 1");
+	for (i = 0; i < 40; i++)
+		tick();
+	// A row of two takes two entries; active from the first on
+	check(Backpressure.active && rb.entries() == 2 * (1 + 39 / 4),
+		"group leader not decimated");
+	drain();
+}
+
+// Swinging door compression: the signal reconstructed from what was
+// reported has to stay within dev of every sample, also when the
+// maximum interval forces points out early.
+#define DOOR_SAMPLES 4096
+
+static int DoorV[DOOR_SAMPLES];
+static tTime DoorT[DOOR_SAMPLES];
+static int DoorN;
+
+static int door_read(int, unsigned long long) {
+	DoorT[DoorN] = Master.now;
+	return DoorV[DoorN++];
+}
+
+class KeepSink : public gpio::DecoderSink {
+public:
+	void sample(char, gpio::tTime t, int v) {
+		gpio::tSample s = { t, v };
+		got.push_back(s);
+	}
+	std::vector<gpio::tSample> got;
+};
+
+static void bench_door(void) {
+	static char buf[1 << 20];
+	tClock::time_point t0;
+	KeepSink sink;
+	double ns;
+	size_t len, j;
+	int i, v = 0, err = 0;
+
+	// Flat stretches, jumps and ramps, starting with 0 0 0 100
+	srand(32);
+	for (i = 0; i < DOOR_SAMPLES; i++) {
+		if (i == 3)
+			v = 100;
+		else if (i > 3 && rand() % 8 == 0)
+			v += rand() % 41 - 20;
+		else if (i > 3 && (i / 64) % 2)
+			v += 3;
+		DoorV[i] = v;
+	}
+	DoorN = 0;
+
+	board();
+	cmd("stream 1");
+	cmd("begin");
+	cmd("source_add A a0 1000 0 0 0");
+	cmd("source_sdt A 1 5000");
+	cmd("commit");
+	hal_reader(door_read);
+	hal_serial_take(buf, sizeof(buf));
+	hal_serial_sink(NULL);
+
+	t0 = tClock::now();
+	for (i = 0; i < DOOR_SAMPLES; i++) {
+		tick();
+		sources_process();
+	}
+	ns = elapsed(t0);
+	hal_reader(NULL);
+	result("process_door", 1, ns, DOOR_SAMPLES);
+
+	len = hal_serial_take(buf, sizeof(buf));
+	gpio::Decoder d(&sink);
+	d.feed((unsigned char *)buf, len);
+	check(sink.got.size() > 2 && sink.got[0].t == DoorT[0],
+		"door reported nothing");
+
+	// Every sample up to the last reported point lies within dev of
+	// the line between the reported points around it
+	for (i = 0, j = 1; i < DoorN && j < sink.got.size(); i++) {
+		const gpio::tSample &a = sink.got[j - 1], &b = sink.got[j];
+		double want;
+
+		if (DoorT[i] > b.t) {
+			j++;
+			i--;
+			continue;
+		}
+		want = a.v + (double)(b.v - a.v) * (DoorT[i] - a.t) / (b.t - a.t);
+		if (fabs(want - DoorV[i]) > 1)
+			err++;
+	}
+	check(err == 0, "door reconstruction off by more than dev");
+	for (j = 1; j < sink.got.size(); j++)
+		if (sink.got[j].t - sink.got[j - 1].t > 5000)
+			err++;
+	check(err == 0, "door interval longer than max");
+}
+
+// Writing what the board sent to a recording, and reading it back. The
+// samples are those of bench_process, decoded up front.
+static void bench_record(int n) {
+	char file[] = "/tmp/gpio_benchXXXXXX";
+	std::vector<gpio::tSample> got;
+	std::vector<char> keys;
+	std::vector<gpio::tSample> in;
+	tClock::time_point t0;
+	gpio::Recorder r;
+	gpio::Recording rec;
+	long i;
+	int fd, k;
+
+	fd = mkstemp(file);
+	if (fd < 0) {
+		perror(file);
+		Failed++;
+		return;
+	}
+	close(fd);
+
+	board();
+	add_sources(n);
+	while ((long)in.size() < Rounds) {
+		tTime t;
+		int idx[RINGBUFFER_RECORD_MAX], val[RINGBUFFER_RECORD_MAX];
+		int c;
+
+		tick();
+		while (rb.entries()) {
+			c = rb.pull(&t, idx, val);
+			for (k = 0; k < c; k++) {
+				gpio::tSample s = { t, val[k] };
+
+				keys.push_back('A' + idx[k]);
+				in.push_back(s);
+			}
+		}
+	}
+
+	r.open(file);
+	t0 = tClock::now();
+	for (i = 0; i < (long)in.size(); i++)
+		r.add(keys[i], in[i].t, in[i].v);
+	check(r.close(), "recorder failed to write");
+	result("record_write", n, elapsed(t0), in.size());
+
+	check(rec.open(file), "recording does not open");
+	t0 = tClock::now();
+	for (k = 0; k < n; k++)
+		rec.read('A' + k, 0, ~0ULL, got);
+	result("record_read", n, elapsed(t0), in.size());
+	check(got.size() == in.size(), "recording lost samples");
+
+	// A screen's worth of all of A, from the pyramid
+	std::vector<gpio::tBucket> cols;
+	tTime first = in[0].t, last = in[in.size() - 1].t;
+	long plots = 0;
+
+	t0 = tClock::now();
+	while (plots < 100) {
+		rec.plot('A', first, last + 1, 1000, cols);
+		plots++;
+	}
+	result("record_plot", n, elapsed(t0), plots);
+	rec.close();
+	unlink(file);
+}
+
+// Through the ring of gpio_aggd: a batch in, and read back in place
+static void bench_shm(void) {
+	const char *boards[] = { "bench" };
+	char name[32];
+	gpio::tSample s[BATCH_SAMPLES];
+	gpio::ShmWriter w;
+	gpio::ShmReader r;
+	tClock::time_point t0;
+	long done = 0;
+	long long sum = 0;
+	int i;
+
+	snprintf(name, sizeof(name), "/gpio_bench_%d", (int)getpid());
+	if (!w.create(name, SHM_SIZE, 1, boards) || !r.open(name)) {
+		perror(name);
+		Failed++;
+		return;
+	}
+	for (i = 0; i < BATCH_SAMPLES; i++) {
+		s[i].t = i;
+		s[i].v = i;
+	}
+
+	t0 = tClock::now();
+	while (done < Rounds * 10) {
+		const gpio::tShmRecord *p;
+		size_t n, j;
+
+		w.publish(0, 'A', s, BATCH_SAMPLES);
+		while ((n = r.peek(&p))) {
+			for (j = 0; j < n; j++)
+				sum += p[j].v;
+			r.done(n);
+			done += n;
+		}
+	}
+	result("shm_ring", 1, elapsed(t0), done);
+	check(r.lost() == 0 && sum > 0, "ring lost records");
+	w.close();
+}
+
+/****************************************************************************
+ Baselines
+ ****************************************************************************/
+
+static void load(const char *file) {
+	FILE *f = fopen(file, "r");
+	tResult *r;
+
+	if (!f) {
+		perror(file);
+		exit(2);
+	}
+	while (BaselineCount < RESULTS_MAX) {
+		r = &Baseline[BaselineCount];
+		if (fscanf(f, "%31s %d %lf", r->name, &r->n, &r->ns) != 3)
+			break;
+		BaselineCount++;
+	}
+	fclose(f);
+}
+
+static void save(const char *file) {
+	FILE *f = fopen(file, "w");
+	int i;
+
+	if (!f) {
+		perror(file);
+		exit(2);
+	}
+	for (i = 0; i < ResultCount; i++)
+		fprintf(f, "%s %d %.1f\n", Results[i].name, Results[i].n,
+			Results[i].ns);
+	fclose(f);
+}
+
+int main(int argc, char **argv) {
+	static const int chans[] = { 1, 4, 16 };
+	static const int outs[] = { 1, 4, 8 };
+	const char *save_to = NULL;
+	unsigned i;
+	int a;
+
+	for (a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "--quick")) {
+			Rounds = 2000;
+		} else if (!strcmp(argv[a], "--save") && a + 1 < argc) {
+			save_to = argv[++a];
+		} else if (!strcmp(argv[a], "--baseline") && a + 1 < argc) {
+			load(argv[++a]);
+		} else if (!strcmp(argv[a], "--tolerance") && a + 1 < argc) {
+			Tolerance = atof(argv[++a]);
+		} else {
+			fprintf(stderr, "usage: %s [--quick] [--save file] "
+				"[--baseline file [--tolerance pct]]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	for (i = 0; i < sizeof(chans) / sizeof(chans[0]); i++)
+		bench_poll(chans[i]);
+	for (i = 0; i < sizeof(chans) / sizeof(chans[0]); i++)
+		bench_process(chans[i], 0);
+	for (i = 0; i < sizeof(chans) / sizeof(chans[0]); i++)
+		bench_process(chans[i], 1);
+	for (i = 0; i < sizeof(outs) / sizeof(outs[0]); i++)
+		bench_push(outs[i]);
+	bench_bus(0);
+	bench_bus(1);
+	bench_bus_claim();
+	bench_shed();
+	bench_lost();
+	bench_door();
+	bench_feed();
+	bench_mod();
+	for (i = 0; i < sizeof(chans) / sizeof(chans[0]); i++)
+		bench_decode(chans[i], 0);
+	for (i = 0; i < sizeof(chans) / sizeof(chans[0]); i++)
+		bench_decode(chans[i], 1);
+	for (i = 0; i < sizeof(chans) / sizeof(chans[0]); i++)
+		bench_record(chans[i]);
+	bench_shm();
+	bench_rb();
+	bench_cmd(0);
+	bench_cmd(1);
+
+	if (save_to)
+		save(save_to);
+	return Failed ? 1 : 0;
+}
@@ -0,0 +1,740 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "Client.h"
+
+namespace gpio {
+
+#define FRAME_SYNC	0xA5
+#define FRAME_COMMAND	0x02
+
+#define ARG_INT		0x01
+#define ARG_CHAR	0x02
+#define ARG_STR		0x03
+
+#define READ_SIZE	65536
+
+/****************************************************************************
+ Subscriptions
+ ****************************************************************************/
+
+Subscription::Subscription(const char *keys, size_t batches)
+	: _pool(batches), _ready(batches), _free(batches), _lost(0) {
+	size_t i;
+
+	memset(_keys, 0, sizeof(_keys));
+	memset(_cur, 0, sizeof(_cur));
+	if (!keys || !*keys)
+		memset(_keys, 1, sizeof(_keys));
+	for (; keys && *keys; keys++)
+		_keys[(unsigned char)*keys] = true;
+	for (i = 0; i < batches; i++)
+		_free.push(&_pool[i]);
+}
+
+// On the reader thread
+void Subscription::add(char key, tTime t, int v) {
+	tBatch *&b = _cur[(unsigned char)key];
+
+	if (!b) {
+		if (!_free.pop(&b)) {
+			b = NULL;
+			_lost++;
+			return;
+		}
+		b->key = key;
+		b->n = 0;
+	}
+	b->s[b->n].t = t;
+	b->s[b->n].v = v;
+	if (++b->n == BATCH_MAX) {
+		_ready.push(b);
+		b = NULL;
+	}
+}
+
+// Hand over what there is at the end of each read, so a slow source
+// does not wait for a full batch
+void Subscription::flush(void) {
+	int k;
+
+	for (k = 0; k < 256; k++) {
+		if (_cur[k]) {
+			_ready.push(_cur[k]);
+			_cur[k] = NULL;
+		}
+	}
+}
+
+tBatch *Subscription::pop(void) {
+	tBatch *b;
+
+	return _ready.pop(&b) ? b : NULL;
+}
+
+// Polls with a short sleep; the queue has nothing to block on
+tBatch *Subscription::wait(int ms) {
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	tBatch *b;
+
+	while (!(b = pop())) {
+		if (std::chrono::steady_clock::now() >= end)
+			return NULL;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	return b;
+}
+
+void Subscription::release(tBatch *b) {
+	_free.push(b);
+}
+
+/****************************************************************************
+ The port and the reader
+ ****************************************************************************/
+
+Client::Client(void) : _fd(-1), _decoder(this), _seq(0), _read_time(0),
+	_ping_id(0), _bytes(0), _samples(0) {
+	_wake[0] = _wake[1] = -1;
+	memset(_credited, 0, sizeof(_credited));
+}
+
+Client::~Client(void) {
+	close();
+}
+
+bool Client::open(const char *path) {
+	struct termios tio;
+
+	// The device may have gone away on its own
+	if (_fd < 0 && _thread.joinable())
+		close();
+	if (_fd >= 0) {
+		errno = EBUSY;
+		return false;
+	}
+	_fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (_fd < 0)
+		return false;
+	if (tcgetattr(_fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(_fd, TCSANOW, &tio);
+		tcflush(_fd, TCIOFLUSH);
+	}
+	if (pipe(_wake)) {
+		::close(_fd);
+		_fd = -1;
+		return false;
+	}
+	_decoder.reset();
+	_thread = std::thread(&Client::reader, this);
+	return true;
+}
+
+void Client::close(void) {
+	if (!_thread.joinable())
+		return;
+	if (::write(_wake[1], "", 1) < 0) {
+		// The reader is stuck without it; nothing else to do
+	}
+	_thread.join();
+	::close(_wake[0]);
+	::close(_wake[1]);
+	if (_fd >= 0)
+		::close(_fd);
+	_fd = -1;
+	fail_all();
+}
+
+void Client::reader(void) {
+	std::vector<unsigned char> buf(READ_SIZE);
+	size_t have = 0;
+
+	for (;;) {
+		struct pollfd p[2] = {
+			{ _fd, POLLIN, 0 },
+			{ _wake[0], POLLIN, 0 },
+		};
+		ssize_t n;
+		size_t used;
+
+		if (poll(p, 2, -1) < 0 && errno != EINTR)
+			break;
+		// close() takes care of the rest
+		if (p[1].revents)
+			return;
+		if (!p[0].revents)
+			continue;
+
+		// Before the read, which may take a while to copy
+		_read_time = host_time();
+		n = ::read(_fd, &buf[have], buf.size() - have);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n <= 0)
+			break;
+		_bytes += n;
+		have += n;
+
+		{
+			std::lock_guard<std::mutex> l(_subs_lock);
+			size_t i;
+
+			used = _decoder.feed(&buf[0], have);
+			for (i = 0; i < _subs.size(); i++)
+				_subs[i]->flush();
+		}
+
+		// Only ever a partial line or frame left over
+		if (used < have)
+			memmove(&buf[0], &buf[used], have - used);
+		have -= used;
+	}
+
+	// The device went away: nothing is going to answer any more.
+	// Both locks, so neither a write nor a new command sees it half
+	// closed.
+	{
+		std::lock_guard<std::mutex> w(_write_lock);
+		std::lock_guard<std::mutex> l(_cmd_lock);
+
+		::close(_fd);
+		_fd = -1;
+	}
+	fail_all();
+}
+
+bool Client::send(const unsigned char *buf, size_t n) {
+	std::lock_guard<std::mutex> l(_write_lock);
+
+	while (n > 0) {
+		struct pollfd p = { _fd, POLLOUT, 0 };
+		ssize_t w = ::write(_fd, buf, n);
+
+		if (w > 0) {
+			buf += w;
+			n -= w;
+			continue;
+		}
+		if (w < 0 && errno != EAGAIN && errno != EINTR)
+			return false;
+		poll(&p, 1, 100);
+	}
+	return true;
+}
+
+void Client::fail_all(void) {
+	std::lock_guard<std::mutex> l(_cmd_lock);
+	std::map<unsigned long, std::promise<int> >::iterator i;
+	std::map<unsigned long, std::promise<tPong> >::iterator j;
+	tPong none = { 0, 0 };
+
+	for (i = _pending.begin(); i != _pending.end(); ++i)
+		i->second.set_value(E_CLOSED);
+	_pending.clear();
+	// Never received, see exchange()
+	for (j = _pongs.begin(); j != _pongs.end(); ++j)
+		j->second.set_value(none);
+	_pongs.clear();
+	wake();
+}
+
+// For play(), which waits on replies as well as credit. Taking the
+// lock makes sure it is either waiting already or sees the news.
+void Client::wake(void) {
+	{
+		std::lock_guard<std::mutex> l(_credit_lock);
+	}
+	_credit_cv.notify_all();
+}
+
+Subscription *Client::subscribe(const char *keys, size_t batches) {
+	std::lock_guard<std::mutex> l(_subs_lock);
+
+	_subs.push_back(std::unique_ptr<Subscription>(new Subscription(keys, batches)));
+	return _subs.back().get();
+}
+
+void Client::on_line(std::function<void(const char *, size_t)> fn) {
+	_on_line = fn;
+}
+
+void Client::on_heartbeat(std::function<void(const tHeartbeat &)> fn) {
+	_on_heartbeat = fn;
+}
+
+void Client::on_frame(std::function<void(unsigned char, const unsigned char *, size_t)> fn) {
+	_on_frame = fn;
+}
+
+tClientStats Client::counters(void) const {
+	tClientStats s;
+
+	s.bytes = _bytes.load();
+	s.samples = _samples.load();
+	s.corrupt = _decoder.corrupt();
+	s.gaps = _decoder.gaps();
+	return s;
+}
+
+/****************************************************************************
+ Decoded stream
+ ****************************************************************************/
+
+void Client::sample(char key, tTime t, int v) {
+	size_t i;
+
+	_samples.fetch_add(1, std::memory_order_relaxed);
+	for (i = 0; i < _subs.size(); i++) {
+		Subscription *s = _subs[i].get();
+
+		if (s->_keys[(unsigned char)key])
+			s->add(key, t, v);
+	}
+}
+
+void Client::status(unsigned long seq, int status) {
+	std::lock_guard<std::mutex> l(_cmd_lock);
+	std::map<unsigned long, std::promise<int> >::iterator i;
+
+	i = _pending.find(seq);
+	if (i == _pending.end())
+		return;
+	i->second.set_value(status);
+	_pending.erase(i);
+	wake();
+}
+
+void Client::pong(unsigned long id, tTime t) {
+	std::lock_guard<std::mutex> l(_cmd_lock);
+	std::map<unsigned long, std::promise<tPong> >::iterator i;
+	tPong p = { t, _read_time };
+
+	i = _pongs.find(id);
+	if (i == _pongs.end())
+		return;
+	i->second.set_value(p);
+	_pongs.erase(i);
+}
+
+void Client::credit(const tCredit &c) {
+	{
+		std::lock_guard<std::mutex> l(_credit_lock);
+
+		_credit[(unsigned char)c.key] = c;
+		_credited[(unsigned char)c.key] = true;
+	}
+	_credit_cv.notify_all();
+}
+
+void Client::heartbeat(const tHeartbeat &h) {
+	if (_on_heartbeat)
+		_on_heartbeat(h);
+}
+
+void Client::line(const char *s, size_t n) {
+	if (_on_line)
+		_on_line(s, n);
+}
+
+void Client::frame(unsigned char type, const unsigned char *p, size_t n) {
+	if (_on_frame)
+		_on_frame(type, p, n);
+}
+
+/****************************************************************************
+ Commands
+ ****************************************************************************/
+
+static void put_varint(std::vector<unsigned char> &b, unsigned long long v) {
+	while (v >= 0x80) {
+		b.push_back((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	b.push_back(v);
+}
+
+Client::Args &Client::Args::i(long long v) {
+	_buf.push_back(ARG_INT);
+	put_varint(_buf, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+	return *this;
+}
+
+Client::Args &Client::Args::c(char k) {
+	_buf.push_back(ARG_CHAR);
+	_buf.push_back(k);
+	return *this;
+}
+
+Client::Args &Client::Args::s(const char *str) {
+	size_t n = strlen(str);
+
+	if (n > 255)
+		n = 255;
+	_buf.push_back(ARG_STR);
+	_buf.push_back(n);
+	_buf.insert(_buf.end(), str, str + n);
+	return *this;
+}
+
+std::future<int> Client::command(unsigned char op, const Args &a) {
+	std::vector<unsigned char> f(4);
+	std::promise<int> p;
+	std::future<int> r = p.get_future();
+	unsigned int s1 = 0, s2 = 0;
+	unsigned long seq;
+	size_t i, len;
+
+	{
+		std::lock_guard<std::mutex> l(_cmd_lock);
+
+		if (_fd < 0) {
+			p.set_value(E_CLOSED);
+			return r;
+		}
+		seq = _seq++;
+		_pending[seq] = std::move(p);
+	}
+
+	put_varint(f, seq);
+	f.push_back(op);
+	f.insert(f.end(), a._buf.begin(), a._buf.end());
+	len = f.size() - 4;
+	f[0] = FRAME_SYNC;
+	f[1] = FRAME_COMMAND;
+	f[2] = len & 0xff;
+	f[3] = len >> 8;
+	for (i = 1; i < f.size(); i++) {
+		s1 = (s1 + f[i]) % 255;
+		s2 = (s2 + s1) % 255;
+	}
+	f.push_back(s1);
+	f.push_back(s2);
+
+	if (!send(&f[0], f.size())) {
+		std::lock_guard<std::mutex> l(_cmd_lock);
+		std::map<unsigned long, std::promise<int> >::iterator i =
+			_pending.find(seq);
+
+		if (i != _pending.end()) {
+			i->second.set_value(E_CLOSED);
+			_pending.erase(i);
+		}
+	}
+	return r;
+}
+
+std::future<int> Client::stop(void) {
+	return command(0x01);
+}
+
+std::future<int> Client::start(void) {
+	return command(0x02);
+}
+
+std::future<int> Client::arm(void) {
+	return command(0x03);
+}
+
+std::future<int> Client::arm(const char *pin, int trigger) {
+	return command(0x03, Args().s(pin).i(trigger));
+}
+
+std::future<int> Client::source_add(char k, const char *port, int period, int avg, int mode, int delta, int phase) {
+	return command(0x10, Args().c(k).s(port).i(period).i(avg).i(mode).i(delta).i(phase));
+}
+
+std::future<int> Client::source_attach_irq(char k, const char *pin, int trigger, int count_ticks) {
+	return command(0x11, Args().c(k).s(pin).i(trigger).i(count_ticks));
+}
+
+std::future<int> Client::source_del(char k) {
+	return command(0x12, Args().c(k));
+}
+
+std::future<int> Client::source_group(char leader, char k) {
+	return command(0x13, Args().c(leader).c(k));
+}
+
+std::future<int> Client::source_shed(char k, int shed, int n) {
+	return command(0x14, Args().c(k).i(shed).i(n));
+}
+
+std::future<int> Client::source_sdt(char k, int dev, int max) {
+	return command(0x15, Args().c(k).i(dev).i(max));
+}
+
+std::future<int> Client::backpressure(int high, int low) {
+	return command(0x16, Args().i(high).i(low));
+}
+
+std::future<int> Client::budget(int limit, int mode) {
+	return command(0x17, Args().i(limit).i(mode));
+}
+
+std::future<int> Client::output_add(char k, const char *port, int period, int step, int offset, int mode, const char *pattern, int phase) {
+	return command(0x20, Args().c(k).s(port).i(period).i(step).i(offset).i(mode).s(pattern).i(phase));
+}
+
+std::future<int> Client::output_reset(void) {
+	return command(0x21);
+}
+
+std::future<int> Client::output_del(char k) {
+	return command(0x22, Args().c(k));
+}
+
+std::future<int> Client::feed(char k, const int *v, int n) {
+	Args a;
+	int i;
+
+	a.c(k);
+	for (i = 0; i < n; i++)
+		a.i(v[i]);
+	return command(0x23, a);
+}
+
+std::future<int> Client::output_bus(char k, int period, int step, int offset, int mode, const char *pattern, int phase, const char *const *pins, int n) {
+	Args a;
+	int i;
+
+	a.c(k).i(period).i(step).i(offset).i(mode).s(pattern).i(phase);
+	for (i = 0; i < n; i++)
+		a.s(pins[i]);
+	return command(0x24, a);
+}
+
+std::future<int> Client::output_mod(char k, int what, int shape, int from, int to, int time, int mode, char src) {
+	Args a;
+
+	a.c(k).i(what).i(shape).i(from).i(to).i(time).i(mode);
+	if (shape == 3 || shape == 4)
+		a.c(src);
+	return command(0x25, a);
+}
+
+std::future<int> Client::begin(void) {
+	return command(0x30);
+}
+
+std::future<int> Client::commit(void) {
+	return command(0x31);
+}
+
+std::future<int> Client::abort(void) {
+	return command(0x32);
+}
+
+std::future<int> Client::pattern_list(void) {
+	return command(0x40);
+}
+
+std::future<int> Client::pin(const char *port, int mode) {
+	return command(0x41, Args().s(port).i(mode));
+}
+
+std::future<int> Client::debug(int level) {
+	return command(0x42, Args().i(level));
+}
+
+std::future<int> Client::stream(int mode) {
+	return command(0x43, Args().i(mode));
+}
+
+std::future<int> Client::dump(void) {
+	return command(0x44);
+}
+
+std::future<int> Client::clear(void) {
+	return command(0x45);
+}
+
+std::future<int> Client::help(void) {
+	return command(0x46);
+}
+
+std::future<int> Client::stats(int reset) {
+	return command(0x47, Args().i(reset));
+}
+
+std::future<int> Client::hist(int reset) {
+	return command(0x48, Args().i(reset));
+}
+
+std::future<int> Client::heartbeat(int ms) {
+	return command(0x49, Args().i(ms));
+}
+
+std::future<int> Client::trace(int mode) {
+	return command(0x4a, Args().i(mode));
+}
+
+std::future<int> Client::trace_dump(void) {
+	return command(0x4b);
+}
+
+std::future<int> Client::ping(int id) {
+	return command(0x4c, Args().i(id));
+}
+
+bool Client::exchange(tTime *sent, tTime *received, tTime *device, int timeout_ms) {
+	std::promise<tPong> p;
+	std::future<tPong> r = p.get_future();
+	std::future<int> s;
+	unsigned long id;
+	tPong pong;
+
+	{
+		std::lock_guard<std::mutex> l(_cmd_lock);
+
+		if (_fd < 0)
+			return false;
+		id = _ping_id++ & 0x3fffffff;
+		_pongs[id] = std::move(p);
+	}
+	*sent = host_time();
+	s = ping(id);
+	// The status comes after the reply; an old firmware only sends that
+	if (s.wait_for(std::chrono::milliseconds(timeout_ms)) != std::future_status::ready ||
+	    s.get() != E_OK ||
+	    r.wait_for(std::chrono::milliseconds(timeout_ms)) != std::future_status::ready) {
+		std::lock_guard<std::mutex> l(_cmd_lock);
+
+		_pongs.erase(id);
+		return false;
+	}
+	pong = r.get();
+	if (!pong.received)
+		return false;
+	*received = pong.received;
+	*device = pong.device;
+	return true;
+}
+
+int Client::sync(ClockModel *m, int n) {
+	tTime sent, received, device;
+	int i, ok = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!exchange(&sent, &received, &device))
+			continue;
+		m->exchange(sent, received, device);
+		ok++;
+	}
+	return ok;
+}
+
+bool Client::credit(char k, tCredit *c) {
+	std::lock_guard<std::mutex> l(_credit_lock);
+
+	if (!_credited[(unsigned char)k])
+		return false;
+	*c = _credit[(unsigned char)k];
+	return true;
+}
+
+// Values per feed command; each takes up to 4 bytes of the frame
+#define FEED_CHUNK 60
+
+// The credit the device reports is what was free once it had handled
+// the commands before; values of commands it has not answered yet are
+// still on their way and come off that.
+size_t Client::play(char k, const int *v, size_t n, int timeout_ms) {
+	std::deque<std::pair<std::future<int>, int> > flight;
+	size_t sent = 0, done = 0;
+	int queued = 0;
+	bool failed = false;
+
+	// An empty feed asks for the credit, and whether k is fed at all
+	flight.push_back(std::make_pair(feed(k, NULL, 0), 0));
+
+	while (!failed && (sent < n || !flight.empty())) {
+		std::unique_lock<std::mutex> l(_credit_lock);
+		std::chrono::steady_clock::time_point until =
+			std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(timeout_ms);
+		int room = 0;
+
+		for (;;) {
+			while (!flight.empty() && flight.front().first.wait_for(
+			    std::chrono::seconds(0)) == std::future_status::ready) {
+				if (flight.front().first.get() != E_OK)
+					failed = true;
+				else
+					done += flight.front().second;
+				queued -= flight.front().second;
+				flight.pop_front();
+			}
+			if (failed)
+				break;
+			if (sent < n && _credited[(unsigned char)k]) {
+				room = _credit[(unsigned char)k].free - queued;
+				if (room >= (int)std::min<size_t>(FEED_CHUNK, n - sent))
+					break;
+			}
+			if (sent == n && flight.empty())
+				break;
+			if (_credit_cv.wait_until(l, until) == std::cv_status::timeout)
+				return done;
+		}
+		l.unlock();
+
+		if (!failed && sent < n) {
+			int c = std::min<size_t>(std::min(room, FEED_CHUNK), n - sent);
+
+			flight.push_back(std::make_pair(feed(k, v + sent, c), c));
+			queued += c;
+			sent += c;
+		}
+	}
+	return done;
+}
+
+std::future<int> Client::save(void) {
+	return command(0x60);
+}
+
+std::future<int> Client::load(void) {
+	return command(0x61);
+}
+
+std::future<int> Client::erase(void) {
+	return command(0x62);
+}
+
+std::future<int> Client::writed(int pin, int value) {
+	return command(0x50, Args().i(pin).i(value));
+}
+
+std::future<int> Client::write(const char *port, int value) {
+	return command(0x51, Args().s(port).i(value));
+}
+
+std::future<int> Client::read(char k, const char *port) {
+	return command(0x52, Args().c(k).s(port));
+}
+
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CLIENT_CLIENT_H
+#define CLIENT_CLIENT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Clock.h"
+#include "Decoder.h"
+#include "Queue.h"
+
+// Host side of GPIO_Platform: owns the serial port, decodes the stream
+// on a reader thread and hands the samples to consumer threads in
+// batches per source. Commands are sent as binary command frames; each
+// returns a future for the status the device replies with.
+//
+//	gpio::Client c;
+//	gpio::Subscription *sub = c.subscribe("AB");
+//	c.open("/dev/ttyACM0");
+//	c.source_add('A', "a0", 1000, 0, 0, 0).get();
+//	c.start();
+//	for (;;) {
+//		gpio::tBatch *b = sub->wait(100);
+//		...
+//		sub->release(b);
+//	}
+
+namespace gpio {
+
+// Status of a command, as in SerialMonitor.h; E_CLOSED if the port was
+// closed, or the device went away, before the reply came
+enum {
+	E_OK = 0, E_ARGS, E_UNKNOWN, E_NOKEY, E_EXISTS, E_FULL, E_PORT,
+	E_INVALID, E_STATE, E_LOAD, E_STORE,
+	E_CLOSED = -1
+};
+
+#define BATCH_MAX 256
+
+// Consecutive samples of one source
+typedef struct {
+	char key;
+	int n;
+	tSample s[BATCH_MAX];
+} tBatch;
+
+// The samples of some sources, for one consumer thread. The batches
+// come from a fixed pool; if the consumer does not release them fast
+// enough, further samples are counted in lost() and dropped, the reader
+// never waits for a consumer.
+class Subscription {
+public:
+	// The next batch, or NULL if there is none
+	tBatch *pop(void);
+	// Same, but waits up to ms for one
+	tBatch *wait(int ms);
+	// Give a batch back once done with it
+	void release(tBatch *b);
+	unsigned long lost(void) const { return _lost.load(); }
+
+private:
+	friend class Client;
+	Subscription(const char *keys, size_t batches);
+	void add(char key, tTime t, int v);
+	void flush(void);
+
+	bool _keys[256];		// Which sources, all if none given
+	std::vector<tBatch> _pool;
+	SpscQueue<tBatch *> _ready;	// Reader to consumer
+	SpscQueue<tBatch *> _free;	// Consumer to reader
+	tBatch *_cur[256];		// Being filled, per key
+	std::atomic<unsigned long> _lost;
+};
+
+typedef struct {
+	unsigned long long bytes;	// Received
+	unsigned long long samples;	// Decoded
+	unsigned long corrupt;		// Frames dropped, damaged
+	unsigned long gaps;		// Sample frames lost
+} tClientStats;
+
+class Client : private DecoderSink {
+public:
+	Client(void);
+	~Client(void);
+
+	// A tty, set to raw mode. Returns false with errno set.
+	bool open(const char *path);
+	void close(void);
+
+	// Keys is a string of source keys, NULL or "" for all of them.
+	// The subscription lives as long as the client.
+	Subscription *subscribe(const char *keys, size_t batches = 64);
+
+	// Called on the reader thread; set them before open()
+	void on_line(std::function<void(const char *, size_t)> fn);
+	void on_heartbeat(std::function<void(const tHeartbeat &)> fn);
+	void on_frame(std::function<void(unsigned char, const unsigned char *, size_t)> fn);
+
+	tClientStats counters(void) const;
+
+	// A command by opcode, with the arguments already encoded
+	class Args {
+	public:
+		Args &i(long long v);
+		Args &c(char k);
+		Args &s(const char *str);
+	private:
+		friend class Client;
+		std::vector<unsigned char> _buf;
+	};
+	std::future<int> command(unsigned char op, const Args &a = Args());
+
+	// Every command of CmdTable; see README.md for the arguments
+	std::future<int> stop(void);
+	std::future<int> start(void);
+	std::future<int> arm(void);
+	std::future<int> arm(const char *pin, int trigger);
+	std::future<int> source_add(char k, const char *port, int period, int avg, int mode, int delta, int phase = 0);
+	std::future<int> source_attach_irq(char k, const char *pin, int trigger, int count_ticks);
+	std::future<int> source_del(char k);
+	std::future<int> source_group(char leader, char k);
+	std::future<int> source_shed(char k, int shed, int n);
+	std::future<int> source_sdt(char k, int dev, int max = 0);
+	std::future<int> backpressure(int high, int low);
+	std::future<int> budget(int limit, int mode);
+	std::future<int> output_add(char k, const char *port, int period, int step, int offset, int mode, const char *pattern, int phase = 0);
+	std::future<int> output_reset(void);
+	std::future<int> output_del(char k);
+	std::future<int> feed(char k, const int *v, int n);
+	std::future<int> output_bus(char k, int period, int step, int offset, int mode, const char *pattern, int phase, const char *const *pins, int n);
+	// src names the output or source followed by shapes 3 and 4
+	std::future<int> output_mod(char k, int what, int shape, int from, int to, int time, int mode, char src = 0);
+	std::future<int> begin(void);
+	std::future<int> commit(void);
+	std::future<int> abort(void);
+	std::future<int> pattern_list(void);
+	std::future<int> pin(const char *port, int mode);
+	std::future<int> debug(int level);
+	std::future<int> stream(int mode);
+	std::future<int> dump(void);
+	std::future<int> clear(void);
+	std::future<int> help(void);
+	std::future<int> stats(int reset);
+	std::future<int> hist(int reset);
+	std::future<int> heartbeat(int ms);
+	std::future<int> trace(int mode);
+	std::future<int> trace_dump(void);
+	std::future<int> ping(int id);
+	std::future<int> save(void);
+	std::future<int> load(void);
+	std::future<int> erase(void);
+	std::future<int> writed(int pin, int value);
+	std::future<int> write(const char *port, int value);
+	std::future<int> read(char k, const char *port);
+
+	// One ping exchange: host times of sending and receiving, device
+	// time in the reply. False if there was no reply within timeout.
+	bool exchange(tTime *sent, tTime *received, tTime *device, int timeout_ms = 1000);
+	// n exchanges into the model, returns how many worked
+	int sync(ClockModel *m, int n);
+
+	// The last credit report of fed output k; false if there was none
+	bool credit(char k, tCredit *c);
+	// Send n values to fed output k, as fast as its credit allows,
+	// waiting up to timeout_ms at a time for more. Returns how many
+	// the device took; fewer on a timeout or an error.
+	size_t play(char k, const int *v, size_t n, int timeout_ms = 1000);
+
+private:
+	void reader(void);
+	bool send(const unsigned char *buf, size_t n);
+	void fail_all(void);
+	void wake(void);
+
+	// DecoderSink, on the reader thread
+	void sample(char key, tTime t, int v);
+	void status(unsigned long seq, int status);
+	void heartbeat(const tHeartbeat &h);
+	void pong(unsigned long id, tTime t);
+	void credit(const tCredit &c);
+	void line(const char *s, size_t n);
+	void frame(unsigned char type, const unsigned char *p, size_t n);
+
+	int _fd;
+	int _wake[2];		// Pipe to stop the reader
+	std::thread _thread;
+	Decoder _decoder;
+
+	std::mutex _subs_lock;	// Taken once per read, not per sample
+	std::vector<std::unique_ptr<Subscription> > _subs;
+
+	std::mutex _write_lock;
+	std::mutex _cmd_lock;
+	unsigned long _seq;
+	std::map<unsigned long, std::promise<int> > _pending;
+
+	typedef struct {
+		tTime device, received;
+	} tPong;
+	tTime _read_time;	// Of the read being decoded
+	int _ping_id;
+	std::map<unsigned long, std::promise<tPong> > _pongs;
+
+	// Woken by credit reports and command replies
+	std::mutex _credit_lock;
+	std::condition_variable _credit_cv;
+	tCredit _credit[256];
+	bool _credited[256];
+
+	std::function<void(const char *, size_t)> _on_line;
+	std::function<void(const tHeartbeat &)> _on_heartbeat;
+	std::function<void(unsigned char, const unsigned char *, size_t)> _on_frame;
+
+	std::atomic<unsigned long long> _bytes;
+	std::atomic<unsigned long long> _samples;
+};
+
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <time.h>
+#include "Clock.h"
+
+namespace gpio {
+
+// Pairs with more error than this times the best one are left out
+#define CLOCK_FILTER	2.0
+// Floor for the error of a pair, so no single one decides the fit
+#define CLOCK_ERR_MIN	1.0
+// Crystals are good to well within this; a rate known less precisely,
+// say from two pings a moment apart, is worse than assuming none
+#define CLOCK_RATE_ERR	1e-4
+
+tTime host_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (tTime)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+ClockModel::ClockModel(size_t window) : _p(window ? window : 1) {
+	reset();
+}
+
+void ClockModel::reset(void) {
+	_next = 0;
+	_n = 0;
+	_xm = 0;
+	_ym = 0;
+	_b = 1;
+	_error = 0;
+}
+
+void ClockModel::exchange(tTime sent, tTime received, tTime device) {
+	if (received < sent)
+		return;
+	add(device, sent + (received - sent) / 2.0, (received - sent) / 2.0);
+}
+
+void ClockModel::add(double device, double ref, double err) {
+	tPoint *p = &_p[_next];
+
+	p->x = device;
+	p->y = ref;
+	p->err = err < CLOCK_ERR_MIN ? CLOCK_ERR_MIN : err;
+	_next = (_next + 1) % _p.size();
+	if (_n < _p.size())
+		_n++;
+	fit();
+}
+
+// Weighted least squares, around the means so the large absolute times
+// do not eat the precision of the doubles
+void ClockModel::fit(void) {
+	double best = INFINITY, limit;
+	double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double x0 = _p[(_next + _p.size() - 1) % _p.size()].x;
+	double y0 = _p[(_next + _p.size() - 1) % _p.size()].y;
+	size_t i;
+
+	for (i = 0; i < _n; i++) {
+		if (_p[i].err < best)
+			best = _p[i].err;
+	}
+	limit = best * CLOCK_FILTER;
+
+	for (i = 0; i < _n; i++) {
+		const tPoint *p = &_p[i];
+		double w, x, y;
+
+		if (p->err > limit)
+			continue;
+		w = 1 / (p->err * p->err);
+		x = p->x - x0;
+		y = p->y - y0;
+		sw += w;
+		sx += w * x;
+		sy += w * y;
+	}
+	sx /= sw;
+	sy /= sw;
+	for (i = 0; i < _n; i++) {
+		const tPoint *p = &_p[i];
+		double w, x, y;
+
+		if (p->err > limit)
+			continue;
+		w = 1 / (p->err * p->err);
+		x = p->x - x0 - sx;
+		y = p->y - y0 - sy;
+		sxx += w * x * x;
+		sxy += w * x * y;
+	}
+
+	_xm = x0 + sx;
+	_ym = y0 + sy;
+	// A single point, or all about at the same time: same rate as the
+	// reference
+	_b = sxx > 0 && 1 / sqrt(sxx) < CLOCK_RATE_ERR ? sxy / sxx : 1;
+
+	_error = 0;
+	for (i = 0; i < _n; i++) {
+		const tPoint *p = &_p[i];
+		double e;
+
+		if (p->err > limit)
+			continue;
+		e = fabs(to_ref(p->x) - p->y) + p->err;
+		if (e > _error)
+			_error = e;
+	}
+}
+
+double ClockModel::to_ref(double device) const {
+	return _ym + _b * (device - _xm);
+}
+
+tClockFit ClockModel::fitted(void) const {
+	tClockFit f = { _xm, _ym, _b, _error };
+
+	return f;
+}
+
+double clock_to_ref(const tClockFit &f, double device) {
+	return f.ym + f.b * (device - f.xm);
+}
+
+double ClockModel::to_device(double ref) const {
+	return _xm + (ref - _ym) / _b;
+}
+
+double ClockModel::drift_ppm(void) const {
+	return (1 / _b - 1) * 1e6;
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CLIENT_CLOCK_H
+#define CLIENT_CLOCK_H
+
+#include <stddef.h>
+#include <vector>
+#include "Decoder.h"
+
+// Every board counts its own uS from its own reset, off its own crystal.
+// A ClockModel relates the time of one board to a reference timeline,
+// the host's clock or another board, as
+//
+//	ref = a + b * device
+//
+// fitted to the latest pairs of times that are known to belong
+// together, each with how far off it may be:
+//
+// - ping exchanges with the host (Client::sync()): the device time in
+//   the reply was taken somewhere between sending and receiving, so
+//   ref is the middle of the two and the error half the round trip
+// - edges of a pulse wired to several boards and recorded by an IRQ
+//   source on each: ref is the time the reference board saw an edge,
+//   device the time this one saw the same edge, the error the
+//   interrupt latency
+//
+// Pairs with much more error than the best ones in the window, such as
+// a ping that waited behind a burst of samples, are left out of the fit.
+
+namespace gpio {
+
+// The host's monotonic clock in uS
+tTime host_time(void);
+
+// A fitted model on its own, ref = ym + b * (device - xm)
+typedef struct {
+	double xm, ym, b;
+	double error;
+} tClockFit;
+
+double clock_to_ref(const tClockFit &f, double device);
+
+class ClockModel {
+public:
+	explicit ClockModel(size_t window = 64);
+	void reset(void);
+
+	// A ping exchange, in host time, and the device time in the reply
+	void exchange(tTime sent, tTime received, tTime device);
+	// Device time and reference time of the same event, known to err
+	void add(double device, double ref, double err);
+
+	// With fewer than two pairs the model is an offset only
+	size_t points(void) const { return _n; }
+	double to_ref(double device) const;
+	double to_device(double ref) const;
+	// How much faster the device clock runs, in parts per million
+	double drift_ppm(void) const;
+	// Largest distance of a pair used in the fit from the model, plus
+	// its own error: the bound the model is known to keep over the
+	// window
+	double error(void) const { return _error; }
+	tClockFit fitted(void) const;
+
+private:
+	typedef struct {
+		double x, y, err;
+	} tPoint;
+
+	void fit(void);
+
+	std::vector<tPoint> _p;		// Ring of the latest pairs
+	size_t _next, _n;
+	// ref = _ym + _b * (device - _xm)
+	double _xm, _ym, _b, _error;
+};
+
+}
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include "Decoder.h"
+
+namespace gpio {
+
+#define FRAME_SYNC	0xA5
+#define FRAME_MAX	256
+#define FRAME_SAMPLES	0x01
+#define FRAME_STATUS	0x03
+#define FRAME_HEARTBEAT	0x07
+#define FRAME_PONG	0x09
+#define FRAME_CREDIT	0x0a
+
+#define REC_SAMPLE	0x00
+#define REC_SAME	0x10
+#define REC_RUN		0x20
+#define REC_PACK	0x30
+#define REC_KEY		0x40
+#define REC_ONE		0x50
+
+// Longer lines than this are garbage, not something to wait for the
+// end of
+#define LINE_MAX	4096
+
+// Readers for the payload of a frame. On running past the end, they
+// return 0 and set p past end, which the callers check once per record.
+static inline tTime get_varint(const unsigned char *&p, const unsigned char *end) {
+	tTime v = 0;
+	int shift = 0;
+
+	while (p < end) {
+		unsigned char b = *p++;
+
+		v |= (tTime)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return v;
+		shift += 7;
+	}
+	p = end + 1;
+	return 0;
+}
+
+static inline long long get_svarint(const unsigned char *&p, const unsigned char *end) {
+	tTime u = get_varint(p, end);
+
+	return (long long)(u >> 1) ^ -(long long)(u & 1);
+}
+
+// Fletcher-16 over type, len and payload
+static bool frame_ok(const unsigned char *f, size_t n) {
+	unsigned int s1 = 0, s2 = 0;
+	size_t i;
+
+	for (i = 1; i < n + 4; i++) {
+		s1 = (s1 + f[i]) % 255;
+		s2 = (s2 + s1) % 255;
+	}
+	return f[n + 4] == s1 && f[n + 5] == s2;
+}
+
+// Decimal number, no allocation; moves s past it and the blank after
+static long long get_num(const char *&s, const char *end) {
+	long long v = 0;
+	bool neg = false;
+
+	if (s < end && *s == '-') {
+		neg = true;
+		s++;
+	}
+	while (s < end && *s >= '0' && *s <= '9')
+		v = v * 10 + (*s++ - '0');
+	while (s < end && *s == ' ')
+		s++;
+	return neg ? -v : v;
+}
+
+Decoder::Decoder(DecoderSink *sink) : _sink(sink) {
+	reset();
+}
+
+void Decoder::reset(void) {
+	memset(_src, 0, sizeof(_src));
+	_text_t = 0;
+	_seq = -1;
+	_corrupt = 0;
+	_gaps = 0;
+}
+
+size_t Decoder::feed(const unsigned char *buf, size_t n) {
+	size_t i = 0;
+
+	while (i < n) {
+		if (buf[i] == FRAME_SYNC) {
+			size_t len;
+
+			if (n - i < 4)
+				break;
+			len = buf[i + 2] | buf[i + 3] << 8;
+			if (len > FRAME_MAX) {
+				// Can't be a frame; skip the sync byte
+				_corrupt++;
+				i++;
+				continue;
+			}
+			if (n - i < len + 6)
+				break;
+			if (!frame_ok(buf + i, len)) {
+				_corrupt++;
+				i++;
+				continue;
+			}
+			frame(buf[i + 1], buf + i + 4, len);
+			i += len + 6;
+			continue;
+		}
+
+		const unsigned char *nl = (const unsigned char *)
+			memchr(buf + i, '\n', n - i);
+		const unsigned char *sync = (const unsigned char *)
+			memchr(buf + i, FRAME_SYNC, nl ? nl - (buf + i) : n - i);
+
+		// After a damaged frame, resume at the next frame
+		if (sync) {
+			i = sync - buf;
+			continue;
+		}
+		if (!nl) {
+			if (n - i > LINE_MAX)
+				i = n;
+			break;
+		}
+		size_t end = nl - buf;
+		size_t len = end - i;
+
+		if (len && buf[end - 1] == '\r')
+			len--;
+		text((const char *)buf + i, len);
+		i = end + 1;
+	}
+	return i;
+}
+
+void Decoder::text(const char *s, size_t n) {
+	const char *end = s + n;
+
+	if (n > 4 && !memcmp(s, "VAL ", 4)) {
+		s += 4;
+		_text_t += get_num(s, end);
+		// Key and value pairs
+		while (end - s >= 2) {
+			char k = *s;
+
+			s += 2;
+			_sink->sample(k, _text_t, (int)get_num(s, end));
+		}
+		return;
+	}
+	if (n > 5 && !memcmp(s, "TIME ", 5)) {
+		s += 5;
+		_text_t = get_num(s, end);
+		return;
+	}
+	if (n > 5 && !memcmp(s, "BEAT ", 5)) {
+		tHeartbeat h;
+
+		s += 5;
+		h.t = get_num(s, end);
+		h.pushed = get_num(s, end);
+		h.dropped = get_num(s, end);
+		h.high = get_num(s, end);
+		h.rx_overflow = get_num(s, end);
+		h.rx_corrupt = get_num(s, end);
+		h.tx_stalls = get_num(s, end);
+		h.log_lost = get_num(s, end);
+		_sink->heartbeat(h);
+		return;
+	}
+	if (n > 5 && !memcmp(s, "PONG ", 5)) {
+		unsigned long id;
+
+		s += 5;
+		id = get_num(s, end);
+		_sink->pong(id, get_num(s, end));
+		return;
+	}
+	if (n > 9 && !memcmp(s, "CREDIT ", 7)) {
+		tCredit c;
+
+		c.key = s[7];
+		s += 9;
+		c.free = get_num(s, end);
+		c.played = get_num(s, end);
+		c.underruns = get_num(s, end);
+		_sink->credit(c);
+		return;
+	}
+	_sink->line(s, n);
+}
+
+void Decoder::frame(unsigned char type, const unsigned char *p, size_t n) {
+	const unsigned char *end = p + n;
+
+	switch (type) {
+	case FRAME_SAMPLES:
+		samples(p, n);
+		break;
+	case FRAME_STATUS: {
+		unsigned long seq = get_varint(p, end);
+
+		if (p < end)
+			_sink->status(seq, *p);
+		else
+			_corrupt++;
+		break;
+	}
+	case FRAME_HEARTBEAT: {
+		tHeartbeat h;
+
+		h.t = get_varint(p, end);
+		h.pushed = get_varint(p, end);
+		h.dropped = get_varint(p, end);
+		h.high = get_varint(p, end);
+		h.rx_overflow = get_varint(p, end);
+		h.rx_corrupt = get_varint(p, end);
+		h.tx_stalls = get_varint(p, end);
+		h.log_lost = get_varint(p, end);
+		if (p <= end)
+			_sink->heartbeat(h);
+		else
+			_corrupt++;
+		break;
+	}
+	case FRAME_PONG: {
+		unsigned long id = get_varint(p, end);
+		tTime t = get_varint(p, end);
+
+		if (p <= end)
+			_sink->pong(id, t);
+		else
+			_corrupt++;
+		break;
+	}
+	case FRAME_CREDIT: {
+		tCredit c;
+
+		c.key = p < end ? *p++ : 0;
+		c.free = get_varint(p, end);
+		c.played = get_varint(p, end);
+		c.underruns = get_varint(p, end);
+		if (p <= end)
+			_sink->credit(c);
+		else
+			_corrupt++;
+		break;
+	}
+	default:
+		_sink->frame(type, p, n);
+	}
+}
+
+void Decoder::samples(const unsigned char *p, size_t n) {
+	const unsigned char *end = p + n;
+	tTime t = 0;		// Of the previous record
+	int i;
+
+	if (!n)
+		return;
+	// A lost frame leaves every source in an unknown state, until
+	// its next keyframe
+	if (_seq >= 0 && *p != ((_seq + 1) & 0xff)) {
+		_gaps++;
+		for (i = 0; i < 16; i++)
+			_src[i].valid = false;
+	}
+	_seq = *p++;
+
+	while (p < end) {
+		unsigned char tag = *p++;
+		tSource *s = &_src[tag & 0x0f];
+		int c;
+
+		switch (tag & 0xf0) {
+		case REC_KEY:
+			if (p >= end)
+				break;
+			s->key = *p++;
+			s->period = get_varint(p, end);
+			s->t = get_varint(p, end);
+			s->v = get_svarint(p, end);
+			if (p > end)
+				break;
+			s->valid = true;
+			t = s->t;
+			_sink->sample(s->key, t, s->v);
+			continue;
+		case REC_ONE: {
+			char k;
+			tTime ot;
+			int v;
+
+			if (p >= end)
+				break;
+			k = *p++;
+			ot = get_varint(p, end);
+			v = get_svarint(p, end);
+			if (p > end)
+				break;
+			_sink->sample(k, ot, v);
+			continue;
+		}
+		case REC_SAMPLE: {
+			long long jitter = get_svarint(p, end);
+			int dv = get_svarint(p, end);
+
+			if (p > end)
+				break;
+			s->t += s->period + jitter;
+			s->v += dv;
+			t = s->t;
+			if (s->valid)
+				_sink->sample(s->key, t, s->v);
+			continue;
+		}
+		case REC_SAME: {
+			int dv = get_svarint(p, end);
+
+			if (p > end)
+				break;
+			s->t = t;
+			s->v += dv;
+			if (s->valid)
+				_sink->sample(s->key, t, s->v);
+			continue;
+		}
+		case REC_RUN:
+			c = get_varint(p, end);
+			if (p > end)
+				break;
+			while (c-- > 0) {
+				s->t += s->period;
+				if (s->valid)
+					_sink->sample(s->key, s->t, s->v);
+			}
+			t = s->t;
+			continue;
+		case REC_PACK:
+			if (end - p < 3)
+				break;
+			s->t += s->period;
+			s->v = p[0] << 4 | p[1] >> 4;
+			if (s->valid)
+				_sink->sample(s->key, s->t, s->v);
+			s->t += s->period;
+			s->v = (p[1] & 0x0f) << 8 | p[2];
+			if (s->valid)
+				_sink->sample(s->key, s->t, s->v);
+			t = s->t;
+			p += 3;
+			continue;
+		}
+		// Unknown or cut short; nothing after it can be trusted
+		_corrupt++;
+		return;
+	}
+}
+
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CLIENT_DECODER_H
+#define CLIENT_DECODER_H
+
+#include <stddef.h>
+
+namespace gpio {
+
+// Device time in uS, as on the board
+typedef unsigned long long tTime;
+
+typedef struct {
+	tTime t;	// Device time, uS
+	int v;
+} tSample;
+
+// The loss counters of a heartbeat, see the heartbeat command
+typedef struct {
+	tTime t;
+	unsigned long pushed;
+	unsigned long dropped;
+	unsigned long high;
+	unsigned long rx_overflow;
+	unsigned long rx_corrupt;
+	unsigned long tx_stalls;
+	unsigned long log_lost;
+} tHeartbeat;
+
+// Room in the feed of an output, see the feed command
+typedef struct {
+	char key;
+	int free;			// Samples that can be sent
+	unsigned long played;		// Since the output was added
+	unsigned long underruns;	// Steps with nothing to play
+} tCredit;
+
+// What the decoder found. Called from within Decoder::feed(); the
+// pointers are into the buffer passed to it.
+class DecoderSink {
+public:
+	virtual ~DecoderSink() {}
+	virtual void sample(char key, tTime t, int v) = 0;
+	// Reply to a binary command
+	virtual void status(unsigned long, int) {}
+	virtual void heartbeat(const tHeartbeat &) {}
+	// Reply to the ping command
+	virtual void pong(unsigned long, tTime) {}
+	virtual void credit(const tCredit &) {}
+	// Any other text line, without the line end
+	virtual void line(const char *, size_t) {}
+	// Any other frame: log, stats, hist, trace
+	virtual void frame(unsigned char, const unsigned char *, size_t) {}
+};
+
+// Decodes the output of the device, VAL lines and binary frames mixed,
+// in place. See README.md for the formats.
+class Decoder {
+public:
+	explicit Decoder(DecoderSink *sink);
+	void reset(void);
+
+	// Returns how much of buf was used up. The rest is an incomplete
+	// line or frame, and has to be passed again, with more after it.
+	size_t feed(const unsigned char *buf, size_t n);
+
+	unsigned long corrupt(void) const { return _corrupt; }
+	unsigned long gaps(void) const { return _gaps; }
+
+private:
+	// What the device sends per source index, see Encoder.cpp
+	typedef struct {
+		bool valid;	// Keyframe seen since the last gap
+		char key;
+		unsigned long period;
+		tTime t;
+		int v;
+	} tSource;
+
+	void text(const char *s, size_t n);
+	void frame(unsigned char type, const unsigned char *p, size_t n);
+	void samples(const unsigned char *p, size_t n);
+
+	DecoderSink *_sink;
+	tSource _src[16];
+	tTime _text_t;		// Time of the last VAL line
+	int _seq;		// Of the last sample frame, -1 if none yet
+	unsigned long _corrupt;
+	unsigned long _gaps;
+};
+
+}
+
+#endif
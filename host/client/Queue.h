@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CLIENT_QUEUE_H
+#define CLIENT_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <vector>
+
+namespace gpio {
+
+// Lock-free ring for exactly one producer and one consumer thread.
+// Each side only writes its own index; the acquire/release pairs make
+// the slot contents visible before the index that publishes them.
+template <class T> class SpscQueue {
+public:
+	explicit SpscQueue(size_t n) : _head(0), _tail(0) {
+		size_t size = 2;
+
+		while (size < n + 1)
+			size <<= 1;
+		_data.resize(size);
+		_mask = size - 1;
+	}
+
+	// Producer side
+	bool push(const T &v) {
+		size_t h = _head.load(std::memory_order_relaxed);
+
+		if (((h + 1) & _mask) == _tail.load(std::memory_order_acquire))
+			return false;
+		_data[h] = v;
+		_head.store((h + 1) & _mask, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side
+	bool pop(T *v) {
+		size_t t = _tail.load(std::memory_order_relaxed);
+
+		if (t == _head.load(std::memory_order_acquire))
+			return false;
+		*v = _data[t];
+		_tail.store((t + 1) & _mask, std::memory_order_release);
+		return true;
+	}
+
+	// Only a snapshot while the other side is running
+	size_t size(void) const {
+		return (_head.load(std::memory_order_acquire) -
+			_tail.load(std::memory_order_acquire)) & _mask;
+	}
+
+private:
+	std::vector<T> _data;
+	size_t _mask;
+	// A cache line apart, so the two sides don't fight over one. Padded
+	// rather than alignas(64): new only honours that from C++17 on, and
+	// queues are members of objects allocated with new.
+	std::atomic<size_t> _head;
+	char _pad[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> _tail;
+	char _pad_tail[64 - sizeof(std::atomic<size_t>)];
+};
+
+}
+
+#endif
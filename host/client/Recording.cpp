@@ -0,0 +1,715 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Recording.h"
+
+namespace gpio {
+
+#define HEADER_SIZE	8
+#define CHUNK_HEADER	40
+#define INDEX_ENTRY	32
+#define TRAILER_SIZE	24
+
+/****************************************************************************
+ Encoding
+ ****************************************************************************/
+
+static void put_le(std::vector<unsigned char> &b, unsigned long long v, int n) {
+	while (n--) {
+		b.push_back(v & 0xff);
+		v >>= 8;
+	}
+}
+
+static unsigned long long get_le(const unsigned char *p, int n) {
+	unsigned long long v = 0;
+
+	while (n--)
+		v = v << 8 | p[n];
+	return v;
+}
+
+static void put_varint(std::vector<unsigned char> &b, unsigned long long v) {
+	while (v >= 0x80) {
+		b.push_back((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	b.push_back(v);
+}
+
+static void put_svarint(std::vector<unsigned char> &b, long long s) {
+	put_varint(b, ((unsigned long long)s << 1) ^ (unsigned long long)(s >> 63));
+}
+
+// Past the end, returns 0 and sets p past end
+static inline unsigned long long get_varint(const unsigned char *&p, const unsigned char *end) {
+	unsigned long long v = 0;
+	int shift = 0;
+
+	while (p < end) {
+		unsigned char b = *p++;
+
+		v |= (unsigned long long)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return v;
+		shift += 7;
+	}
+	p = end + 1;
+	return 0;
+}
+
+static inline long long get_svarint(const unsigned char *&p, const unsigned char *end) {
+	unsigned long long v = get_varint(p, end);
+
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static void merge(tBucket *to, const tBucket &b) {
+	if (!to->count) {
+		tTime t = to->t;
+
+		*to = b;
+		to->t = t;
+		return;
+	}
+	to->count += b.count;
+	to->sum += b.sum;
+	if (b.min < to->min)
+		to->min = b.min;
+	if (b.max > to->max)
+		to->max = b.max;
+}
+
+/****************************************************************************
+ Recorder
+ ****************************************************************************/
+
+Recorder::Recorder(size_t chunk) : _chunk(chunk ? chunk : 1), _f(NULL),
+	_error(false), _offset(0), _samples(0) {
+}
+
+Recorder::~Recorder(void) {
+	close();
+}
+
+bool Recorder::open(const char *path) {
+	std::vector<unsigned char> h;
+	int k;
+
+	if (_f) {
+		errno = EBUSY;
+		return false;
+	}
+	_f = fopen(path, "wb");
+	if (!_f)
+		return false;
+	_error = false;
+	_offset = 0;
+	_samples = 0;
+	_index.clear();
+	for (k = 0; k < 256; k++) {
+		tPending *p = &_pending[k];
+		int l;
+
+		p->t.clear();
+		p->v.clear();
+		for (l = 0; l < REC_LEVELS; l++) {
+			p->open[l].count = 0;
+			p->done[l].clear();
+		}
+	}
+	put_le(h, REC_MAGIC, 4);
+	put_le(h, REC_VERSION, 4);
+	return put(h);
+}
+
+bool Recorder::close(void) {
+	std::vector<unsigned char> b;
+	size_t i;
+	bool ok;
+	int k;
+
+	if (!_f)
+		return true;
+	for (k = 0; k < 256; k++)
+		close_buckets(k, &_pending[k]);
+	flush();
+	for (i = 0; i < _index.size(); i++) {
+		const tChunk &c = _index[i];
+
+		put_le(b, (unsigned char)c.key | c.level << 8, 4);
+		put_le(b, c.n, 4);
+		put_le(b, c.t0, 8);
+		put_le(b, c.t1, 8);
+		put_le(b, c.offset, 8);
+	}
+	put_le(b, _offset, 8);
+	put_le(b, _index.size(), 8);
+	put_le(b, REC_INDEX_MAGIC, 4);
+	put_le(b, 0, 4);
+	put(b);
+
+	ok = !_error;
+	if (fclose(_f))
+		ok = false;
+	_f = NULL;
+	return ok;
+}
+
+bool Recorder::put(const std::vector<unsigned char> &b) {
+	if (fwrite(&b[0], 1, b.size(), _f) != b.size())
+		_error = true;
+	_offset += b.size();
+	return !_error;
+}
+
+void Recorder::add(char key, tTime t, int v) {
+	tPending *p = &_pending[(unsigned char)key];
+
+	tBucket b = { t, 1, v, v, v };
+
+	// A step back in time (a reset): what came before goes into chunks
+	// of its own, summaries included, so none of them goes back. The
+	// samples may just have been written, the open bucket has not.
+	if (p->open[0].count && t < p->last) {
+		int l;
+
+		if (!p->t.empty())
+			write_chunk(key, p);
+		close_buckets(key, p);
+		for (l = 1; l <= REC_LEVELS; l++) {
+			if (!p->done[l - 1].empty())
+				write_summary(key, l, p->done[l - 1]);
+		}
+	}
+	p->t.push_back(t);
+	p->v.push_back(v);
+	p->last = t;
+	_samples++;
+	if (p->t.size() >= _chunk)
+		write_chunk(key, p);
+	summarize(key, p, 1, b);
+}
+
+// Adds b, a sample or a finished bucket of the level below, to the
+// open bucket of level
+void Recorder::summarize(char key, tPending *p, int level, const tBucket &b) {
+	tBucket *o = &p->open[level - 1];
+	tTime start = b.t >> REC_WIDTH_SHIFT(level) << REC_WIDTH_SHIFT(level);
+
+	if (o->count && o->t != start)
+		close_bucket(key, p, level);
+	o->t = start;
+	merge(o, b);
+}
+
+void Recorder::close_bucket(char key, tPending *p, int level) {
+	tBucket b = p->open[level - 1];
+	std::vector<tBucket> &done = p->done[level - 1];
+
+	p->open[level - 1].count = 0;
+	done.push_back(b);
+	if (done.size() >= _chunk)
+		write_summary(key, level, done);
+	if (level < REC_LEVELS)
+		summarize(key, p, level + 1, b);
+}
+
+// Each closes into the level above, so bottom up
+void Recorder::close_buckets(char key, tPending *p) {
+	int l;
+
+	for (l = 1; l <= REC_LEVELS; l++) {
+		if (p->open[l - 1].count)
+			close_bucket(key, p, l);
+	}
+}
+
+void Recorder::add(char key, const tSample *s, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		add(key, s[i].t, s[i].v);
+}
+
+bool Recorder::flush(void) {
+	int k;
+
+	for (k = 0; k < 256; k++) {
+		tPending *p = &_pending[k];
+		int l;
+
+		if (!p->t.empty())
+			write_chunk(k, p);
+		for (l = 1; l <= REC_LEVELS; l++) {
+			if (!p->done[l - 1].empty())
+				write_summary(k, l, p->done[l - 1]);
+		}
+	}
+	if (_f && fflush(_f))
+		_error = true;
+	return !_error;
+}
+
+bool Recorder::write_chunk(char key, tPending *p) {
+	std::vector<unsigned char> times, values, b;
+	long long last = 0;
+	size_t i, n = p->t.size();
+	tChunk c;
+
+	if (!_f)
+		return false;
+	times.reserve(n);
+	values.reserve(n * 2);
+	for (i = 1; i < n; i++) {
+		long long d = p->t[i] - p->t[i - 1];
+
+		put_svarint(times, d - last);
+		last = d;
+		put_svarint(values, (long long)p->v[i] - p->v[i - 1]);
+	}
+
+	c.key = key;
+	c.level = 0;
+	c.n = n;
+	c.t0 = p->t[0];
+	c.t1 = p->t[n - 1];
+	c.offset = _offset;
+
+	b.reserve(CHUNK_HEADER + times.size() + values.size());
+	put_le(b, REC_CHUNK_MAGIC, 4);
+	put_le(b, (unsigned char)key, 4);
+	put_le(b, n, 4);
+	put_le(b, c.t0, 8);
+	put_le(b, c.t1, 8);
+	put_le(b, (unsigned int)p->v[0], 4);
+	put_le(b, times.size(), 4);
+	put_le(b, values.size(), 4);
+	b.insert(b.end(), times.begin(), times.end());
+	b.insert(b.end(), values.begin(), values.end());
+
+	p->t.clear();
+	p->v.clear();
+	if (!put(b))
+		return false;
+	_index.push_back(c);
+	return true;
+}
+
+bool Recorder::write_summary(char key, int level, std::vector<tBucket> &bs) {
+	std::vector<unsigned char> times, values, b;
+	unsigned long long last;
+	int shift = REC_WIDTH_SHIFT(level), min = 0;
+	size_t i, n = bs.size();
+	tChunk c;
+
+	if (!_f)
+		return false;
+	last = bs[0].t >> shift;
+	for (i = 0; i < n; i++) {
+		const tBucket &k = bs[i];
+
+		put_varint(times, (k.t >> shift) - last);
+		last = k.t >> shift;
+		put_varint(values, k.count);
+		put_svarint(values, (long long)k.min - min);
+		min = k.min;
+		put_varint(values, (long long)k.max - k.min);
+		put_varint(values, k.sum - (long long)k.count * k.min);
+	}
+
+	c.key = key;
+	c.level = level;
+	c.n = n;
+	c.t0 = bs[0].t;
+	c.t1 = bs[n - 1].t + REC_WIDTH(level) - 1;
+	c.offset = _offset;
+
+	b.reserve(CHUNK_HEADER + times.size() + values.size());
+	put_le(b, REC_CHUNK_MAGIC, 4);
+	put_le(b, (unsigned char)key | level << 8, 4);
+	put_le(b, n, 4);
+	put_le(b, c.t0, 8);
+	put_le(b, c.t1, 8);
+	put_le(b, 0, 4);
+	put_le(b, times.size(), 4);
+	put_le(b, values.size(), 4);
+	b.insert(b.end(), times.begin(), times.end());
+	b.insert(b.end(), values.begin(), values.end());
+
+	bs.clear();
+	if (!put(b))
+		return false;
+	_index.push_back(c);
+	return true;
+}
+
+/****************************************************************************
+ Recording
+ ****************************************************************************/
+
+Recording::Recording(void) : _map(NULL), _size(0), _recovered(false) {
+}
+
+Recording::~Recording(void) {
+	close();
+}
+
+bool Recording::open(const char *path) {
+	struct stat st;
+	unsigned long long version;
+	void *m;
+	size_t i;
+	int fd, k, l;
+
+	close();
+	fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st)) {
+		::close(fd);
+		return false;
+	}
+	if (st.st_size < HEADER_SIZE) {
+		::close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (m == MAP_FAILED)
+		return false;
+	_map = (const unsigned char *)m;
+	_size = st.st_size;
+
+	version = get_le(_map + 4, 4);
+	if (get_le(_map, 4) != REC_MAGIC || version < 1 || version > REC_VERSION) {
+		close();
+		errno = EINVAL;
+		return false;
+	}
+	_recovered = !load_index();
+	if (_recovered)
+		scan();
+	// Queries go through the chunks a key has, in time order
+	madvise(m, _size, MADV_RANDOM);
+
+	for (i = 0; i < _chunks.size(); i++)
+		_series[(unsigned char)_chunks[i].key][_chunks[i].level].chunks.push_back(i);
+	for (k = 0; k < 256; k++) {
+		for (l = 0; l <= REC_LEVELS; l++) {
+			tSeries &s = _series[k][l];
+			tTime reach = 0;
+
+			std::stable_sort(s.chunks.begin(), s.chunks.end(),
+				[this](size_t a, size_t b) {
+					return _chunks[a].t0 < _chunks[b].t0;
+				});
+			for (i = 0; i < s.chunks.size(); i++) {
+				reach = std::max(reach, _chunks[s.chunks[i]].t1);
+				s.reach.push_back(reach);
+			}
+		}
+	}
+	return true;
+}
+
+void Recording::close(void) {
+	int k, l;
+
+	if (_map)
+		munmap((void *)_map, _size);
+	_map = NULL;
+	_size = 0;
+	_recovered = false;
+	_chunks.clear();
+	for (k = 0; k < 256; k++) {
+		for (l = 0; l <= REC_LEVELS; l++) {
+			_series[k][l].chunks.clear();
+			_series[k][l].reach.clear();
+		}
+	}
+}
+
+// The chunk at c.offset, if it is one and fits into the file
+const unsigned char *Recording::chunk(const tChunk &c, size_t *len) const {
+	const unsigned char *p;
+
+	if (c.offset < HEADER_SIZE || c.offset + CHUNK_HEADER > _size)
+		return NULL;
+	p = _map + c.offset;
+	if (get_le(p, 4) != REC_CHUNK_MAGIC)
+		return NULL;
+	*len = CHUNK_HEADER + get_le(p + 32, 4) + get_le(p + 36, 4);
+	if (c.offset + *len > _size)
+		return NULL;
+	return p;
+}
+
+bool Recording::load_index(void) {
+	const unsigned char *t, *p;
+	unsigned long long off, n, i;
+	size_t len;
+
+	if (_size < HEADER_SIZE + TRAILER_SIZE)
+		return false;
+	t = _map + _size - TRAILER_SIZE;
+	off = get_le(t, 8);
+	n = get_le(t + 8, 8);
+	if (get_le(t + 16, 4) != REC_INDEX_MAGIC ||
+	    off > _size - TRAILER_SIZE ||
+	    n != (_size - TRAILER_SIZE - off) / INDEX_ENTRY ||
+	    off + n * INDEX_ENTRY != _size - TRAILER_SIZE)
+		return false;
+
+	for (i = 0, p = _map + off; i < n; i++, p += INDEX_ENTRY) {
+		tChunk c;
+
+		c.key = p[0];
+		c.level = p[1];
+		c.n = get_le(p + 4, 4);
+		c.t0 = get_le(p + 8, 8);
+		c.t1 = get_le(p + 16, 8);
+		c.offset = get_le(p + 24, 8);
+		if (c.level > REC_LEVELS || !chunk(c, &len)) {
+			_chunks.clear();
+			return false;
+		}
+		_chunks.push_back(c);
+	}
+	return true;
+}
+
+// No index: the chunks follow each other from the header on, up to the
+// first one that is damaged or cut short
+void Recording::scan(void) {
+	unsigned long long off = HEADER_SIZE;
+	const unsigned char *p;
+	size_t len;
+
+	for (;;) {
+		tChunk c;
+
+		c.offset = off;
+		p = chunk(c, &len);
+		if (!p || p[5] > REC_LEVELS)
+			break;
+		c.key = p[4];
+		c.level = p[5];
+		c.n = get_le(p + 8, 4);
+		c.t0 = get_le(p + 12, 8);
+		c.t1 = get_le(p + 20, 8);
+		_chunks.push_back(c);
+		off += len;
+	}
+}
+
+std::string Recording::keys(void) const {
+	std::string s;
+	int k;
+
+	for (k = 1; k < 256; k++) {
+		if (!_series[k][0].chunks.empty())
+			s += (char)k;
+	}
+	return s;
+}
+
+bool Recording::range(char key, tTime *first, tTime *last) const {
+	const tSeries &s = _series[(unsigned char)key][0];
+
+	if (s.chunks.empty())
+		return false;
+	*first = _chunks[s.chunks[0]].t0;
+	*last = s.reach.back();
+	return true;
+}
+
+unsigned long long Recording::count(char key) const {
+	const tSeries &s = _series[(unsigned char)key][0];
+	unsigned long long n = 0;
+	size_t i;
+
+	for (i = 0; i < s.chunks.size(); i++)
+		n += _chunks[s.chunks[i]].n;
+	return n;
+}
+
+// The first chunk that gets as far as from
+size_t Recording::first(const tSeries &s, tTime from) const {
+	return std::lower_bound(s.reach.begin(), s.reach.end(), from) - s.reach.begin();
+}
+
+size_t Recording::read(char key, tTime from, tTime to, std::vector<tSample> &out) const {
+	return each_sample(key, from, to, [](void *o, const tSample &s) {
+		((std::vector<tSample> *)o)->push_back(s);
+	}, &out);
+}
+
+size_t Recording::read_level(char key, int level, tTime from, tTime to, std::vector<tBucket> &out) const {
+	return each_bucket(key, level, from, to, [](void *o, const tBucket &b) {
+		((std::vector<tBucket> *)o)->push_back(b);
+	}, &out);
+}
+
+size_t Recording::each_sample(char key, tTime from, tTime to, tSampleFn fn, void *ctx) const {
+	const tSeries &ser = _series[(unsigned char)key][0];
+	size_t i, found = 0;
+
+	for (i = first(ser, from); i < ser.chunks.size() && _chunks[ser.chunks[i]].t0 < to; i++) {
+		const tChunk &c = _chunks[ser.chunks[i]];
+		const unsigned char *p, *tp, *tend, *vp, *vend;
+		long long d = 0;
+		unsigned long j;
+		tSample s;
+		size_t len;
+
+		if (c.t1 < from)
+			continue;
+		p = chunk(c, &len);
+		if (!p)
+			continue;
+		tp = p + CHUNK_HEADER;
+		tend = tp + get_le(p + 32, 4);
+		vp = tend;
+		vend = p + len;
+
+		s.t = c.t0;
+		s.v = (int)get_le(p + 28, 4);
+		for (j = 0; ; ) {
+			if (s.t >= to)
+				break;
+			if (s.t >= from) {
+				fn(ctx, s);
+				found++;
+			}
+			if (++j >= c.n)
+				break;
+			d += get_svarint(tp, tend);
+			s.t += d;
+			s.v += get_svarint(vp, vend);
+			if (tp > tend || vp > vend)
+				break;
+		}
+	}
+	return found;
+}
+
+size_t Recording::each_bucket(char key, int level, tTime from, tTime to, tBucketFn fn, void *ctx) const {
+	const tSeries *ser;
+	int shift = REC_WIDTH_SHIFT(level);
+	size_t i, found = 0;
+
+	if (level < 1 || level > REC_LEVELS)
+		return 0;
+	ser = &_series[(unsigned char)key][level];
+	for (i = first(*ser, from); i < ser->chunks.size() && _chunks[ser->chunks[i]].t0 < to; i++) {
+		const tChunk &c = _chunks[ser->chunks[i]];
+		const unsigned char *p, *tp, *tend, *vp, *vend;
+		unsigned long long n;
+		unsigned long j;
+		tBucket b;
+		size_t len;
+		int min = 0;
+
+		if (c.t1 < from)
+			continue;
+		p = chunk(c, &len);
+		if (!p)
+			continue;
+		tp = p + CHUNK_HEADER;
+		tend = tp + get_le(p + 32, 4);
+		vp = tend;
+		vend = p + len;
+
+		n = c.t0 >> shift;
+		for (j = 0; j < c.n; j++) {
+			n += get_varint(tp, tend);
+			b.t = n << shift;
+			b.count = get_varint(vp, vend);
+			min += get_svarint(vp, vend);
+			b.min = min;
+			b.max = min + (long long)get_varint(vp, vend);
+			b.sum = (long long)get_varint(vp, vend) + (long long)b.count * min;
+			if (tp > tend || vp > vend || b.t >= to)
+				break;
+			if (b.t >= from) {
+				fn(ctx, b);
+				found++;
+			}
+		}
+	}
+	return found;
+}
+
+// Where plot() puts what it reads
+typedef struct {
+	std::vector<tBucket> *out;
+	tTime from, span;
+} tPlot;
+
+static void plot_bucket(void *ctx, const tBucket &b) {
+	tPlot *p = (tPlot *)ctx;
+	tTime t = b.t < p->from ? p->from : b.t;
+
+	merge(&(*p->out)[(t - p->from) * p->out->size() / p->span], b);
+}
+
+static void plot_sample(void *ctx, const tSample &s) {
+	tBucket b = { s.t, 1, s.v, s.v, s.v };
+
+	plot_bucket(ctx, b);
+}
+
+int Recording::plot(char key, tTime from, tTime to, size_t width, std::vector<tBucket> &out) const {
+	tPlot p = { &out, from, to - from };
+	size_t i;
+	int level;
+
+	out.clear();
+	if (!width || to <= from)
+		return 0;
+	for (i = 0; i < width; i++) {
+		tBucket c = { from + p.span * i / width, 0, 0, 0, 0 };
+
+		out.push_back(c);
+	}
+
+	for (level = REC_LEVELS; level > 0; level--) {
+		if (REC_WIDTH(level) <= p.span / width &&
+		    !_series[(unsigned char)key][level].chunks.empty())
+			break;
+	}
+	if (!level) {
+		each_sample(key, from, to, plot_sample, &p);
+		return 0;
+	}
+	// With the bucket from starts in
+	from = from >> REC_WIDTH_SHIFT(level) << REC_WIDTH_SHIFT(level);
+	each_bucket(key, level, from, to, plot_bucket, &p);
+	return level;
+}
+
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CLIENT_RECORDING_H
+#define CLIENT_RECORDING_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "Decoder.h"
+
+// Recordings of samples on disk, for long captures that have to be
+// queried by time later on. The file is
+//
+//	header: magic (4) version (4)
+//	chunk...
+//	index: entry (32) per chunk
+//	trailer: index offset (8) entries (8) magic (4) 0 (4)
+//
+// all little endian. A chunk holds the samples of one source, column by
+// column:
+//
+//	magic (4) key (1) level (1) 0 (2) n (4) t0 (8) t1 (8) v0 (4)
+//	tbytes (4) vbytes (4)
+//	times: zig-zag varint of the change in interval, n - 1 of them
+//	values: zig-zag varint of the change in value, n - 1 of them
+//
+// so a source sampled at a steady rate costs a byte per timestamp, and
+// one whose value hardly moves a byte per value. t0 and t1 are the
+// first and last time in the chunk. An index entry repeats key, level,
+// n, t0 and t1, with the offset of the chunk. Without the index, after
+// the recorder was killed, the reader finds the chunks by their headers.
+//
+// Chunks of level 1 and up hold the summary pyramid of a source: the
+// count, min, max and sum of its samples in buckets of REC_WIDTH(level)
+// uS, aligned to multiples of it, with each level four times as coarse
+// as the one below. Only buckets with samples are stored. Here t0 is
+// the start of the first bucket, t1 the end of the last, v0 is 0, and
+//
+//	times: varint of the change in bucket number, n of them, the first
+//		from t0
+//	values: per bucket, varint count, zig-zag varint of the change in
+//		min, varint max - min, varint sum - count * min
+//
+// Version 1 files have no pyramid, the level byte is always 0.
+namespace gpio {
+
+#define REC_MAGIC	0x43455247	// "GREC"
+#define REC_VERSION	2
+#define REC_CHUNK_MAGIC	0x4b4e4843	// "CHNK"
+#define REC_INDEX_MAGIC	0x58444e49	// "INDX"
+#define REC_CHUNK	8192		// Samples per chunk, by default
+#define REC_LEVELS	12		// Of the pyramid, from 16 mS to 19 hours
+#define REC_WIDTH_SHIFT(l)	(12 + 2 * (l))
+#define REC_WIDTH(l)	(1ULL << REC_WIDTH_SHIFT(l))
+
+typedef struct {
+	char key;
+	int level;		// 0 for samples, else of the pyramid
+	unsigned long n;
+	tTime t0, t1;
+	unsigned long long offset;
+} tChunk;
+
+// Samples in a span of time; count is 0 if there were none
+typedef struct {
+	tTime t;		// Start
+	unsigned long count;
+	int min, max;
+	long long sum;
+} tBucket;
+
+class Recorder {
+public:
+	explicit Recorder(size_t chunk = REC_CHUNK);
+	~Recorder(void);
+
+	// Returns false with errno set
+	bool open(const char *path);
+	// Writes what is buffered and the index; false on a write error
+	bool close(void);
+
+	// Samples of a source in time order. A step back in time, as after
+	// a reset of the board, starts a new chunk.
+	void add(char key, tTime t, int v);
+	void add(char key, const tSample *s, int n);
+
+	// Writes the chunk of every source, full or not
+	bool flush(void);
+	unsigned long long samples(void) const { return _samples; }
+
+private:
+	typedef struct {
+		std::vector<tTime> t;
+		std::vector<int> v;
+		tTime last;	// Of the latest sample, if open[0] has any
+		// The pyramid: the bucket being filled and the finished
+		// ones not yet written, per level
+		tBucket open[REC_LEVELS];
+		std::vector<tBucket> done[REC_LEVELS];
+	} tPending;
+
+	bool write_chunk(char key, tPending *p);
+	bool write_summary(char key, int level, std::vector<tBucket> &b);
+	void summarize(char key, tPending *p, int level, const tBucket &b);
+	void close_bucket(char key, tPending *p, int level);
+	void close_buckets(char key, tPending *p);
+	bool put(const std::vector<unsigned char> &b);
+
+	size_t _chunk;
+	FILE *_f;
+	bool _error;
+	unsigned long long _offset;
+	unsigned long long _samples;
+	tPending _pending[256];
+	std::vector<tChunk> _index;
+};
+
+// A recording, mapped into memory. Only the chunks a query touches are
+// decoded.
+class Recording {
+public:
+	Recording(void);
+	~Recording(void);
+
+	// Returns false with errno set; EINVAL if it is not a recording
+	bool open(const char *path);
+	void close(void);
+
+	// The sources, and how far each reaches
+	std::string keys(void) const;
+	bool range(char key, tTime *first, tTime *last) const;
+	unsigned long long count(char key) const;
+	// All chunks, in file order
+	const std::vector<tChunk> &chunks(void) const { return _chunks; }
+	// Whether the index had to be rebuilt from the chunks
+	bool recovered(void) const { return _recovered; }
+
+	// Appends the samples of key with from <= t < to, in time order
+	// within each chunk. Returns how many.
+	size_t read(char key, tTime from, tTime to, std::vector<tSample> &out) const;
+
+	// Same for the buckets of a level of the pyramid that start in
+	// the window
+	size_t read_level(char key, int level, tTime from, tTime to, std::vector<tBucket> &out) const;
+
+	// For plotting: the window split into width columns, each with
+	// what the samples in it came to. Reads the coarsest level that
+	// still has a bucket per column, or the samples if there is none,
+	// so the cost goes with width rather than with the window. A bucket
+	// goes to the column it starts in. Returns the level, 0 for the
+	// samples.
+	int plot(char key, tTime from, tTime to, size_t width, std::vector<tBucket> &out) const;
+
+private:
+	typedef struct {
+		// Indexes into _chunks by t0, and the latest t1 up to each
+		// of them, for a binary search even if chunks overlap
+		std::vector<size_t> chunks;
+		std::vector<tTime> reach;
+	} tSeries;
+
+	typedef void (*tSampleFn)(void *ctx, const tSample &s);
+	typedef void (*tBucketFn)(void *ctx, const tBucket &b);
+
+	bool load_index(void);
+	void scan(void);
+	const unsigned char *chunk(const tChunk &c, size_t *len) const;
+	size_t first(const tSeries &s, tTime from) const;
+	size_t each_sample(char key, tTime from, tTime to, tSampleFn fn, void *ctx) const;
+	size_t each_bucket(char key, int level, tTime from, tTime to, tBucketFn fn, void *ctx) const;
+
+	const unsigned char *_map;
+	size_t _size;
+	bool _recovered;
+	std::vector<tChunk> _chunks;
+	tSeries _series[256][REC_LEVELS + 1];	// By key and level
+};
+
+// Feeds the samples a Decoder finds into a Recorder, e.g. to convert a
+// captured VAL log
+class RecorderSink : public DecoderSink {
+public:
+	explicit RecorderSink(Recorder *r) : _r(r) {}
+	void sample(char key, tTime t, int v) { _r->add(key, t, v); }
+private:
+	Recorder *_r;
+};
+
+}
+
+#endif
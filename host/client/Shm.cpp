@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <new>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Shm.h"
+
+namespace gpio {
+
+/****************************************************************************
+ Writer
+ ****************************************************************************/
+
+ShmWriter::ShmWriter(void) : _h(NULL), _rec(NULL), _len(0) {
+	_name[0] = 0;
+}
+
+ShmWriter::~ShmWriter(void) {
+	close();
+}
+
+bool ShmWriter::create(const char *name, size_t size, int boards, const char *const *names) {
+	size_t n = 1;
+	void *m;
+	int fd, i;
+
+	if (_h) {
+		errno = EBUSY;
+		return false;
+	}
+	if (boards < 1 || boards > SHM_BOARDS || strlen(name) >= sizeof(_name)) {
+		errno = EINVAL;
+		return false;
+	}
+	while (n < size)
+		n <<= 1;
+	_len = SHM_RECORDS + n * sizeof(tShmRecord);
+
+	// Readers of a ring from before see it go away, not change
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, _len)) {
+		::close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	m = mmap(NULL, _len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (m == MAP_FAILED) {
+		shm_unlink(name);
+		return false;
+	}
+
+	_h = new (m) tShmHeader;
+	_rec = (tShmRecord *)((char *)m + SHM_RECORDS);
+	strcpy(_name, name);
+	_h->size = n;
+	_h->boards = boards;
+	for (i = 0; i < boards; i++) {
+		strncpy(_h->board[i].name, names[i], sizeof(_h->board[i].name) - 1);
+		_h->board[i].samples = 0;
+		_h->board[i].lost = 0;
+		_h->board[i].gaps = 0;
+		_h->board[i].clock_seq = 0;
+	}
+	_h->reserve = 0;
+	_h->head = 0;
+	_h->version = SHM_VERSION;
+	// Last, so a reader never sees a ring half set up
+	std::atomic_thread_fence(std::memory_order_release);
+	_h->magic = SHM_MAGIC;
+	return true;
+}
+
+void ShmWriter::close(void) {
+	if (!_h)
+		return;
+	munmap(_h, _len);
+	shm_unlink(_name);
+	_h = NULL;
+}
+
+void ShmWriter::publish(int board, char key, const tSample *s, size_t n) {
+	uint64_t head = _h->head.load(std::memory_order_relaxed);
+	size_t mask = _h->size - 1;
+
+	while (n > 0) {
+		size_t run = n < _h->size ? n : _h->size;
+		size_t i;
+
+		_h->reserve.store(head + run, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (i = 0; i < run; i++) {
+			tShmRecord *r = &_rec[(head + i) & mask];
+
+			r->t = s[i].t;
+			r->v = s[i].v;
+			r->board = board;
+			r->key = key;
+			r->pad = 0;
+		}
+		head += run;
+		_h->head.store(head, std::memory_order_release);
+		_h->board[board].samples.fetch_add(run, std::memory_order_relaxed);
+		s += run;
+		n -= run;
+	}
+}
+
+// A sequence lock: readers retry while it is odd or has moved on
+void ShmWriter::set_clock(int board, const tClockFit &f) {
+	tShmBoard *b = &_h->board[board];
+	uint32_t seq = b->clock_seq.load(std::memory_order_relaxed);
+
+	b->clock_seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	b->clock = f;
+	b->clock_seq.store(seq + 2, std::memory_order_release);
+}
+
+/****************************************************************************
+ Reader
+ ****************************************************************************/
+
+ShmReader::ShmReader(void) : _h(NULL), _rec(NULL), _len(0), _pos(0), _lost(0) {
+}
+
+ShmReader::~ShmReader(void) {
+	close();
+}
+
+bool ShmReader::open(const char *name) {
+	const tShmHeader *h;
+	struct stat st;
+	void *m;
+	int fd;
+
+	close();
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) || (size_t)st.st_size < SHM_RECORDS) {
+		::close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (m == MAP_FAILED)
+		return false;
+	h = (const tShmHeader *)m;
+	if (h->magic != SHM_MAGIC || h->version != SHM_VERSION ||
+	    SHM_RECORDS + (size_t)h->size * sizeof(tShmRecord) > (size_t)st.st_size) {
+		munmap(m, st.st_size);
+		errno = EINVAL;
+		return false;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	_h = h;
+	_rec = (const tShmRecord *)((const char *)m + SHM_RECORDS);
+	_len = st.st_size;
+	_pos = _h->head.load(std::memory_order_acquire);
+	_lost = 0;
+	return true;
+}
+
+void ShmReader::close(void) {
+	if (!_h)
+		return;
+	munmap((void *)_h, _len);
+	_h = NULL;
+}
+
+size_t ShmReader::peek(const tShmRecord **p, size_t max) {
+	uint64_t head = _h->head.load(std::memory_order_acquire);
+	uint64_t reserve = _h->reserve.load(std::memory_order_relaxed);
+	size_t size = _h->size, at, n;
+
+	// Lapped already
+	if (reserve - _pos > size) {
+		_lost += reserve - size - _pos;
+		_pos = reserve - size;
+	}
+	if (head <= _pos)
+		return 0;
+	at = _pos & (size - 1);
+	n = head - _pos;
+	if (n > size - at)
+		n = size - at;
+	if (n > max)
+		n = max;
+	*p = &_rec[at];
+	return n;
+}
+
+bool ShmReader::clock(int board, tClockFit *f) const {
+	const tShmBoard *b;
+	uint32_t seq;
+
+	if (board < 0 || board >= (int)_h->boards)
+		return false;
+	b = &_h->board[board];
+	do {
+		seq = b->clock_seq.load(std::memory_order_acquire);
+		*f = b->clock;
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((seq & 1) || seq != b->clock_seq.load(std::memory_order_relaxed));
+	return seq != 0;
+}
+
+bool ShmReader::done(size_t n) {
+	uint64_t reserve;
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	reserve = _h->reserve.load(std::memory_order_relaxed);
+	if (reserve - _pos > _h->size) {
+		_lost += n;
+		_pos += n;
+		return false;
+	}
+	_pos += n;
+	return true;
+}
+
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CLIENT_SHM_H
+#define CLIENT_SHM_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "Clock.h"
+#include "Decoder.h"
+
+// Samples of several boards in one ring in shared memory, written by
+// one process (gpio_aggd) and read by any number of others, which map
+// it read-only and use the records where they are. The writer never
+// waits for a reader; a reader that falls more than the size of the
+// ring behind loses the records it missed, and is told so.
+//
+// Before writing a run of records the writer moves reserve to its end,
+// after it moves head. A reader takes the records between its position
+// and head, and once done with them checks reserve: whatever is more
+// than the size of the ring behind it may have been overwritten while
+// it was being read, and has to be thrown away.
+
+namespace gpio {
+
+#define SHM_MAGIC	0x4d484750	// "PGHM"
+#define SHM_VERSION	2
+#define SHM_BOARDS	16
+#define SHM_NAME	"/gpio"
+#define SHM_SIZE	(1 << 20)	// Records, by default
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared counters need lock-free atomics");
+
+typedef struct {
+	uint64_t t;		// Device time of the board, uS
+	int32_t v;
+	uint8_t board;		// Index into the boards of the header
+	char key;
+	uint16_t pad;
+} tShmRecord;
+
+typedef struct {
+	char name[48];		// Serial port
+	std::atomic<uint64_t> samples;	// Published
+	std::atomic<uint64_t> lost;	// Dropped by the writer, behind
+	std::atomic<uint64_t> gaps;	// Sample frames lost on the line
+	// Device time to host_time(), if the writer keeps it; odd while
+	// being updated, 0 until there is one
+	std::atomic<uint32_t> clock_seq;
+	tClockFit clock;
+} tShmBoard;
+
+// The records follow at SHM_RECORDS
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		// Records, a power of two
+	uint32_t boards;
+	tShmBoard board[SHM_BOARDS];
+	alignas(64) std::atomic<uint64_t> reserve;
+	alignas(64) std::atomic<uint64_t> head;
+} tShmHeader;
+
+#define SHM_RECORDS	((sizeof(tShmHeader) + 63) & ~(size_t)63)
+
+class ShmWriter {
+public:
+	ShmWriter(void);
+	~ShmWriter(void);
+
+	// Creates the ring anew, size rounded up to a power of two.
+	// Returns false with errno set.
+	bool create(const char *name, size_t size, int boards, const char *const *names);
+	// Removes it; readers still attached keep their mapping
+	void close(void);
+
+	void publish(int board, char key, const tSample *s, size_t n);
+	void set_clock(int board, const tClockFit &f);
+	tShmBoard *board(int i) { return &_h->board[i]; }
+
+private:
+	tShmHeader *_h;
+	tShmRecord *_rec;
+	size_t _len;
+	char _name[64];
+};
+
+class ShmReader {
+public:
+	ShmReader(void);
+	~ShmReader(void);
+
+	// Starts at the records published from now on. Returns false
+	// with errno set; EINVAL if it is not a ring of the right version.
+	bool open(const char *name);
+	void close(void);
+	const tShmHeader *header(void) const { return _h; }
+
+	// The records not read yet, up to max, as one run in the ring.
+	// Returns how many are at *p, 0 if there are none.
+	size_t peek(const tShmRecord **p, size_t max = (size_t)-1);
+	// Done with n records from peek(). Returns false if they may have
+	// been overwritten meanwhile; then they are counted as lost.
+	bool done(size_t n);
+	// Records that were overwritten before they were read
+	uint64_t lost(void) const { return _lost; }
+	// How the time of a board maps to host_time(); false if the
+	// writer has not got there yet
+	bool clock(int board, tClockFit *f) const;
+
+private:
+	const tShmHeader *_h;
+	const tShmRecord *_rec;
+	size_t _len;
+	uint64_t _pos;
+	uint64_t _lost;
+};
+
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef HAL_ADS1115_H
+#define HAL_ADS1115_H
+
+// Host build only: the ADS1115 channels read simulated ports
+// HAL_ADS1115_PIN and up, see hal.h
+
+#include "hal.h"
+
+#define ADS1115_ADDRESS_ADDR_GND	0x48
+#define ADS1115_RATE_860		0x07
+#define ADS1115_PGA_4P096		0x01
+#define ADS1115_MODE_CONTINUOUS		0x00
+
+class ADS1115 {
+public:
+	ADS1115(uint8_t) { }
+	void initialize(void) { }
+	void setRate(uint8_t) { }
+	void setGain(uint8_t) { }
+	void setMode(bool) { }
+	int16_t getConversionP0N1(void) { return hal_read(HAL_ADS1115_PIN + 4); }
+	int16_t getConversionP0N3(void) { return hal_read(HAL_ADS1115_PIN + 5); }
+	int16_t getConversionP1N3(void) { return hal_read(HAL_ADS1115_PIN + 6); }
+	int16_t getConversionP2N3(void) { return hal_read(HAL_ADS1115_PIN + 7); }
+	int16_t getConversionP0GND(void) { return hal_read(HAL_ADS1115_PIN + 0); }
+	int16_t getConversionP1GND(void) { return hal_read(HAL_ADS1115_PIN + 1); }
+	int16_t getConversionP2GND(void) { return hal_read(HAL_ADS1115_PIN + 2); }
+	int16_t getConversionP3GND(void) { return hal_read(HAL_ADS1115_PIN + 3); }
+};
+
+#endif
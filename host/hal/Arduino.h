@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef HAL_ARDUINO_H
+#define HAL_ARDUINO_H
+
+// Host build only: just enough of the Arduino Due core for the
+// firmware to build and run natively on Linux. Ports, interrupts, the
+// timer and the clock are simulated; see hal.h for driving them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#define HIGH	1
+#define LOW	0
+
+#define INPUT		0
+#define OUTPUT		1
+#define INPUT_PULLUP	2
+
+#define FALLING	2
+#define RISING	3
+#define CHANGE	4
+
+#define DEC	10
+#define HEX	16
+
+#ifndef PI
+#define PI 3.1415926535897932384626433832795
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size);
+#endif
+
+class Print {
+public:
+	size_t print(const char *s);
+	size_t print(char c);
+	size_t print(unsigned char v, int base = DEC);
+	size_t print(int v, int base = DEC);
+	size_t print(unsigned int v, int base = DEC);
+	size_t print(long v, int base = DEC);
+	size_t print(unsigned long v, int base = DEC);
+	size_t print(double v, int digits = 2);
+
+	template <class T> size_t println(T v) {
+		size_t n = print(v);
+		return n + println();
+	}
+	template <class T> size_t println(T v, int base) {
+		size_t n = print(v, base);
+		return n + println();
+	}
+	size_t println(void);
+
+	virtual size_t write(const uint8_t *buf, size_t n) = 0;
+	size_t write(uint8_t b) {
+		return write(&b, 1);
+	}
+	size_t write(const char *buf, size_t n) {
+		return write((const uint8_t *)buf, n);
+	}
+};
+
+// The USB serial port; output and input are kept in buffers, see hal.h
+class HalSerial : public Print {
+public:
+	using Print::write;
+	void begin(unsigned long) { }
+	int available(void);
+	int read(void);
+	void flush(void) { }
+	size_t write(const uint8_t *buf, size_t n);
+};
+
+extern HalSerial SerialUSB;
+
+// The virtual clock
+unsigned long micros(void);
+unsigned long millis(void);
+void delay(unsigned long ms);
+
+// Interrupts are only ever simulated on the calling thread, so this is
+// just bookkeeping for __get_PRIMASK()
+void noInterrupts(void);
+void interrupts(void);
+uint32_t __get_PRIMASK(void);
+
+int analogRead(int pin);
+void analogWrite(int pin, int v);
+int digitalRead(int pin);
+void digitalWrite(int pin, int v);
+void pinMode(int pin, int mode);
+void analogReadResolution(int bits);
+void analogWriteResolution(int bits);
+
+void attachInterrupt(int pin, void (*fn)(void), int mode);
+void detachInterrupt(int pin);
+
+// The parallel I/O controllers, as plain memory: what is written to
+// PIO_ODSR stays there, nothing else happens. Only the registers the
+// firmware uses.
+typedef struct {
+	volatile uint32_t PIO_OWER;	// Output write enable
+	volatile uint32_t PIO_OWDR;	// Output write disable
+	volatile uint32_t PIO_OWSR;	// Output write status
+	volatile uint32_t PIO_ODSR;	// Output data status
+} Pio;
+
+extern Pio HalPio[4];
+#define PIOA (&HalPio[0])
+#define PIOB (&HalPio[1])
+#define PIOC (&HalPio[2])
+#define PIOD (&HalPio[3])
+
+// Controller and bit mask of the digital pins, 0 to 53, as on the Due
+typedef struct {
+	Pio *pPort;
+	uint32_t ulPin;
+} PinDescription;
+
+extern const PinDescription g_APinDescription[];
+
+// The cycle counter counts the virtual clock at 84 MHz
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type *DWT;
+extern CoreDebug_Type *CoreDebug;
+extern uint32_t SystemCoreClock;
+
+#define CoreDebug_DEMCR_TRCENA_Msk	(1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk		(1UL << 0)
+
+#endif
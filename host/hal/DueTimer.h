@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef HAL_DUETIMER_H
+#define HAL_DUETIMER_H
+
+// Host build only: the timer fires from hal_advance()
+
+class DueTimer {
+public:
+	DueTimer &attachInterrupt(void (*fn)(void));
+	DueTimer &setPeriod(unsigned long us);
+	DueTimer &start(long us = -1);
+	DueTimer &stop(void);
+};
+
+extern DueTimer Timer1;
+
+#endif
@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Host build only: the simulated board behind Arduino.h
+
+#include <vector>
+#include "Arduino.h"
+#include "DueTimer.h"
+#include "Wire.h"
+#include "DueFlashStorage.h"
+#include "hal.h"
+
+HalSerial SerialUSB;
+DueTimer Timer1;
+TwoWire Wire;
+
+static DWT_Type _dwt;
+static CoreDebug_Type _coredebug;
+DWT_Type *DWT = &_dwt;
+CoreDebug_Type *CoreDebug = &_coredebug;
+uint32_t SystemCoreClock = 84000000;
+
+Pio HalPio[4];
+
+#define P(port, bit) { port, 1UL << bit }
+const PinDescription g_APinDescription[] = {
+	P(PIOA, 8), P(PIOA, 9), P(PIOB, 25), P(PIOC, 28), P(PIOC, 26),
+	P(PIOC, 25), P(PIOC, 24), P(PIOC, 23), P(PIOC, 22), P(PIOC, 21),
+	P(PIOC, 29), P(PIOD, 7), P(PIOD, 8), P(PIOB, 27), P(PIOD, 4),
+	P(PIOD, 5), P(PIOA, 13), P(PIOA, 12), P(PIOA, 11), P(PIOA, 10),
+	P(PIOB, 12), P(PIOB, 13), P(PIOB, 26), P(PIOA, 14), P(PIOA, 15),
+	P(PIOD, 0), P(PIOD, 1), P(PIOD, 2), P(PIOD, 3), P(PIOD, 6),
+	P(PIOD, 9), P(PIOA, 7), P(PIOD, 10), P(PIOC, 1), P(PIOC, 2),
+	P(PIOC, 3), P(PIOC, 4), P(PIOC, 5), P(PIOC, 6), P(PIOC, 7),
+	P(PIOC, 8), P(PIOC, 9), P(PIOA, 19), P(PIOA, 20), P(PIOC, 19),
+	P(PIOC, 18), P(PIOC, 17), P(PIOC, 16), P(PIOC, 15), P(PIOC, 14),
+	P(PIOC, 13), P(PIOC, 12), P(PIOB, 21), P(PIOB, 14),
+};
+#undef P
+
+static struct {
+	unsigned long long now;		// Virtual clock, uS
+	uint32_t primask;
+
+	void (*timer_fn)(void);
+	unsigned long period;
+	bool running;
+	unsigned long long next;	// When the timer fires next
+
+	void (*irq[HAL_PINS])(void);
+	int counter[HAL_PINS];
+	int written[HAL_PINS];
+	unsigned long writes;
+	tHalReader reader;
+
+	tHalSink sink;
+} Hal;
+
+static std::vector<uint8_t> _rx, _tx;
+static size_t _rx_pos;
+
+static void hal_clock(unsigned long long t) {
+	Hal.now = t;
+	DWT->CYCCNT = (uint32_t)(t * (SystemCoreClock / 1000000));
+}
+
+void hal_reset(void) {
+	memset(&Hal, 0, sizeof(Hal));
+	memset(&_dwt, 0, sizeof(_dwt));
+	memset(&_coredebug, 0, sizeof(_coredebug));
+	memset(HalPio, 0, sizeof(HalPio));
+	_rx.clear();
+	_tx.clear();
+	_rx_pos = 0;
+}
+
+unsigned long long hal_now(void) {
+	return Hal.now;
+}
+
+unsigned long hal_advance(unsigned long us) {
+	unsigned long long end = Hal.now + us;
+	unsigned long ticks = 0;
+
+	while (Hal.running && Hal.timer_fn && Hal.next <= end) {
+		hal_clock(Hal.next);
+		Hal.next += Hal.period;
+		Hal.timer_fn();
+		ticks++;
+	}
+	hal_clock(end);
+	return ticks;
+}
+
+/****************************************************************************
+ Ports and interrupts
+ ****************************************************************************/
+
+void hal_reader(tHalReader fn) {
+	Hal.reader = fn;
+}
+
+// Without a reader, each pin counts up through the 12 bit range
+int hal_read(int pin) {
+	if (pin < 0 || pin >= HAL_PINS)
+		return 0;
+	if (Hal.reader)
+		return Hal.reader(pin, Hal.now);
+	return Hal.counter[pin]++ & 4095;
+}
+
+int hal_written(int pin) {
+	if (pin < 0 || pin >= HAL_PINS)
+		return 0;
+	return Hal.written[pin];
+}
+
+unsigned long hal_writes(void) {
+	return Hal.writes;
+}
+
+static void hal_write(int pin, int v) {
+	if (pin < 0 || pin >= HAL_PINS)
+		return;
+	Hal.written[pin] = v;
+	Hal.writes++;
+}
+
+bool hal_irq(int pin) {
+	if (pin < 0 || pin >= HAL_PINS || !Hal.irq[pin])
+		return false;
+	Hal.irq[pin]();
+	return true;
+}
+
+int analogRead(int pin) {
+	return hal_read(pin);
+}
+
+void analogWrite(int pin, int v) {
+	hal_write(pin, v);
+}
+
+int digitalRead(int pin) {
+	return hal_read(pin) ? HIGH : LOW;
+}
+
+void digitalWrite(int pin, int v) {
+	hal_write(pin, v);
+}
+
+void pinMode(int, int) {
+}
+
+void analogReadResolution(int) {
+}
+
+void analogWriteResolution(int) {
+}
+
+void attachInterrupt(int pin, void (*fn)(void), int) {
+	if (pin >= 0 && pin < HAL_PINS)
+		Hal.irq[pin] = fn;
+}
+
+void detachInterrupt(int pin) {
+	if (pin >= 0 && pin < HAL_PINS)
+		Hal.irq[pin] = NULL;
+}
+
+void noInterrupts(void) {
+	Hal.primask = 1;
+}
+
+void interrupts(void) {
+	Hal.primask = 0;
+}
+
+uint32_t __get_PRIMASK(void) {
+	return Hal.primask;
+}
+
+/****************************************************************************
+ Clock and timer
+ ****************************************************************************/
+
+// Like on the Due, micros() wraps at 32 bit
+unsigned long micros(void) {
+	return (uint32_t)Hal.now;
+}
+
+unsigned long millis(void) {
+	return (uint32_t)(Hal.now / 1000);
+}
+
+// Nothing would ever advance the clock from inside a busy wait
+void delay(unsigned long) {
+}
+
+DueTimer &DueTimer::attachInterrupt(void (*fn)(void)) {
+	Hal.timer_fn = fn;
+	return *this;
+}
+
+DueTimer &DueTimer::setPeriod(unsigned long us) {
+	Hal.period = us ? us : 1;
+	Hal.next = Hal.now + Hal.period;
+	return *this;
+}
+
+DueTimer &DueTimer::start(long us) {
+	if (us > 0)
+		setPeriod(us);
+	Hal.next = Hal.now + Hal.period;
+	Hal.running = Hal.period > 0;
+	return *this;
+}
+
+DueTimer &DueTimer::stop(void) {
+	Hal.running = false;
+	return *this;
+}
+
+/****************************************************************************
+ Serial
+ ****************************************************************************/
+
+void hal_serial_input(const void *buf, size_t n) {
+	// Compact once everything queued so far has been read
+	if (_rx_pos == _rx.size()) {
+		_rx.clear();
+		_rx_pos = 0;
+	}
+	_rx.insert(_rx.end(), (const uint8_t *)buf, (const uint8_t *)buf + n);
+}
+
+size_t hal_serial_pending(void) {
+	return _rx.size() - _rx_pos;
+}
+
+void hal_serial_sink(tHalSink fn) {
+	Hal.sink = fn;
+}
+
+void hal_serial_discard(const uint8_t *, size_t) {
+}
+
+size_t hal_serial_take(char *buf, size_t n) {
+	if (n > _tx.size())
+		n = _tx.size();
+	memcpy(buf, _tx.data(), n);
+	_tx.erase(_tx.begin(), _tx.begin() + n);
+	return n;
+}
+
+int HalSerial::available(void) {
+	return hal_serial_pending();
+}
+
+int HalSerial::read(void) {
+	if (_rx_pos == _rx.size())
+		return -1;
+	return _rx[_rx_pos++];
+}
+
+size_t HalSerial::write(const uint8_t *buf, size_t n) {
+	if (Hal.sink)
+		Hal.sink(buf, n);
+	else
+		_tx.insert(_tx.end(), buf, buf + n);
+	return n;
+}
+
+/****************************************************************************
+ Flash
+ ****************************************************************************/
+
+static byte _flash[HAL_FLASH_SIZE];
+static bool _flash_used;	// Not erased yet
+static const char *_flash_path;
+
+void hal_flash_erase(void) {
+	memset(_flash, 0xff, sizeof(_flash));
+	_flash_used = true;
+}
+
+static bool hal_flash_sync(void) {
+	FILE *f;
+	bool ok;
+
+	if (!_flash_path)
+		return true;
+	f = fopen(_flash_path, "wb");
+	if (!f)
+		return false;
+	ok = fwrite(_flash, sizeof(_flash), 1, f) == 1;
+	return fclose(f) == 0 && ok;
+}
+
+bool hal_flash_file(const char *path) {
+	FILE *f;
+
+	hal_flash_erase();
+	_flash_path = path;
+	if (!path)
+		return true;
+	f = fopen(path, "rb");
+	if (!f)
+		return hal_flash_sync();
+	fread(_flash, 1, sizeof(_flash), f);
+	fclose(f);
+	return true;
+}
+
+byte DueFlashStorage::read(uint32_t address) {
+	return *readAddress(address);
+}
+
+byte *DueFlashStorage::readAddress(uint32_t address) {
+	if (!_flash_used)
+		hal_flash_erase();
+	return &_flash[address < HAL_FLASH_SIZE ? address : 0];
+}
+
+boolean DueFlashStorage::write(uint32_t address, byte value) {
+	return write(address, &value, 1);
+}
+
+boolean DueFlashStorage::write(uint32_t address, byte *data, uint32_t len) {
+	if (address > HAL_FLASH_SIZE || len > HAL_FLASH_SIZE - address)
+		return false;
+	if (!_flash_used)
+		hal_flash_erase();
+	memcpy(_flash + address, data, len);
+	return hal_flash_sync();
+}
+
+/****************************************************************************
+ Print, as far as the firmware uses it
+ ****************************************************************************/
+
+static size_t print_num(Print *p, unsigned long long v, bool neg, int base) {
+	char buf[72];
+	int i = sizeof(buf);
+
+	if (base < 2 || base > 16)
+		base = DEC;
+	do {
+		buf[--i] = "0123456789ABCDEF"[v % base];
+		v /= base;
+	} while (v);
+	if (neg)
+		buf[--i] = '-';
+	return p->write((const uint8_t *)buf + i, sizeof(buf) - i);
+}
+
+// Only decimal output is signed, as on the board
+static size_t print_signed(Print *p, long long v, int base) {
+	if (base == DEC && v < 0)
+		return print_num(p, -(unsigned long long)v, true, base);
+	return print_num(p, (uint32_t)v, false, base);
+}
+
+size_t Print::print(const char *s) {
+	return write((const uint8_t *)s, strlen(s));
+}
+
+size_t Print::print(char c) {
+	return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char v, int base) {
+	return print_num(this, v, false, base);
+}
+
+size_t Print::print(int v, int base) {
+	return print_signed(this, v, base);
+}
+
+size_t Print::print(unsigned int v, int base) {
+	return print_num(this, v, false, base);
+}
+
+size_t Print::print(long v, int base) {
+	return print_signed(this, v, base);
+}
+
+size_t Print::print(unsigned long v, int base) {
+	return print_num(this, v, false, base);
+}
+
+size_t Print::print(double v, int digits) {
+	char buf[64];
+	int n = snprintf(buf, sizeof(buf), "%.*f", digits, v);
+
+	return write((const uint8_t *)buf, n);
+}
+
+size_t Print::println(void) {
+	return write((const uint8_t *)"\r\n", 2);
+}
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size) {
+	size_t n = strlen(src);
+
+	if (size) {
+		size_t c = n < size - 1 ? n : size - 1;
+		memcpy(dst, src, c);
+		dst[c] = '\0';
+	}
+	return n;
+}
+#endif
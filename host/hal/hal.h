@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+// Host build only: drives the simulated board behind the Arduino
+// headers in this directory. Time stands still unless hal_advance() is
+// called; the timer interrupt fires from there, on schedule.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The ADS1115 channels appear as simulated pins from here on
+#define HAL_ADS1115_PIN 100
+#define HAL_PINS (HAL_ADS1115_PIN + 8)
+
+// Back to power-on: clock, pins, serial buffers and interrupt handlers
+void hal_reset(void);
+
+// Move the virtual clock forward, running every timer tick that falls
+// due on the way. Returns the number of ticks run.
+unsigned long hal_advance(unsigned long us);
+unsigned long long hal_now(void);
+
+// Simulated ports. The reader defaults to a counter per pin; writes are
+// recorded and can be read back with hal_written().
+typedef int (*tHalReader)(int pin, unsigned long long now);
+void hal_reader(tHalReader fn);
+int hal_read(int pin);
+int hal_written(int pin);
+unsigned long hal_writes(void);
+
+// Bus outputs write the PIO registers instead: PIOA to PIOD, as
+// declared in Arduino.h
+
+// Raise the interrupt attached to a pin, as if its edge came in
+bool hal_irq(int pin);
+
+// Bytes for SerialUSB.read(). Output is collected for hal_serial_take()
+// unless a sink is set; NULL goes back to collecting.
+typedef void (*tHalSink)(const uint8_t *buf, size_t n);
+void hal_serial_input(const void *buf, size_t n);
+size_t hal_serial_pending(void);
+void hal_serial_sink(tHalSink fn);
+void hal_serial_discard(const uint8_t *buf, size_t n);
+size_t hal_serial_take(char *buf, size_t n);
+
+// Flash, as seen by DueFlashStorage. It starts out erased and keeps
+// its contents across hal_reset(). With a file, the contents are read
+// from it (if it exists) and every write goes to it as well; NULL goes
+// back to memory only.
+#define HAL_FLASH_SIZE 4096
+bool hal_flash_file(const char *path);
+void hal_flash_erase(void);
+
+#endif
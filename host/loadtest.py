@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Load profiles for GPIO_Platform, end to end: configures the sources,
+# reads the stream for a while, decodes it and reports the sustained
+# samples per second, the share of samples lost in the device and the
+# latency from sampling to arrival. Runs against a real board or starts
+# the virtual device from the host build.
+#
+#	loadtest.py [--port tty | --vdev gpio_vdev] [--seconds n] [--check]
+#	            [profile...]
+#
+# Latency is measured from the device timestamp, against the fastest
+# sample seen, so it is the spread on top of the fixed delay, not the
+# absolute delay. --check fails unless every profile got at least 80%
+# of its samples without a loss; meant for the light profiles.
+
+import argparse
+import os
+import select
+import subprocess
+import sys
+import termios
+import time
+import tty
+
+FRAME_SYNC = 0xA5
+FRAME_SAMPLES = 0x01
+FRAME_HEARTBEAT = 0x07
+
+# name: (stream mode, sources as (port, period in uS))
+PROFILES = {
+    "text-4x1k": (0, [("a%d" % i, 1000) for i in range(4)]),
+    "binary-4x1k": (1, [("a%d" % i, 1000) for i in range(4)]),
+    "text-12x1k": (0, [("a%d" % i, 1000) for i in range(12)]),
+    "binary-12x1k": (1, [("a%d" % i, 1000) for i in range(12)]),
+    "binary-4x10k": (1, [("a%d" % i, 100) for i in range(4)]),
+    "binary-16x10k": (1, [("a%d" % (i % 12), 100) for i in range(16)]),
+}
+
+
+def varint(buf, i):
+    v = shift = 0
+    while True:
+        b = buf[i]
+        i += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, i
+
+
+def svarint(buf, i):
+    u, i = varint(buf, i)
+    return (u >> 1) ^ -(u & 1), i
+
+
+def fletcher(data):
+    s1 = s2 = 0
+    for b in data:
+        s1 = (s1 + b) % 255
+        s2 = (s2 + s1) % 255
+    return bytes([s1, s2])
+
+
+class Stream:
+    """Decodes VAL lines and sample frames into (time, key, value), and
+    keeps the loss counters from the heartbeats."""
+
+    def __init__(self):
+        self.buf = b""
+        self.samples = 0
+        self.offsets = []       # Arrival minus device time, in seconds
+        self.beats = []         # (pushed, dropped)
+        self.corrupt = 0
+        self.gaps = 0
+        self.t = 0
+        self.src = {}           # index: [key, period, time, value]
+        self.seq = None
+
+    def sample(self, t, now):
+        self.samples += 1
+        self.offsets.append(now - t / 1e6)
+
+    def feed(self, data, now):
+        self.buf += data
+        i = 0
+        buf = self.buf
+        while i < len(buf):
+            if buf[i] == FRAME_SYNC:
+                if i + 4 > len(buf):
+                    break
+                n = buf[i + 2] | buf[i + 3] << 8
+                end = i + 6 + n
+                if end > len(buf):
+                    break
+                if fletcher(buf[i + 1:i + 4 + n]) != buf[i + 4 + n:end]:
+                    self.corrupt += 1
+                else:
+                    self.frame(buf[i + 1], buf[i + 4:i + 4 + n], now)
+                i = end
+                continue
+            j = buf.find(b"\n", i)
+            if j < 0:
+                break
+            self.line(buf[i:j].decode("latin-1").split(), now)
+            i = j + 1
+        self.buf = buf[i:]
+
+    def line(self, w, now):
+        if not w:
+            return
+        if w[0] == "TIME":
+            self.t = int(w[1])
+        elif w[0] == "VAL":
+            self.t += int(w[1])
+            for _ in w[2::2]:
+                self.sample(self.t, now)
+        elif w[0] == "BEAT":
+            self.beats.append((int(w[2]), int(w[3])))
+
+    def frame(self, ftype, p, now):
+        if ftype == FRAME_HEARTBEAT:
+            _, i = varint(p, 0)
+            pushed, i = varint(p, i)
+            dropped, i = varint(p, i)
+            self.beats.append((pushed, dropped))
+        elif ftype == FRAME_SAMPLES:
+            self.records(p, now)
+
+    def records(self, p, now):
+        if self.seq is not None and p[0] != (self.seq + 1) & 0xff:
+            self.gaps += 1
+            self.src = {}
+        self.seq = p[0]
+        i = 1
+        t = 0
+        while i < len(p):
+            kind, n = p[i] & 0xf0, p[i] & 0x0f
+            i += 1
+            s = self.src.get(n)
+            if kind == 0x40:
+                key = p[i]
+                period, i = varint(p, i + 1)
+                t, i = varint(p, i)
+                v, i = svarint(p, i)
+                self.src[n] = [key, period, t, v]
+                self.sample(t, now)
+                continue
+            if kind == 0x50:
+                _, i = varint(p, i + 1)
+                _, i = svarint(p, i)
+                continue
+            if kind == 0x00:
+                jitter, i = svarint(p, i)
+                _, i = svarint(p, i)
+                if s:
+                    s[2] += s[1] + jitter
+                    t = s[2]
+                    self.sample(t, now)
+            elif kind == 0x10:
+                _, i = svarint(p, i)
+                if s:
+                    s[2] = t
+                    self.sample(t, now)
+            elif kind == 0x20:
+                count, i = varint(p, i)
+                for _ in range(count):
+                    if s:
+                        s[2] += s[1]
+                        self.sample(s[2], now)
+            elif kind == 0x30:
+                i += 3
+                for _ in range(2):
+                    if s:
+                        s[2] += s[1]
+                        self.sample(s[2], now)
+            else:
+                # Unknown record, the rest of the frame can't be parsed
+                self.corrupt += 1
+                return
+
+
+def open_port(path):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+    tty.setraw(fd)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+    return fd
+
+
+def send(fd, *lines):
+    for line in lines:
+        data = (line + "\r").encode()
+        while data:
+            try:
+                data = data[os.write(fd, data):]
+            except BlockingIOError:
+                select.select([], [fd], [], 1)
+
+
+def read_for(fd, seconds, stream):
+    end = time.monotonic() + seconds
+    total = 0
+    while True:
+        left = end - time.monotonic()
+        if left <= 0:
+            return total
+        if not select.select([fd], [], [], left)[0]:
+            continue
+        try:
+            data = os.read(fd, 65536)
+        except BlockingIOError:
+            continue
+        total += len(data)
+        if stream:
+            stream.feed(data, time.monotonic())
+
+
+def percentile(values, q):
+    if not values:
+        return 0
+    return values[min(len(values) - 1, int(len(values) * q))]
+
+
+def run(fd, name, seconds):
+    mode, sources = PROFILES[name]
+    send(fd, "stop", "clear", "debug 0", "budget 80 0", "heartbeat 0",
+         "stream %d" % mode)
+    read_for(fd, 0.2, None)
+
+    cmds = ["begin"]
+    for i, (port, period) in enumerate(sources):
+        cmds.append("source_add %c %s %d 0 0 0" % (65 + i, port, period))
+    cmds += ["commit", "heartbeat 500", "start"]
+    stream = Stream()
+    send(fd, *cmds)
+    nbytes = read_for(fd, seconds, stream)
+    send(fd, "stop", "heartbeat 0", "stream 0")
+    read_for(fd, 0.2, stream)
+
+    expect = sum(1e6 / period for _, period in sources)
+    rate = stream.samples / seconds
+    pushed = dropped = 0
+    if len(stream.beats) > 1:
+        pushed = stream.beats[-1][0] - stream.beats[0][0]
+        dropped = stream.beats[-1][1] - stream.beats[0][1]
+    loss = 100.0 * dropped / (pushed + dropped) if pushed + dropped else 0
+    base = min(stream.offsets, default=0)
+    lat = sorted(o - base for o in stream.offsets)
+    print("%-14s %9.0f %9.0f %7.2f %7.1f %7.1f %7.1f %9.0f %s" % (
+        name, expect, rate, loss, percentile(lat, 0.5) * 1e3,
+        percentile(lat, 0.99) * 1e3, percentile(lat, 1) * 1e3,
+        nbytes / seconds,
+        "" if not (stream.gaps or stream.corrupt) else
+        "gaps %d corrupt %d" % (stream.gaps, stream.corrupt)))
+    return rate >= 0.8 * expect and dropped == 0 and not stream.gaps \
+        and not stream.corrupt
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--port", help="serial port of the board")
+    ap.add_argument("--vdev", help="start this virtual device instead")
+    ap.add_argument("--seconds", type=float, default=5)
+    ap.add_argument("--check", action="store_true")
+    ap.add_argument("profiles", nargs="*", choices=[[]] + list(PROFILES))
+    args = ap.parse_args()
+
+    vdev = None
+    port = args.port
+    if args.vdev:
+        vdev = subprocess.Popen([args.vdev], stdout=subprocess.PIPE)
+        port = vdev.stdout.readline().decode().strip()
+    if not port:
+        ap.error("need --port or --vdev")
+
+    ok = True
+    try:
+        fd = open_port(port)
+        print("%-14s %9s %9s %7s %7s %7s %7s %9s" % (
+            "profile", "expect/s", "got/s", "loss%", "p50 ms", "p99 ms",
+            "max ms", "bytes/s"))
+        for name in args.profiles or list(PROFILES):
+            ok = run(fd, name, args.seconds) and ok
+    finally:
+        if vdev:
+            vdev.terminate()
+            vdev.wait()
+    return 0 if ok or not args.check else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Formats the log frames in a capture of the binary stream, using the
+# event table generated from Log.h. Text lines are passed through, other
+# frames are skipped.
+#
+#	logdecode.py [capture]
+#
+# The event table is read from Log.h in the directory above this script.
+
+import os
+import re
+import sys
+
+FRAME_SYNC = 0xA5
+FRAME_LOG = 0x04
+LEVELS = {"LOG_LEVEL_CRIT": "CRITICAL", "LOG_LEVEL_WARN": "WARN",
+          "LOG_LEVEL_DEBUG": "DEBUG"}
+
+
+def event_table(path):
+    table = []
+    for m in re.finditer(r'X\((\w+),\s*(\w+),\s*"((?:[^"\\]|\\.)*)"\)',
+                         open(path).read()):
+        table.append((m.group(1), LEVELS[m.group(2)], m.group(3)))
+    return table
+
+
+def varint(buf, i):
+    v = shift = 0
+    while True:
+        b = buf[i]
+        i += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, i
+
+
+def svarint(buf, i):
+    u, i = varint(buf, i)
+    return (u >> 1) ^ -(u & 1), i
+
+
+def fletcher(data):
+    s1 = s2 = 0
+    for b in data:
+        s1 = (s1 + b) % 255
+        s2 = (s2 + s1) % 255
+    return bytes([s1, s2])
+
+
+def log_records(payload, table):
+    i = 0
+    while i < len(payload):
+        eid = payload[i]
+        t, i = varint(payload, i + 1)
+        n = payload[i]
+        i += 1
+        args = []
+        for _ in range(n):
+            a, i = svarint(payload, i)
+            args.append(a)
+        if eid >= len(table):
+            yield t, "UNKNOWN event %d %s" % (eid, args)
+            continue
+        name, level, fmt = table[eid]
+        args += [0] * fmt.count("%d")
+        yield t, "%s %s" % (level, fmt % tuple(args[:fmt.count("%d")]))
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    table = event_table(os.path.join(here, "..", "Log.h"))
+    f = open(sys.argv[1], "rb") if len(sys.argv) > 1 else sys.stdin.buffer
+    buf = f.read()
+    out = sys.stdout
+    i = 0
+    while i < len(buf):
+        if buf[i] != FRAME_SYNC:
+            j = buf.find(b"\n", i)
+            j = len(buf) if j < 0 else j + 1
+            out.write(buf[i:j].decode("latin-1"))
+            i = j
+            continue
+        if i + 4 > len(buf):
+            break
+        ftype = buf[i + 1]
+        n = buf[i + 2] | buf[i + 3] << 8
+        end = i + 4 + n + 2
+        if end > len(buf):
+            break
+        if fletcher(buf[i + 1:i + 4 + n]) != buf[i + 4 + n:end]:
+            out.write("# corrupt frame\n")
+        elif ftype == FRAME_LOG:
+            for t, line in log_records(buf[i + 4:i + 4 + n], table):
+                out.write("%d %s\n" % (t, line))
+        i = end
+
+
+if __name__ == "__main__":
+    main()
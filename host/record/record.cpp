@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Recordings on disk, see host/client/Recording.h:
+//
+//   gpio_record convert capture out.rec
+//   gpio_record live port out.rec
+//   gpio_record info file.rec
+//   gpio_record dump file.rec key [from [to]]
+//   gpio_record plot file.rec key from to width
+//
+// convert reads a capture of what the board sent, VAL lines, binary
+// frames or both, as saved from the serial port. live records from the
+// board as it is configured, until interrupted. dump prints the time and
+// value of each sample of a source, from <= t < to, in uS. plot prints
+// the window split into width columns, with the start, count, min, max
+// and mean of each, as read from the pyramid.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "Client.h"
+#include "Recording.h"
+
+static volatile sig_atomic_t Quit;
+
+static void quit(int) {
+	Quit = 1;
+}
+
+static int convert(const char *in, const char *out) {
+	gpio::Recorder r;
+	gpio::RecorderSink sink(&r);
+	gpio::Decoder d(&sink);
+	std::vector<unsigned char> buf(1 << 20);
+	size_t have = 0, n, used;
+	FILE *f;
+
+	f = fopen(in, "rb");
+	if (!f) {
+		perror(in);
+		return 1;
+	}
+	if (!r.open(out)) {
+		perror(out);
+		fclose(f);
+		return 1;
+	}
+	while ((n = fread(&buf[have], 1, buf.size() - have, f)) > 0) {
+		have += n;
+		used = d.feed(&buf[0], have);
+		memmove(&buf[0], &buf[used], have - used);
+		have -= used;
+	}
+	// A last line without its line end
+	if (have) {
+		buf.resize(have);
+		buf.push_back('\n');
+		d.feed(&buf[0], buf.size());
+	}
+	fclose(f);
+	if (!r.close()) {
+		perror(out);
+		return 1;
+	}
+	printf("%llu samples, %lu damaged frames, %lu lost\n",
+		r.samples(), d.corrupt(), d.gaps());
+	return 0;
+}
+
+static int live(const char *port, const char *out) {
+	gpio::Client c;
+	gpio::Recorder r;
+	gpio::Subscription *sub = c.subscribe(NULL, 1024);
+
+	if (!r.open(out)) {
+		perror(out);
+		return 1;
+	}
+	if (!c.open(port)) {
+		perror(port);
+		return 1;
+	}
+	signal(SIGINT, quit);
+	signal(SIGTERM, quit);
+	while (!Quit) {
+		gpio::tBatch *b = sub->wait(100);
+
+		if (!b)
+			continue;
+		r.add(b->key, b->s, b->n);
+		sub->release(b);
+	}
+	c.close();
+	while (gpio::tBatch *b = sub->pop()) {
+		r.add(b->key, b->s, b->n);
+		sub->release(b);
+	}
+	if (!r.close()) {
+		perror(out);
+		return 1;
+	}
+	gpio::tClientStats s = c.counters();
+	printf("%llu samples, %lu lost here, %lu damaged frames, %lu lost\n",
+		r.samples(), sub->lost(), s.corrupt, s.gaps);
+	return 0;
+}
+
+static int info(const char *file) {
+	gpio::Recording rec;
+	std::string keys;
+	size_t i, levels = 0;
+
+	if (!rec.open(file)) {
+		perror(file);
+		return 1;
+	}
+	keys = rec.keys();
+	for (i = 0; i < rec.chunks().size(); i++)
+		levels += rec.chunks()[i].level != 0;
+	printf("%zu chunks, %zu of them of the pyramid%s\n",
+		rec.chunks().size(), levels,
+		rec.recovered() ? ", index rebuilt" : "");
+	for (i = 0; i < keys.size(); i++) {
+		gpio::tTime first, last;
+
+		rec.range(keys[i], &first, &last);
+		printf("%c %llu samples, %llu to %llu\n", keys[i],
+			rec.count(keys[i]), first, last);
+	}
+	return 0;
+}
+
+static int dump(const char *file, char key, gpio::tTime from, gpio::tTime to) {
+	gpio::Recording rec;
+	std::vector<gpio::tSample> s;
+	size_t i;
+
+	if (!rec.open(file)) {
+		perror(file);
+		return 1;
+	}
+	rec.read(key, from, to, s);
+	for (i = 0; i < s.size(); i++)
+		printf("%llu %d\n", s[i].t, s[i].v);
+	return 0;
+}
+
+static int plot(const char *file, char key, gpio::tTime from, gpio::tTime to, size_t width) {
+	gpio::Recording rec;
+	std::vector<gpio::tBucket> b;
+	size_t i;
+	int level;
+
+	if (!rec.open(file)) {
+		perror(file);
+		return 1;
+	}
+	level = rec.plot(key, from, to, width, b);
+	printf("# level %d\n", level);
+	for (i = 0; i < b.size(); i++) {
+		if (!b[i].count)
+			continue;
+		printf("%llu %lu %d %d %.2f\n", b[i].t, b[i].count, b[i].min,
+			b[i].max, (double)b[i].sum / b[i].count);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc == 4 && !strcmp(argv[1], "convert"))
+		return convert(argv[2], argv[3]);
+	if (argc == 4 && !strcmp(argv[1], "live"))
+		return live(argv[2], argv[3]);
+	if (argc == 3 && !strcmp(argv[1], "info"))
+		return info(argv[2]);
+	if (argc >= 4 && argc <= 6 && !strcmp(argv[1], "dump"))
+		return dump(argv[2], argv[3][0],
+			argc > 4 ? strtoull(argv[4], NULL, 0) : 0,
+			argc > 5 ? strtoull(argv[5], NULL, 0) : ~0ULL);
+	if (argc == 7 && !strcmp(argv[1], "plot"))
+		return plot(argv[2], argv[3][0], strtoull(argv[4], NULL, 0),
+			strtoull(argv[5], NULL, 0), strtoul(argv[6], NULL, 0));
+
+	fprintf(stderr, "usage: %s convert capture out.rec\n"
+		"       %s live port out.rec\n"
+		"       %s info file.rec\n"
+		"       %s dump file.rec key [from [to]]\n"
+		"       %s plot file.rec key from to width\n",
+		argv[0], argv[0], argv[0], argv[0], argv[0]);
+	return 2;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// What the host tests share: CHECK() counts failures instead of
+// stopping at the first one, check_done() reports them as the exit
+// code, and spawn() runs the programs under test.
+
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int Failed;
+
+#define CHECK(c) do { \
+	if (!(c)) { \
+		printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #c); \
+		Failed++; \
+	} \
+} while (0)
+
+static inline int check_done(void) {
+	if (Failed) {
+		printf("%d checks failed\n", Failed);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
+
+// Runs a program; if name is set, returns the first line it prints,
+// which is the terminal of gpio_vdev
+static inline pid_t spawn(const char *const *argv, char *name, size_t n) {
+	int fd[2];
+	pid_t pid;
+	FILE *f;
+
+	if (name && pipe(fd))
+		return -1;
+	pid = fork();
+	if (pid == 0) {
+		if (name) {
+			dup2(fd[1], 1);
+			close(fd[0]);
+			close(fd[1]);
+		}
+		execv(argv[0], (char *const *)argv);
+		_exit(127);
+	}
+	if (!name)
+		return pid;
+	close(fd[1]);
+	f = fdopen(fd[0], "r");
+	if (!f || !fgets(name, n, f)) {
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	name[strcspn(name, "\n")] = 0;
+	fclose(f);
+	return pid;
+}
+
+static inline void spawn_stop(pid_t pid) {
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+#endif
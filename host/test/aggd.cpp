@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// The shared-memory ring on its own, then gpio_aggd with two virtual
+// devices and two readers.
+//
+//   gpio_aggd_test path/to/gpio_vdev path/to/gpio_aggd
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include "Client.h"
+#include "Shm.h"
+#include "Check.h"
+
+static void ring(const char *name) {
+	const char *boards[] = { "one" };
+	gpio::tSample s[64];
+	gpio::ShmWriter w;
+	gpio::ShmReader r;
+	const gpio::tShmRecord *p;
+	size_t i, n;
+
+	for (i = 0; i < 64; i++) {
+		s[i].t = i;
+		s[i].v = -(int)i;
+	}
+	CHECK(w.create(name, 10, 1, boards));
+	CHECK(r.open(name));
+	CHECK(r.header()->size == 16 && r.header()->boards == 1);
+	CHECK(!strcmp(r.header()->board[0].name, "one"));
+	CHECK(r.peek(&p) == 0);
+
+	w.publish(0, 'A', s, 10);
+	n = r.peek(&p);
+	CHECK(n == 10 && p[0].t == 0 && p[9].v == -9 && p[3].key == 'A');
+	CHECK(r.done(n));
+
+	// 40 more: the first 24 of them are gone by now
+	w.publish(0, 'A', s + 10, 40);
+	n = r.peek(&p);
+	CHECK(r.lost() == 24);
+	CHECK(n == 14 && p[0].t == 34);
+	CHECK(r.done(n));
+	n = r.peek(&p);
+	CHECK(n == 2 && p[0].t == 48);
+
+	// Overwritten while being read
+	w.publish(0, 'A', s, 16);
+	CHECK(!r.done(n));
+	CHECK(r.lost() == 26);
+	n = r.peek(&p);
+	CHECK(n == 14 && p[0].t == 0 && r.lost() == 26);
+	CHECK(r.done(n));
+	CHECK(w.board(0)->samples == 66);
+
+	w.close();
+	CHECK(!r.open(name));
+}
+
+typedef struct {
+	unsigned long n[2][256];
+	unsigned long backwards;
+	uint64_t last[2][256];
+} tCount;
+
+static void count(const char *name, int ms, tCount *c) {
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	gpio::ShmReader r;
+
+	memset(c, 0, sizeof(*c));
+	if (!r.open(name))
+		return;
+	while (std::chrono::steady_clock::now() < end) {
+		const gpio::tShmRecord *p;
+		size_t n, i;
+
+		n = r.peek(&p);
+		if (!n) {
+			usleep(500);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			int b = p[i].board & 1;
+			unsigned char k = p[i].key;
+
+			if (c->n[b][k] && p[i].t <= c->last[b][k])
+				c->backwards++;
+			c->last[b][k] = p[i].t;
+			c->n[b][k]++;
+		}
+		if (!r.done(n))
+			c->backwards += 1000000;
+	}
+}
+
+static void aggd(const char *vdev, const char *agg, const char *name) {
+	const char *v[] = { vdev, NULL };
+	char pty[2][256];
+	pid_t pv[2], pa;
+	gpio::ShmReader r;
+	tCount c1, c2;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		gpio::Client c;
+
+		pv[i] = spawn(v, pty[i], sizeof(pty[i]));
+		CHECK(pv[i] > 0);
+		CHECK(c.open(pty[i]));
+		if (i == 0) {
+			CHECK(c.source_add('A', "a0", 1000, 0, 0, 0).get() == gpio::E_OK);
+		} else {
+			CHECK(c.source_add('A', "a0", 1000, 0, 0, 0).get() == gpio::E_OK);
+			CHECK(c.source_add('B', "a1", 500, 0, 0, 0).get() == gpio::E_OK);
+		}
+	}
+
+	const char *a[] = { agg, "--name", name, "--sync", "0.2", "--start",
+		pty[0], pty[1], NULL };
+	pa = spawn(a, NULL, 0);
+	CHECK(pa > 0);
+	for (i = 0; i < 200 && !r.open(name); i++)
+		usleep(10000);
+	CHECK(i < 200);
+	r.close();
+	// Until both boards are going
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	std::thread t(count, name, 1000, &c2);
+	count(name, 1000, &c1);
+	t.join();
+
+	printf("board 0: A %lu, board 1: A %lu B %lu; second reader A %lu\n",
+		c1.n[0]['A'], c1.n[1]['A'], c1.n[1]['B'], c2.n[0]['A']);
+	CHECK(c1.n[0]['A'] > 700 && c1.n[0]['A'] < 1300);
+	CHECK(c1.n[1]['A'] > 700 && c1.n[1]['A'] < 1300);
+	CHECK(c1.n[1]['B'] > 1400 && c1.n[1]['B'] < 2600);
+	CHECK(c1.n[0]['B'] == 0);
+	CHECK(c1.backwards == 0 && c2.backwards == 0);
+	// Same stream, give or take where they started and stopped
+	CHECK(c2.n[1]['B'] > c1.n[1]['B'] - 100 && c2.n[1]['B'] < c1.n[1]['B'] + 100);
+
+	// Both boards on the host's timeline: the last samples were just now
+	gpio::tClockFit f0, f1;
+	double now = gpio::host_time(), h0, h1;
+
+	CHECK(r.open(name));
+	CHECK(r.clock(0, &f0) && r.clock(1, &f1));
+	h0 = gpio::clock_to_ref(f0, c1.last[0]['A']);
+	h1 = gpio::clock_to_ref(f1, c1.last[1]['B']);
+	printf("last samples %.1f and %.1f mS ago, clocks to %.0f and %.0f uS\n",
+		(now - h0) / 1000, (now - h1) / 1000, f0.error, f1.error);
+	CHECK(now - h0 > -10000 && now - h0 < 100000);
+	CHECK(now - h1 > -10000 && now - h1 < 100000);
+	CHECK(fabs(h0 - h1) < 10000);
+	r.close();
+
+	spawn_stop(pa);
+	for (i = 0; i < 2; i++) {
+		spawn_stop(pv[i]);
+	}
+	CHECK(!r.open(name));
+}
+
+int main(int argc, char **argv) {
+	char name[64];
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s gpio_vdev gpio_aggd\n", argv[0]);
+		return 2;
+	}
+	snprintf(name, sizeof(name), "/gpio_test_%d", (int)getpid());
+
+	ring(name);
+	aggd(argv[1], argv[2], name);
+
+	return check_done();
+}
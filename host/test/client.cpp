@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// The host client library against the virtual device: command replies,
+// the samples of both stream modes as seen by a subscriber, and a fed
+// output kept going by play().
+//
+//   gpio_client_test path/to/gpio_vdev
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <future>
+#include <thread>
+#include "Client.h"
+#include "Check.h"
+
+typedef struct {
+	unsigned long n;
+	gpio::tTime first, last;
+	unsigned long backwards;	// Time not moving forward
+	unsigned long off;		// Not one period after the previous one
+} tSeen;
+
+// Consumes the subscription for ms, per key
+static void collect(gpio::Subscription *sub, int ms, tSeen *seen) {
+	std::chrono::steady_clock::time_point end =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+
+	memset(seen, 0, 256 * sizeof(tSeen));
+	while (std::chrono::steady_clock::now() < end) {
+		gpio::tBatch *b = sub->wait(10);
+		int i;
+
+		if (!b)
+			continue;
+		tSeen *s = &seen[(unsigned char)b->key];
+		for (i = 0; i < b->n; i++) {
+			gpio::tTime t = b->s[i].t;
+
+			if (s->n && t <= s->last)
+				s->backwards++;
+			else if (s->n && t - s->last != 1000)
+				s->off++;
+			if (!s->n)
+				s->first = t;
+			s->last = t;
+			s->n++;
+		}
+		sub->release(b);
+	}
+}
+
+static void run(gpio::Client &c, gpio::Subscription *all, gpio::Subscription *only, int mode) {
+	static tSeen seen[256], seen_a[256];
+	std::thread t;
+
+	CHECK(c.stream(mode).get() == gpio::E_OK);
+	CHECK(c.start().get() == gpio::E_OK);
+	t = std::thread(collect, only, 500, seen_a);
+	collect(all, 500, seen);
+	t.join();
+	CHECK(c.stop().get() == gpio::E_OK);
+	// What was still under way
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	while (gpio::tBatch *b = all->pop())
+		all->release(b);
+	while (gpio::tBatch *b = only->pop())
+		only->release(b);
+
+	printf("stream %d: A %lu B %lu, A alone %lu\n", mode,
+		seen['A'].n, seen['B'].n, seen_a['A'].n);
+	// 1 kHz for half a second, give or take the start and the scheduler
+	CHECK(seen['A'].n > 300 && seen['A'].n < 700);
+	CHECK(seen['B'].n > 300 && seen['B'].n < 700);
+	CHECK(seen['A'].backwards == 0 && seen['B'].backwards == 0);
+	CHECK(seen['A'].off < seen['A'].n / 10);
+	CHECK(seen_a['A'].n > 300 && seen_a['B'].n == 0);
+	CHECK(all->lost() == 0 && only->lost() == 0);
+}
+
+// Three feeds' worth at 5 kHz. Filled up before the start, the output
+// must not run dry until the end.
+static void play(gpio::Client &c, int mode) {
+	static int v[3 * 2048];
+	size_t done = 0;
+	gpio::tCredit cr;
+	std::thread t;
+	int i;
+
+	for (i = 0; i < (int)(sizeof(v) / sizeof(v[0])); i++)
+		v[i] = i & 4095;
+
+	CHECK(c.stream(mode).get() == gpio::E_OK);
+	CHECK(c.output_add('f', "DAC0", 200, 1, 0, 0, "feed").get() == gpio::E_OK);
+	CHECK(c.feed('q', v, 1).get() == gpio::E_NOKEY);
+
+	t = std::thread([&c, &done]() {
+		done = c.play('f', v, sizeof(v) / sizeof(v[0]));
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	CHECK(c.credit('f', &cr) && cr.free < 100 && cr.played == 0);
+	CHECK(c.start().get() == gpio::E_OK);
+	t.join();
+	CHECK(done == sizeof(v) / sizeof(v[0]));
+	CHECK(c.credit('f', &cr) && cr.underruns == 0);
+
+	// It reports running dry on its own
+	for (i = 0; i < 100 && c.credit('f', &cr) && cr.played < done; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	printf("feed %d: played %lu, %lu underruns\n", mode, cr.played,
+		cr.underruns);
+	CHECK(cr.played == done && cr.free == 2048);
+	CHECK(c.stop().get() == gpio::E_OK);
+	CHECK(c.output_del('f').get() == gpio::E_OK);
+}
+
+int main(int argc, char **argv) {
+	char name[256];
+	unsigned long lines = 0;
+	gpio::Client c;
+	gpio::Subscription *all, *only;
+	pid_t pid;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s gpio_vdev\n", argv[0]);
+		return 2;
+	}
+	const char *v[] = { argv[1], "--signal", "ramp", NULL };
+	pid = spawn(v, name, sizeof(name));
+	if (pid < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	all = c.subscribe(NULL);
+	only = c.subscribe("A");
+	c.on_line([&lines](const char *, size_t) { lines++; });
+	CHECK(c.open(name));
+
+	// Replies, in the order of the commands or not
+	std::future<int> f1 = c.source_add('A', "a0", 1000, 0, 0, 0);
+	std::future<int> f2 = c.source_add('A', "a1", 1000, 0, 0, 0);
+	std::future<int> f3 = c.source_add('Z', "nope", 1000, 0, 0, 0);
+	CHECK(f3.get() == gpio::E_PORT);
+	CHECK(f2.get() == gpio::E_EXISTS);
+	CHECK(f1.get() == gpio::E_OK);
+	CHECK(c.source_add('B', "a1", 1000, 0, 0, 0).get() == gpio::E_OK);
+	CHECK(c.command(0x7f).get() == gpio::E_UNKNOWN);
+	CHECK(c.pattern_list().get() == gpio::E_OK);
+	CHECK(lines > 0);
+
+	// A bus has to stay on one port controller
+	static const char *const bus[] = { "D33", "D34", "D35", "D22" };
+	CHECK(c.output_bus('b', 1000, 1, 0, 0, "inc", 0, bus, 4).get() == gpio::E_PORT);
+	CHECK(c.output_bus('b', 1000, 1, 0, 0, "inc", 0, bus, 3).get() == gpio::E_OK);
+	CHECK(c.output_del('b').get() == gpio::E_OK);
+	// Fed values only have 16 bits
+	static const char *const wide[] = { "D33", "D34", "D35", "D36", "D37",
+		"D38", "D39", "D40", "D41", "D44", "D45", "D46", "D47", "D48",
+		"D49", "D50", "D51" };
+	CHECK(c.output_bus('b', 1000, 1, 0, 0, "feed", 0, wide, 17).get() == gpio::E_INVALID);
+	CHECK(c.output_bus('b', 1000, 1, 0, 0, "feed", 0, wide, 16).get() == gpio::E_OK);
+	CHECK(c.output_del('b').get() == gpio::E_OK);
+
+	run(c, all, only, 0);
+	run(c, all, only, 1);
+	play(c, 0);
+	play(c, 1);
+
+	// The clock of the device against ours, from pings in both modes
+	gpio::ClockModel m;
+	gpio::tTime sent, received, device;
+
+	CHECK(c.sync(&m, 10) == 10);
+	CHECK(c.stream(0).get() == gpio::E_OK);
+	CHECK(c.sync(&m, 10) == 10);
+	CHECK(c.exchange(&sent, &received, &device));
+	printf("clock: error %.0f uS, %+.0f ppm\n", m.error(), m.drift_ppm());
+	CHECK(m.points() == 20 && m.error() < 20000);
+	CHECK(fabs(m.to_ref(device) - (sent + received) / 2.0) < m.error() + (received - sent));
+
+	gpio::tClientStats s = c.counters();
+	printf("%llu bytes, %llu samples, %lu corrupt, %lu gaps\n",
+		s.bytes, s.samples, s.corrupt, s.gaps);
+	CHECK(s.corrupt == 0 && s.gaps == 0);
+
+	std::future<int> f = c.dump();
+	c.close();
+	int r = f.get();
+	CHECK(r == gpio::E_OK || r == gpio::E_CLOSED);
+	CHECK(c.stop().get() == gpio::E_CLOSED);
+
+	spawn_stop(pid);
+
+	// A device going away answers whatever is still waiting
+	pid = spawn(v, name, sizeof(name));
+	CHECK(pid > 0 && c.open(name));
+	kill(pid, SIGSTOP);
+	f = c.stop();
+	std::future<bool> e = std::async(std::launch::async, [&c]() {
+		gpio::tTime sent, received, device;
+		return c.exchange(&sent, &received, &device, 5000);
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	CHECK(f.wait_for(std::chrono::seconds(2)) == std::future_status::ready &&
+	      f.get() == gpio::E_CLOSED);
+	CHECK(e.wait_for(std::chrono::seconds(2)) == std::future_status::ready &&
+	      !e.get());
+	CHECK(c.stop().get() == gpio::E_CLOSED);
+	CHECK(!c.open(name));
+	c.close();
+
+	return check_done();
+}
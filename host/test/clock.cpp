@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Fitting clock models against simulated boards, whose crystals are off
+// by up to 100 ppm, and whose ping replies are held up by random delays.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "Clock.h"
+#include "Check.h"
+
+// A board's clock, started at boot with its own rate
+typedef struct {
+	double boot;	// Host time of the reset
+	double ppm;
+} tBoard;
+
+static double device_time(const tBoard *b, double host) {
+	return (host - b->boot) * (1 + b->ppm / 1e6);
+}
+
+// uS, mostly short, now and then stuck behind a burst of output
+static double delay(void) {
+	if (rand() % 20 == 0)
+		return 5000 + rand() % 20000;
+	return 100 + rand() % 900;
+}
+
+// Pings every half a second for a minute, then how well it maps what
+// follows
+static void pings(const tBoard *b) {
+	gpio::ClockModel m;
+	double host = 5e6, worst = 0;
+	int i;
+
+	for (i = 0; i < 120; i++) {
+		double sent = host;
+		double dev = device_time(b, sent + delay());
+		double received = sent + (dev / (1 + b->ppm / 1e6) + b->boot - sent) + delay();
+
+		m.exchange(sent, received, dev);
+		host += 500000;
+	}
+	printf("%+.0f ppm: fitted %+.2f ppm, error %.0f uS\n", b->ppm,
+		m.drift_ppm(), m.error());
+	CHECK(fabs(m.drift_ppm() - b->ppm) < 10);
+	CHECK(m.error() < 2000);
+
+	// Within the window, and 10 s beyond it
+	for (i = 0; i < 100; i++) {
+		double h = 40e6 + i * 250000;
+		double e = fabs(m.to_ref(device_time(b, h)) - h);
+
+		if (e > worst)
+			worst = e;
+		CHECK(fabs(m.to_device(h) - device_time(b, h)) < m.error() * 2);
+	}
+	CHECK(worst < m.error());
+}
+
+// Two boards see the same pulse train, every second, with a few uS of
+// interrupt latency; board y is mapped onto the time of board x
+static void pulses(const tBoard *x, const tBoard *y) {
+	gpio::ClockModel m(16);
+	double worst = 0;
+	int i;
+
+	for (i = 0; i < 30; i++) {
+		double h = 10e6 + i * 1e6;
+
+		m.add(device_time(y, h) + rand() % 5, device_time(x, h) + rand() % 5, 5);
+	}
+	for (i = 0; i < 100; i++) {
+		double h = 35e6 + i * 70000;
+		double e = fabs(m.to_ref(device_time(y, h)) - device_time(x, h));
+
+		if (e > worst)
+			worst = e;
+	}
+	printf("pulses: %+.2f ppm between them, off by %.1f uS at most, "
+		"bound %.1f\n", m.drift_ppm(), worst, m.error());
+	CHECK(worst < 20);
+	CHECK(m.error() < 30);
+	CHECK(fabs(m.drift_ppm() - (y->ppm - x->ppm)) < 1);
+}
+
+// Until there is enough of a baseline, it is an offset
+static void early(const tBoard *b) {
+	gpio::ClockModel m;
+
+	CHECK(m.points() == 0);
+	m.exchange(3000000, 3000400, device_time(b, 3000200));
+	CHECK(m.points() == 1);
+	CHECK(m.drift_ppm() == 0);
+	CHECK(fabs(m.to_ref(device_time(b, 3000200)) - 3000200) < 1);
+	m.exchange(3001000, 3001400, device_time(b, 3001200));
+	CHECK(m.drift_ppm() == 0);
+	CHECK(m.error() >= 200 && m.error() < 210);
+}
+
+int main(void) {
+	tBoard a = { 1.5e6, 37.5 };
+	tBoard b = { 3.1e6, -92 };
+	tBoard c = { 0.2e6, 0 };
+
+	srand(1);
+	pings(&a);
+	pings(&b);
+	pings(&c);
+	pulses(&a, &b);
+	early(&a);
+
+	return check_done();
+}
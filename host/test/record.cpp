@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Recordings: queries by time against the samples written, rebuilding
+// the index of a file that was cut short, and converting a VAL log.
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "Recording.h"
+#include "Check.h"
+
+typedef struct {
+	char key;
+	gpio::tSample s;
+} tRef;
+
+static std::vector<tRef> Ref;
+
+static bool by_time(const gpio::tSample &a, const gpio::tSample &b) {
+	return a.t < b.t || (a.t == b.t && a.v < b.v);
+}
+
+static std::vector<gpio::tSample> expect(char key, gpio::tTime from, gpio::tTime to) {
+	std::vector<gpio::tSample> v;
+	size_t i;
+
+	for (i = 0; i < Ref.size(); i++) {
+		if (Ref[i].key == key && Ref[i].s.t >= from && Ref[i].s.t < to)
+			v.push_back(Ref[i].s);
+	}
+	std::sort(v.begin(), v.end(), by_time);
+	return v;
+}
+
+static bool same(std::vector<gpio::tSample> a, const std::vector<gpio::tSample> &b) {
+	size_t i;
+
+	std::sort(a.begin(), a.end(), by_time);
+	if (a.size() != b.size())
+		return false;
+	for (i = 0; i < a.size(); i++) {
+		if (a[i].t != b[i].t || a[i].v != b[i].v)
+			return false;
+	}
+	return true;
+}
+
+// What plot() should come to: every sample goes to the column its
+// bucket of level starts in, or that it is in itself for level 0
+static std::vector<gpio::tBucket> expect_plot(char key, gpio::tTime from, gpio::tTime to, size_t width, int level) {
+	std::vector<gpio::tBucket> v(width);
+	gpio::tTime span = to - from, first = from;
+	size_t i;
+
+	if (level)
+		first = from >> REC_WIDTH_SHIFT(level) << REC_WIDTH_SHIFT(level);
+	for (i = 0; i < Ref.size(); i++) {
+		gpio::tTime t = Ref[i].s.t;
+		gpio::tBucket *b;
+		int val = Ref[i].s.v;
+
+		if (level)
+			t = t >> REC_WIDTH_SHIFT(level) << REC_WIDTH_SHIFT(level);
+		if (Ref[i].key != key || t < first || t >= to)
+			continue;
+		if (t < from)
+			t = from;
+		b = &v[(t - from) * width / span];
+		if (!b->count || val < b->min)
+			b->min = val;
+		if (!b->count || val > b->max)
+			b->max = val;
+		b->count++;
+		b->sum += val;
+	}
+	return v;
+}
+
+static bool same_plot(const std::vector<gpio::tBucket> &a, const std::vector<gpio::tBucket> &b) {
+	size_t i;
+
+	if (a.size() != b.size())
+		return false;
+	for (i = 0; i < a.size(); i++) {
+		if (a[i].count != b[i].count)
+			return false;
+		if (a[i].count && (a[i].min != b[i].min || a[i].max != b[i].max ||
+		    a[i].sum != b[i].sum))
+			return false;
+	}
+	return true;
+}
+
+static void add(gpio::Recorder &r, char key, gpio::tTime t, int v) {
+	tRef e = { key, { t, v } };
+
+	r.add(key, t, v);
+	Ref.push_back(e);
+}
+
+// A at 1 kHz with jitter and a random walk, B at 4 kHz with large
+// steps, C restarting from 0 half way through
+static void record(const char *file) {
+	gpio::Recorder r(1000);
+	int i, a = 2048, b = 0;
+
+	CHECK(r.open(file));
+	for (i = 0; i < 20000; i++) {
+		gpio::tTime t = 5000000000ULL + i * 1000ULL;
+
+		a += rand() % 21 - 10;
+		add(r, 'A', t + rand() % 7, a);
+		b = rand() % 100000 - 50000;
+		add(r, 'B', t, b);
+		add(r, 'B', t + 250, -b);
+		add(r, 'B', t + 500, b);
+		add(r, 'B', t + 750, 0);
+		add(r, 'C', (i % 10000) * 100ULL, i);
+	}
+	CHECK(r.close());
+	CHECK(r.samples() == Ref.size());
+}
+
+static void query(const char *file) {
+	gpio::Recording rec;
+	gpio::tTime first, last;
+	int i;
+
+	CHECK(rec.open(file));
+	CHECK(!rec.recovered());
+	CHECK(rec.keys() == "ABC");
+	CHECK(rec.count('A') == 20000 && rec.count('B') == 80000);
+	CHECK(rec.range('B', &first, &last));
+	CHECK(first == 5000000000ULL && last == 5000000000ULL + 19999750ULL);
+	CHECK(!rec.range('D', &first, &last));
+
+	for (i = 0; i < 200; i++) {
+		char key = "ABC"[i % 3];
+		gpio::tTime from, to;
+		std::vector<gpio::tSample> got;
+
+		if (key == 'C') {
+			from = rand() % 1100000;
+			to = from + rand() % 200000;
+		} else {
+			from = 4999000000ULL + rand() % 22000000;
+			to = from + rand() % 3000000;
+		}
+		rec.read(key, from, to, got);
+		CHECK(same(got, expect(key, from, to)));
+	}
+}
+
+// The pyramid against the samples, at every zoom
+static void zoom(const char *file) {
+	gpio::Recording rec;
+	std::vector<gpio::tBucket> got, lvl;
+	int i;
+
+	CHECK(rec.open(file));
+	// All of A: 20 s over 100 columns is 200 mS per column
+	CHECK(rec.plot('A', 5000000000ULL, 5020000000ULL, 100, got) == 2);
+	CHECK(same_plot(got, expect_plot('A', 5000000000ULL, 5020000000ULL, 100, 2)));
+	CHECK(got[0].t == 5000000000ULL && got[1].t == 5000200000ULL);
+	// Less than 16 mS per column, from the samples
+	CHECK(rec.plot('B', 5000000000ULL, 5000100000ULL, 10, got) == 0);
+	CHECK(same_plot(got, expect_plot('B', 5000000000ULL, 5000100000ULL, 10, 0)));
+	CHECK(got[0].count == 40);
+
+	for (i = 0; i < 100; i++) {
+		char key = "ABC"[i % 3];
+		gpio::tTime from, to;
+		size_t width = 1 + rand() % 2000;
+		int level;
+
+		if (key == 'C') {
+			from = rand() % 1100000;
+			to = from + 1 + rand() % 2000000;
+		} else {
+			from = 4999000000ULL + rand() % 22000000;
+			to = from + 1 + (rand() % 2 ? rand() % 30000000 : rand() % 300000);
+		}
+		level = rec.plot(key, from, to, width, got);
+		CHECK(level == 0 || REC_WIDTH(level) <= (to - from) / width);
+		CHECK(same_plot(got, expect_plot(key, from, to, width, level)));
+	}
+
+	// Every level adds up to all the samples
+	for (i = 1; i <= REC_LEVELS; i++) {
+		unsigned long n = 0;
+		size_t j;
+
+		lvl.clear();
+		rec.read_level('B', i, 0, ~0ULL, lvl);
+		for (j = 0; j < lvl.size(); j++)
+			n += lvl[j].count;
+		CHECK(n == 80000);
+	}
+}
+
+// The recorder did not get to write the index, nor all of the last chunk
+static void truncated(const char *file) {
+	gpio::Recording rec;
+	std::vector<gpio::tSample> got;
+	unsigned long long all = 0, kept = 0;
+	size_t i, last, cut;
+
+	CHECK(rec.open(file));
+	const std::vector<gpio::tChunk> c = rec.chunks();
+	last = c.size() - 1;
+	cut = c[last].offset + 10;
+	for (i = 0; i < c.size(); i++) {
+		if (c[i].level)
+			continue;
+		all += c[i].n;
+		if (i != last)
+			kept += c[i].n;
+	}
+	rec.close();
+	CHECK(truncate(file, cut) == 0);
+
+	CHECK(rec.open(file));
+	CHECK(rec.recovered());
+	CHECK(rec.chunks().size() == last);
+	CHECK(rec.count('A') + rec.count('B') + rec.count('C') == kept);
+	CHECK(all == Ref.size());
+	rec.read('A', 0, ~0ULL, got);
+	CHECK(got.size() == rec.count('A'));
+}
+
+static void convert(const char *file) {
+	static const char log[] =
+		"TIME 1000\r\n"
+		"VAL 0 A 5 B 7\r\n"
+		"VAL 1000 A 6\r\n"
+		"some other output\r\n"
+		"VAL 1000 A -3 B 8\r\n"
+		"TIME 100\r\n"
+		"VAL 50 A 1\r\n";
+	gpio::Recorder r(2);
+	gpio::RecorderSink sink(&r);
+	gpio::Decoder d(&sink);
+	gpio::Recording rec;
+	std::vector<gpio::tSample> a, b;
+
+	CHECK(r.open(file));
+	CHECK(d.feed((const unsigned char *)log, sizeof(log) - 1) == sizeof(log) - 1);
+	CHECK(r.close());
+
+	CHECK(rec.open(file));
+	CHECK(rec.keys() == "AB");
+	rec.read('A', 0, ~0ULL, a);
+	rec.read('B', 0, ~0ULL, b);
+	CHECK(a.size() == 4 && b.size() == 2);
+	// The step back in time went into a chunk of its own, which comes
+	// first
+	CHECK(a[0].t == 150 && a[0].v == 1);
+	CHECK(a[1].t == 1000 && a[1].v == 5);
+	CHECK(a[2].t == 2000 && a[2].v == 6);
+	CHECK(a[3].t == 3000 && a[3].v == -3);
+	CHECK(b[0].t == 1000 && b[0].v == 7);
+	CHECK(b[1].t == 3000 && b[1].v == 8);
+}
+
+// A board reset half way: the summaries from before it must not end up
+// in the chunks of those after it, which start over in time
+static void reset(const char *file) {
+	static const size_t widths[] = { 1, 7, 100, 2000 };
+	gpio::Recorder r(1000);
+	gpio::Recording rec;
+	std::vector<gpio::tSample> got;
+	std::vector<gpio::tBucket> plot;
+	int i, level;
+
+	CHECK(r.open(file));
+	for (i = 0; i < 20000; i++)
+		add(r, 'R', (i < 10000 ? 1000000ULL : 0) + (i % 10000) * 1000ULL, i);
+	CHECK(r.close());
+
+	CHECK(rec.open(file));
+	rec.read('R', 0, 5000000, got);
+	CHECK(got.size() == 9000 && same(got, expect('R', 0, 5000000)));
+	for (i = 0; i < (int)(sizeof(widths) / sizeof(widths[0])); i++) {
+		level = rec.plot('R', 0, 5000000, widths[i], plot);
+		CHECK(same_plot(plot, expect_plot('R', 0, 5000000, widths[i], level)));
+	}
+	for (level = 1; level <= REC_LEVELS; level++) {
+		unsigned long n = 0;
+		size_t j;
+
+		plot.clear();
+		rec.read_level('R', level, 0, ~0ULL, plot);
+		for (j = 0; j < plot.size(); j++)
+			n += plot[j].count;
+		CHECK(n == 20000);
+	}
+}
+
+int main(void) {
+	char file[] = "/tmp/gpio_record_testXXXXXX";
+	int fd = mkstemp(file);
+
+	if (fd < 0) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+	srand(1);
+
+	record(file);
+	query(file);
+	zoom(file);
+	truncated(file);
+	convert(file);
+	reset(file);
+	unlink(file);
+
+	return check_done();
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Saving the configuration to flash and restoring it at boot, against
+// the file-backed flash of the host build.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "GPIO_Platform.h"
+#include "Sources.h"
+#include "Outputs.h"
+#include "Lowlevel.h"
+#include "SerialMonitor.h"
+#include "Budget.h"
+#include "Store.h"
+#include "hal.h"
+#include "Check.h"
+
+// From the sketch
+void setup(void);
+
+static void cmd(const char *fmt, ...) {
+	char line[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	hal_serial_input(line, strlen(line));
+	hal_serial_input("\r", 1);
+	while (hal_serial_pending())
+		SerialMonitor_poll();
+}
+
+static bool output_has(const char *s) {
+	static char buf[65536];
+	size_t n = hal_serial_take(buf, sizeof(buf) - 1);
+
+	buf[n] = 0;
+	return strstr(buf, s) != NULL;
+}
+
+// Power cycle: RAM is gone, flash is not
+static void reboot(void) {
+	hal_reset();
+	memset(&Master, 0, sizeof(Master));
+	stream_mode = 0;
+	memset(PinModes, 0, sizeof(PinModes));
+	Budget.limit = 80;
+	Budget.mode = 2;
+	sources_backpressure(48, 16);
+	setup();
+}
+
+static void configure(void) {
+	cmd("debug 0");
+	cmd("pin D30 1");
+	cmd("begin");
+	cmd("source_add A a0 1000 4 0 0");
+	cmd("source_add B a1 1000 0 0 0");
+	cmd("source_add C D31 0 0 0 0");
+	cmd("source_attach_irq C D30 1 0");
+	cmd("source_group A B");
+	cmd("source_shed A 1 2");
+	cmd("source_sdt C 5 100000");
+	cmd("source_sdt A 5 100000");
+	cmd("output_add o D2 1000 3 7 1 sine 250");
+	cmd("output_add p DAC0 2000 1 0 0 inc");
+	cmd("output_bus q 500 1 0 0 inc 0 D33 D34 D35 D36 D37 D38 D39 D40");
+	cmd("output_mod p 1 2 500 2000 1000000 2");
+	cmd("output_mod o 0 3 500 1500 0 0 p");
+	cmd("commit");
+	cmd("backpressure 40 10");
+	cmd("budget 70 1");
+	cmd("stream 1");
+	cmd("start");
+}
+
+// The fields the commands set; house keeping is left out
+static bool same_source(const tSourceEntry *a, const tSourceEntry *b) {
+	return a->k == b->k && a->p == b->p && a->period == b->period &&
+		a->avg == b->avg && a->mode == b->mode &&
+		a->delta == b->delta && a->phase == b->phase &&
+		a->group == b->group && a->shed == b->shed &&
+		a->shed_n == b->shed_n && a->sdt == b->sdt &&
+		a->sdt_max == b->sdt_max && a->irq == b->irq &&
+		a->trigger == b->trigger && a->count_ticks == b->count_ticks &&
+		a->method == b->method;
+}
+
+static bool same_mod(const tMod *a, const tMod *b) {
+	return a->shape == b->shape && a->mode == b->mode && a->src == b->src &&
+		a->from == b->from && a->to == b->to && a->time == b->time;
+}
+
+static bool same_output(const tOutputEntry *a, const tOutputEntry *b) {
+	return same_mod(&a->mod[MOD_RATE], &b->mod[MOD_RATE]) &&
+		same_mod(&a->mod[MOD_AMP], &b->mod[MOD_AMP]) && a->k == b->k && a->p == b->p && a->period == b->period &&
+		a->step == b->step && a->offset == b->offset &&
+		a->mode == b->mode && a->v == b->v && a->phase == b->phase &&
+		a->bus.n == b->bus.n && a->bus.mask == b->bus.mask &&
+		a->bus.shift == b->bus.shift &&
+		!memcmp(a->bus.idx, b->bus.idx, sizeof(a->bus.idx));
+}
+
+int main(void) {
+	char path[] = "/tmp/gpio_flash_XXXXXX";
+	tSources s;
+	tOutputs o;
+	int fd, i;
+	FILE *f;
+
+	fd = mkstemp(path);
+	CHECK(fd >= 0);
+	close(fd);
+	unlink(path);
+	CHECK(hal_flash_file(path));
+
+	// Nothing saved: boots empty, quietly
+	reboot();
+	CHECK(Sources->entries == 0);
+	CHECK(!output_has("Configuration"));
+	cmd("load");
+	CHECK(output_has("WARN No configuration saved"));
+
+	configure();
+	// Not for the group of A
+	CHECK(output_has("ERROR Sources in a group cannot use the swinging door"));
+	memcpy(&s, Sources, sizeof(s));
+	memcpy(&o, Outputs, sizeof(o));
+	CHECK(s.entries == 3 && o.entries == 3);
+	CHECK(o.out[0].mod[MOD_RATE].shape == MOD_OUTPUT && o.out[0].mod[MOD_RATE].idx == 1);
+	CHECK(o.out[1].mod[MOD_AMP].shape == MOD_LOG);
+	cmd("save");
+	output_has("");
+
+	// Restored at boot, from the file
+	CHECK(hal_flash_file(path));
+	reboot();
+	CHECK(output_has("INFO Configuration loaded"));
+	CHECK(Sources->entries == s.entries);
+	for (i = 0; i < s.entries; i++)
+		CHECK(same_source(&Sources->s[i], &s.s[i]));
+	CHECK(Outputs->entries == o.entries);
+	for (i = 0; i < o.entries; i++)
+		CHECK(same_output(&Outputs->out[i], &o.out[i]));
+	CHECK(Master.started);
+	CHECK(stream_mode == 1);
+	CHECK(PinModes[30] == 2);
+	CHECK(Backpressure.high == 40 && Backpressure.low == 10);
+	CHECK(Budget.limit == 70 && Budget.mode == 1);
+	CHECK(hal_irq(30));
+
+	// And it runs: the timer ticks, outputs are written
+	CHECK(hal_advance(10000) > 0);
+	CHECK(hal_writes() > 0);
+	CHECK((PIOC->PIO_ODSR & 0x1fe) != 0);
+
+	// A damaged image is not used
+	f = fopen(path, "r+b");
+	CHECK(f != NULL);
+	if (f) {
+		fseek(f, 20, SEEK_SET);
+		fputc(fgetc(f) ^ 0x40, f);
+		fclose(f);
+	}
+	CHECK(hal_flash_file(path));
+	reboot();
+	CHECK(output_has("ERROR Saved configuration is damaged"));
+	CHECK(Sources->entries == 0 && Outputs->entries == 0);
+	CHECK(!Master.started);
+
+	// Rejected on load: the running configuration goes on
+	configure();
+	cmd("budget 1 2");
+	cmd("backpressure 30 5");
+	cmd("pin D52 2");
+	cmd("save");
+	cmd("budget 70 1");
+	cmd("backpressure 40 10");
+	cmd("pin D52 0");
+	output_has("");
+	cmd("load");
+	CHECK(output_has("ERROR Configuration rejected"));
+	CHECK(Master.started && Outputs->entries == 3);
+	CHECK(Budget.limit == 70 && Budget.mode == 1);
+	CHECK(Backpressure.high == 40 && Backpressure.low == 10);
+	CHECK(PinModes[52] == 1);
+
+	// Erased, it boots empty again
+	configure();
+	cmd("save");
+	cmd("erase");
+	reboot();
+	CHECK(Sources->entries == 0);
+	CHECK(!output_has("Configuration"));
+
+	unlink(path);
+	return check_done();
+}
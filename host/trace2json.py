@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Converts the output of trace_dump into the Chrome trace event format,
+# which chrome://tracing and ui.perfetto.dev can show as a timeline.
+# Everything in the capture that is not a trace frame is skipped.
+#
+#	trace2json.py [capture] > trace.json
+
+import json
+import sys
+
+FRAME_SYNC = 0xA5
+FRAME_TRACE = 0x08
+
+# Must match the enum in Trace.h; interrupt context events go on their
+# own track
+EVENTS = [("tick", 1), ("irq", 1), ("push", 1), ("drop", 1),
+          ("drain", 0), ("flush", 0), ("command", 0)]
+TRACKS = {0: "loop", 1: "interrupts"}
+
+
+def varint(buf, i):
+    v = shift = 0
+    while True:
+        b = buf[i]
+        i += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, i
+
+
+def fletcher(data):
+    s1 = s2 = 0
+    for b in data:
+        s1 = (s1 + b) % 255
+        s2 = (s2 + s1) % 255
+    return bytes([s1, s2])
+
+
+def frames(buf):
+    i = 0
+    while i + 4 <= len(buf):
+        if buf[i] != FRAME_SYNC:
+            j = buf.find(b"\n", i)
+            if j < 0:
+                return
+            i = j + 1
+            continue
+        n = buf[i + 2] | buf[i + 3] << 8
+        end = i + 4 + n + 2
+        if end > len(buf):
+            return
+        if fletcher(buf[i + 1:i + 4 + n]) == buf[i + 4 + n:end]:
+            yield buf[i + 1], buf[i + 4:i + 4 + n]
+        i = end
+
+
+def main():
+    f = open(sys.argv[1], "rb") if len(sys.argv) > 1 else sys.stdin.buffer
+    out = []
+    last = None
+    base = 0
+    for ftype, p in frames(f.read()):
+        if ftype != FRAME_TRACE:
+            continue
+        mhz, i = varint(p, 0)
+        while i < len(p):
+            ev, phase, arg = p[i], chr(p[i + 1]), p[i + 2]
+            cycles, i = varint(p, i + 3)
+            # The cycle counter is 32 bit; events are in order, so
+            # going backwards means it wrapped
+            if last is not None and cycles < last:
+                base += 1 << 32
+            last = cycles
+            name, tid = EVENTS[ev] if ev < len(EVENTS) else ("ev%d" % ev, 0)
+            e = {"name": name, "ph": phase, "ts": (base + cycles) / mhz,
+                 "pid": 0, "tid": tid, "args": {"arg": arg}}
+            if phase == "i":
+                e["s"] = "t"
+            out.append(e)
+
+    for tid, name in TRACKS.items():
+        out.append({"name": "thread_name", "ph": "M", "pid": 0,
+                    "tid": tid, "args": {"name": name}})
+    json.dump({"traceEvents": out, "displayTimeUnit": "ns"}, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2014 Lars Marowsky-Bree <lars@marowsky-bree.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// A virtual GPIO_Platform: the firmware running on the simulated board
+// in host/hal, in real time, with SerialUSB on a pseudo-terminal.
+//
+//   gpio_vdev [--link path] [--signal sine|ramp|noise|flat] [--flash file]
+//
+// The name of the terminal is printed on the first line; --link also
+// puts a symlink to it at path. Analog pins read the chosen signal, a
+// sine of (pin - A0 + 1) Hz by default; digital pins a square wave of
+// (pin + 1) * 10 ms; the ADS1115 channels a 0.1 Hz sine. With --flash,
+// the saved configuration is kept in that file. Runs until killed.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "GPIO_Platform.h"
+#include "Lowlevel.h"
+#include "hal.h"
+
+// From the sketch
+void setup(void);
+void loop(void);
+
+// How long a write may wait for the host to read, before the data is
+// thrown away as if nobody was listening
+#define VDEV_WRITE_TIMEOUT 100
+
+static int Pty = -1;
+static volatile sig_atomic_t Quit;
+static unsigned long TxLost;
+
+static enum { SIG_SINE, SIG_RAMP, SIG_NOISE, SIG_FLAT } Signal;
+
+static unsigned long long wall_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int signal_analog(int n, unsigned long long now) {
+	double s = now / 1e6;
+
+	switch (Signal) {
+	case SIG_RAMP:
+		return (now / 100 + n * 256) & 4095;
+	case SIG_NOISE:
+		return 2048 + rand() % 201 - 100;
+	case SIG_FLAT:
+		return 2048;
+	default:
+		return 2048 + 2047 * sin(2 * PI * (n + 1) * s);
+	}
+}
+
+static int signal_read(int pin, unsigned long long now) {
+	if (pin >= ANALOG_MIN && pin <= ANALOG_MAX)
+		return signal_analog(pin - ANALOG_MIN, now);
+	if (pin >= HAL_ADS1115_PIN)
+		return 16000 * sin(2 * PI * 0.1 * now / 1e6);
+	return (now / ((pin + 1) * 10000)) & 1;
+}
+
+static void pty_write(const uint8_t *buf, size_t n) {
+	while (n > 0) {
+		struct pollfd p = { Pty, POLLOUT, 0 };
+		ssize_t w = write(Pty, buf, n);
+
+		if (w > 0) {
+			buf += w;
+			n -= w;
+			continue;
+		}
+		if (w < 0 && errno != EAGAIN && errno != EINTR)
+			break;
+		if (poll(&p, 1, VDEV_WRITE_TIMEOUT) == 0)
+			break;
+	}
+	TxLost += n;
+}
+
+static size_t pty_read(void) {
+	uint8_t buf[256];
+	ssize_t n = read(Pty, buf, sizeof(buf));
+
+	if (n <= 0)
+		return 0;
+	hal_serial_input(buf, n);
+	return n;
+}
+
+// The slave end is kept open, so the master stays usable while no host
+// is attached, and raw, so nothing is echoed or translated
+static int pty_open(const char *link) {
+	struct termios tio;
+	const char *name;
+	int slave;
+
+	Pty = posix_openpt(O_RDWR | O_NOCTTY);
+	if (Pty < 0 || grantpt(Pty) || unlockpt(Pty) || !(name = ptsname(Pty))) {
+		perror("pty");
+		return -1;
+	}
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tio)) {
+		perror(name);
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	fcntl(Pty, F_SETFL, O_NONBLOCK);
+
+	if (link) {
+		unlink(link);
+		if (symlink(name, link)) {
+			perror(link);
+			return -1;
+		}
+	}
+	printf("%s\n", name);
+	fflush(stdout);
+	return 0;
+}
+
+static void quit(int) {
+	Quit = 1;
+}
+
+int main(int argc, char **argv) {
+	const char *link = NULL;
+	const char *flash = NULL;
+	unsigned long long start;
+	int a;
+
+	for (a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "--link") && a + 1 < argc) {
+			link = argv[++a];
+		} else if (!strcmp(argv[a], "--flash") && a + 1 < argc) {
+			flash = argv[++a];
+		} else if (!strcmp(argv[a], "--signal") && a + 1 < argc) {
+			a++;
+			if (!strcmp(argv[a], "sine"))
+				Signal = SIG_SINE;
+			else if (!strcmp(argv[a], "ramp"))
+				Signal = SIG_RAMP;
+			else if (!strcmp(argv[a], "noise"))
+				Signal = SIG_NOISE;
+			else if (!strcmp(argv[a], "flat"))
+				Signal = SIG_FLAT;
+			else
+				break;
+		} else {
+			break;
+		}
+	}
+	if (a < argc) {
+		fprintf(stderr, "usage: %s [--link path] "
+			"[--signal sine|ramp|noise|flat] [--flash file]\n",
+			argv[0]);
+		return 2;
+	}
+
+	if (flash && !hal_flash_file(flash)) {
+		perror(flash);
+		return 1;
+	}
+	if (pty_open(link))
+		return 1;
+	signal(SIGINT, quit);
+	signal(SIGTERM, quit);
+
+	hal_reset();
+	hal_reader(signal_read);
+	hal_serial_sink(pty_write);
+	setup();
+
+	// The board time follows the wall clock. If the process falls
+	// behind, the missed timer ticks run back to back, and loop()
+	// has to catch up, like after an overload on the real thing.
+	start = wall_us();
+	while (!Quit) {
+		unsigned long ticks;
+		size_t in;
+
+		ticks = hal_advance(wall_us() - start - hal_now());
+		in = pty_read();
+		loop();
+		if (!ticks && !in)
+			usleep(20);
+	}
+
+	if (link)
+		unlink(link);
+	if (TxLost)
+		fprintf(stderr, "%lu bytes not read by the host\n", TxLost);
+	return 0;
+}